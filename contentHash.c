@@ -0,0 +1,230 @@
+/* XXH64 over whole files, used to find byte identical inputs, and the byte 
+ * comparison that confirms them. Files are mapped where possible, otherwise 
+ * read whole. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h> /* memcmp */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_HASH_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* POSIX */
+
+#include "readAhead.h" /* readWholeFile */
+#include "contentHash.h"
+
+#define DIF_XXH_PRIME1 (0x9E3779B185EBCA87ULL)
+#define DIF_XXH_PRIME2 (0xC2B2AE3D27D4EB4FULL)
+#define DIF_XXH_PRIME3 (0x165667B19E3779F9ULL)
+#define DIF_XXH_PRIME4 (0x85EBCA77C2B2AE63ULL)
+#define DIF_XXH_PRIME5 (0x27D4EB2F165667C5ULL)
+
+#define DIF_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Byte at a time so alignment and host endianness don't matter */
+static uint64_t readLE64(const unsigned char * const p)
+{
+	return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) 
+		| ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+		| ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+		| ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static uint64_t readLE32(const unsigned char * const p)
+{
+	return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) 
+		| ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24);
+}
+
+static uint64_t xxhRound(uint64_t acc, const uint64_t input)
+{
+	acc += input * DIF_XXH_PRIME2;
+	acc = DIF_ROTL64(acc, 31);
+
+	return acc * DIF_XXH_PRIME1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, const uint64_t val)
+{
+	acc ^= xxhRound(0, val);
+
+	return (acc * DIF_XXH_PRIME1) + DIF_XXH_PRIME4;
+}
+
+uint64_t contentHash64(const unsigned char * const data, const size_t len,
+	const uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char * const end = data + len;
+	uint64_t hash;
+
+	if (len >= 32)
+	{
+		const unsigned char * const limit = end - 32;
+		uint64_t v1 = seed + DIF_XXH_PRIME1 + DIF_XXH_PRIME2;
+		uint64_t v2 = seed + DIF_XXH_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - DIF_XXH_PRIME1;
+
+		do
+		{
+			v1 = xxhRound(v1, readLE64(p));
+			v2 = xxhRound(v2, readLE64(p + 8));
+			v3 = xxhRound(v3, readLE64(p + 16));
+			v4 = xxhRound(v4, readLE64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		hash = DIF_ROTL64(v1, 1) + DIF_ROTL64(v2, 7) 
+			+ DIF_ROTL64(v3, 12) + DIF_ROTL64(v4, 18);
+		hash = xxhMerge(hash, v1);
+		hash = xxhMerge(hash, v2);
+		hash = xxhMerge(hash, v3);
+		hash = xxhMerge(hash, v4);
+	}
+	else
+	{
+		hash = seed + DIF_XXH_PRIME5;
+	}
+
+	hash += (uint64_t) len;
+
+	while (end - p >= 8)
+	{
+		hash ^= xxhRound(0, readLE64(p));
+		hash = (DIF_ROTL64(hash, 27) * DIF_XXH_PRIME1) + DIF_XXH_PRIME4;
+		p += 8;
+	}
+
+	if (end - p >= 4)
+	{
+		hash ^= readLE32(p) * DIF_XXH_PRIME1;
+		hash = (DIF_ROTL64(hash, 23) * DIF_XXH_PRIME2) + DIF_XXH_PRIME3;
+		p += 4;
+	}
+
+	while (p < end)
+	{
+		hash ^= (*p++) * DIF_XXH_PRIME5;
+		hash = DIF_ROTL64(hash, 11) * DIF_XXH_PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= DIF_XXH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= DIF_XXH_PRIME3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/* A whole file, mapped where possible and otherwise read into memory */
+struct contentView
+{
+	unsigned char *data;
+	size_t len;
+	int mapped;
+};
+
+static int contentOpen(const char * const path, 
+	struct contentView * const view)
+{
+#ifdef DIF_HASH_MMAP
+	struct stat info;
+	void *map;
+	int fd;
+#endif /* DIF_HASH_MMAP */
+
+	view->data = NULL;
+	view->len = 0;
+	view->mapped = 0;
+
+#ifdef DIF_HASH_MMAP
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		return -1;
+	}
+
+	if ((fstat(fd, &info) == 0) && (info.st_size > 0)
+	&& ((map = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, 
+		fd, 0)) != MAP_FAILED))
+	{
+		(void) madvise(map, (size_t) info.st_size, MADV_SEQUENTIAL);
+		close(fd);
+		view->data = map;
+		view->len = (size_t) info.st_size;
+		view->mapped = 1;
+
+		return 0;
+	}
+
+	close(fd);
+#endif /* DIF_HASH_MMAP */
+
+	return readWholeFile(path, &view->data, &view->len);
+}
+
+static void contentClose(struct contentView * const view)
+{
+#ifdef DIF_HASH_MMAP
+	if (view->mapped)
+	{
+		munmap(view->data, view->len);
+	}
+	else
+#endif /* DIF_HASH_MMAP */
+	{
+		free(view->data);
+	}
+
+	view->data = NULL;
+	view->len = 0;
+	view->mapped = 0;
+}
+
+int contentHashFile(const char * const path, uint64_t * const hash,
+	uint64_t * const len)
+{
+	struct contentView view;
+
+	if (contentOpen(path, &view) != 0)
+	{
+		return -1;
+	}
+
+	*hash = contentHash64(view.data, view.len, 0);
+	*len = (uint64_t) view.len;
+	contentClose(&view);
+
+	return 0;
+}
+
+int contentHashEqual(const char * const left, const char * const right)
+{
+	struct contentView left_view, right_view;
+	int same;
+
+	if (contentOpen(left, &left_view) != 0)
+	{
+		return 0;
+	}
+
+	if (contentOpen(right, &right_view) != 0)
+	{
+		contentClose(&left_view);
+
+		return 0;
+	}
+
+	same = (left_view.len == right_view.len) 
+		&& (memcmp(left_view.data, right_view.data, left_view.len) 
+			== 0);
+	contentClose(&left_view);
+	contentClose(&right_view);
+
+	return same;
+}
@@ -0,0 +1,20 @@
+#ifndef DIF_CONTENT_HASH_H
+#define DIF_CONTENT_HASH_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+
+/* XXH64 as specified by xxHash, so digests match other implementations */
+uint64_t contentHash64(const unsigned char * const data, const size_t len,
+	const uint64_t seed);
+
+/* Hashes a whole file, mapped where possible. Returns -1 if it can't be read,
+ * len is set to the number of bytes hashed. */
+int contentHashFile(const char * const path, uint64_t * const hash,
+	uint64_t * const len);
+
+/* Whether two files are byte for byte the same, which a matching hash only 
+ * makes all but certain. 0 if either can't be read. */
+int contentHashEqual(const char * const left, const char * const right);
+
+#endif /* DIF_CONTENT_HASH_H */
@@ -0,0 +1,327 @@
+/* How many CPUs the process can actually keep busy, and pinning threads to
+ * them. The affinity mask gives the CPUs the process may be scheduled on, a
+ * cgroup CPU quota then limits how much of them it may use. A container
+ * allowed two CPUs on a 64 core host counts as two, so pools sized from it
+ * don't spend their time being throttled. Both cgroup v2 and the v1 cpu
+ * controller are read, every level up to the root since a parent's quota
+ * bounds its children too. Built with DIF_USE_NUMA the NUMA nodes are found
+ * through libnuma, without it everything is taken to be on one node. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* sched_getaffinity, sched_getcpu, CPU_COUNT... */
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h> /* strlen, strchr, strrchr, strncmp */
+
+#if defined(__linux__)
+#define DIF_CPU_LINUX
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef DIF_USE_NUMA
+#define DIF_CPU_NUMA
+#include <numa.h>
+#endif /* DIF_USE_NUMA */
+#elif defined(__unix__) || defined(__APPLE__)
+#define DIF_CPU_POSIX
+#include <unistd.h>
+#endif /* __linux__ */
+
+#include "cpuSet.h"
+
+/* Where the cgroup hierarchies are mounted, the v1 cpu controller below it */
+#ifndef DIF_CGROUP_ROOT
+#define DIF_CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+
+#define DIF_CGROUP_PATH_MAX (4096)
+
+#ifdef DIF_CPU_LINUX
+/* CPUs needed to run quota out of every period, 0 if unlimited or unknown */
+static size_t quotaCpus(const long long quota, const long long period)
+{
+	if ((quota <= 0) || (period <= 0))
+	{
+		return 0;
+	}
+
+	return (size_t) ((quota + period - 1) / period);
+}
+
+static int readLine(const char * const dir, const char * const name,
+	char * const line, const size_t len)
+{
+	char path[DIF_CGROUP_PATH_MAX];
+	FILE *file;
+	int ret = -1;
+
+	if (((size_t) snprintf(path, sizeof(path), "%s/%s", dir, name)
+		>= sizeof(path)) || ((file = fopen(path, "r")) == NULL))
+	{
+		return -1;
+	}
+
+	if (fgets(line, (int) len, file) != NULL)
+	{
+		ret = 0;
+	}
+
+	fclose(file);
+
+	return ret;
+}
+
+/* cpu.max holds the quota, or "max", followed by the period */
+static size_t cgroup2Cpus(const char * const dir)
+{
+	char line[128];
+	long long quota, period;
+
+	if ((readLine(dir, "cpu.max", line, sizeof(line)) != 0)
+	|| (sscanf(line, "%lld %lld", &quota, &period) != 2))
+	{
+		return 0;
+	}
+
+	return quotaCpus(quota, period);
+}
+
+/* An unlimited quota is -1 */
+static size_t cgroup1Cpus(const char * const dir)
+{
+	char line[128];
+	long long quota, period;
+
+	if ((readLine(dir, "cpu.cfs_quota_us", line, sizeof(line)) != 0)
+	|| (sscanf(line, "%lld", &quota) != 1)
+	|| (readLine(dir, "cpu.cfs_period_us", line, sizeof(line)) != 0)
+	|| (sscanf(line, "%lld", &period) != 1))
+	{
+		return 0;
+	}
+
+	return quotaCpus(quota, period);
+}
+
+/* The tightest quota from the group itself up to the mount root, 0 if none.
+ * Inside a cgroup namespace the group is the root and the rest is skipped. */
+static size_t cgroupTreeCpus(const char * const mount, const char *group,
+	size_t (*read)(const char * const dir))
+{
+	char dir[DIF_CGROUP_PATH_MAX];
+	const size_t root_len = strlen(mount);
+	size_t len, cpus, limit = 0;
+	char *cut;
+
+	if ((size_t) snprintf(dir, sizeof(dir), "%s%s", mount, group)
+		>= sizeof(dir))
+	{
+		return 0;
+	}
+
+	for (len = strlen(dir); (len > root_len) && (dir[len - 1] == '/');
+		len--)
+	{
+		dir[len - 1] = '\0';
+	}
+
+	for (;;)
+	{
+		cpus = read(dir);
+
+		if ((cpus != 0) && ((limit == 0) || (cpus < limit)))
+		{
+			limit = cpus;
+		}
+
+		if ((strlen(dir) <= root_len)
+		|| ((cut = strrchr(dir + root_len, '/')) == NULL))
+		{
+			break;
+		}
+
+		*cut = '\0';
+	}
+
+	return limit;
+}
+
+/* Whether the comma separated controller list names cpu */
+static int hasCpuController(const char *list, const char * const end)
+{
+	while (list < end)
+	{
+		const char *next = memchr(list, ',', (size_t) (end - list));
+
+		if (next == NULL)
+		{
+			next = end;
+		}
+
+		if (((next - list) == 3) && (strncmp(list, "cpu", 3) == 0))
+		{
+			return 1;
+		}
+
+		list = next + 1;
+	}
+
+	return 0;
+}
+
+/* Lines of /proc/self/cgroup are id:controllers:path, v2 being the one with
+ * no controllers listed */
+static size_t cgroupCpus(void)
+{
+	char line[DIF_CGROUP_PATH_MAX];
+	size_t cpus, limit = 0;
+	FILE *file;
+
+	if ((file = fopen("/proc/self/cgroup", "r")) == NULL)
+	{
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char * const controllers = strchr(line, ':');
+		char *group, *end;
+
+		if ((controllers == NULL)
+		|| ((group = strchr(controllers + 1, ':')) == NULL))
+		{
+			continue;
+		}
+
+		if ((end = strchr(group, '\n')) != NULL)
+		{
+			*end = '\0';
+		}
+
+		if (group == controllers + 1)
+		{
+			cpus = cgroupTreeCpus(DIF_CGROUP_ROOT, group + 1,
+				cgroup2Cpus);
+		}
+		else if (hasCpuController(controllers + 1, group))
+		{
+			cpus = cgroupTreeCpus(DIF_CGROUP_ROOT "/cpu",
+				group + 1, cgroup1Cpus);
+		}
+		else
+		{
+			continue;
+		}
+
+		if ((cpus != 0) && ((limit == 0) || (cpus < limit)))
+		{
+			limit = cpus;
+		}
+	}
+
+	fclose(file);
+
+	return limit;
+}
+#endif /* DIF_CPU_LINUX */
+
+size_t cpuSetCount(void)
+{
+	size_t count = 0;
+#ifdef DIF_CPU_LINUX
+	cpu_set_t set;
+	size_t quota;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		count = (size_t) CPU_COUNT(&set);
+	}
+	else
+	{
+		const long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+		count = (online > 0) ? (size_t) online : 1;
+	}
+
+	if (((quota = cgroupCpus()) != 0) && (quota < count))
+	{
+		count = quota;
+	}
+#elif defined(DIF_CPU_POSIX)
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+	count = (online > 0) ? (size_t) online : 1;
+#endif /* DIF_CPU_LINUX */
+
+	return (count == 0) ? 1 : count;
+}
+
+size_t cpuSetNodes(void)
+{
+#ifdef DIF_CPU_NUMA
+	if ((numa_available() < 0) || (numa_max_node() < 0))
+	{
+		return 1;
+	}
+
+	return (size_t) numa_max_node() + 1;
+#else
+	return 1;
+#endif /* DIF_CPU_NUMA */
+}
+
+size_t cpuSetNode(void)
+{
+#ifdef DIF_CPU_NUMA
+	int cpu, node;
+
+	if ((numa_available() < 0) || ((cpu = sched_getcpu()) < 0)
+	|| ((node = numa_node_of_cpu(cpu)) < 0))
+	{
+		return 0;
+	}
+
+	return (size_t) node;
+#else
+	return 0;
+#endif /* DIF_CPU_NUMA */
+}
+
+#ifndef DIF_DISABLE_THREADING
+int cpuSetPinThread(const pthread_t thread, const size_t index)
+{
+#ifdef DIF_CPU_LINUX
+	cpu_set_t allowed, pinned;
+	size_t count, skip, cpu;
+
+	if ((sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	|| ((count = (size_t) CPU_COUNT(&allowed)) == 0))
+	{
+		return -1;
+	}
+
+	skip = index % count;
+
+	for (cpu = 0; cpu < (size_t) CPU_SETSIZE; cpu++)
+	{
+		if ((CPU_ISSET(cpu, &allowed)) && (skip-- == 0))
+		{
+			break;
+		}
+	}
+
+	CPU_ZERO(&pinned);
+	CPU_SET(cpu, &pinned);
+
+	return (pthread_setaffinity_np(thread, sizeof(pinned), &pinned) == 0)
+		? 0 : -1;
+#else
+	(void) thread;
+	(void) index;
+
+	return -1;
+#endif /* DIF_CPU_LINUX */
+}
+#endif /* !DIF_DISABLE_THREADING */
@@ -0,0 +1,26 @@
+#ifndef DIF_CPU_SET_H
+#define DIF_CPU_SET_H
+
+#include <stddef.h> /* size_t */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#endif /* !DIF_DISABLE_THREADING */
+
+/* CPUs the process may run on, capped by its cgroup's CPU quota, at least 1 */
+size_t cpuSetCount(void);
+
+/* NUMA nodes memory may be placed on, 1 unless built with DIF_USE_NUMA */
+size_t cpuSetNodes(void);
+
+/* The node the calling thread is running on at the moment, from 0 to below
+ * cpuSetNodes, it may have moved on by the time it's used */
+size_t cpuSetNode(void);
+
+#ifndef DIF_DISABLE_THREADING
+/* Pins the thread to the index-th CPU it may run on, wrapping around when
+ * there are fewer, returns -1 if pinning isn't supported or failed */
+int cpuSetPinThread(const pthread_t thread, const size_t index);
+#endif /* !DIF_DISABLE_THREADING */
+
+#endif /* DIF_CPU_SET_H */
@@ -0,0 +1,739 @@
+/* Fingerprinting and all pairs matching, the core of libdif. The image
+ * decoding and reduction is left to imageHandling, which has to be set up with
+ * difInit before any print is taken. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h> /* memcpy */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#include "thirdparty/macroThreadPool.h"
+
+#ifdef DIF_USE_NUMA
+#define DIF_NUMA
+#include <numa.h>
+#endif /* DIF_USE_NUMA */
+#endif /* !DIF_DISABLE_THREADING */
+
+#include "imageHandling.h"
+#include "hammingIndex.h"
+#include "cpuSet.h"
+#include "dif.h"
+
+/* The pool only runs ParallelFor helpers, a couple per thread at most */
+#define DIF_BATCH_RING_PER_THREAD (2)
+
+/* Slots a thread claims at a time when comparing in parallel, enough for the
+ * pairs found by a range to be worth a list of their own */
+#define DIF_COMPARE_GRAIN (256)
+
+/* The density of a print is how many of its bits are set. Two prints further
+ * apart in density than the threshold can't be within it of one another, so
+ * sorted by density each print only needs comparing against a window. */
+struct difCompareSlot
+{
+	uint64_t print;
+	size_t index;
+	unsigned int density;
+};
+
+struct difPool
+{
+	size_t threads;
+#ifndef DIF_DISABLE_THREADING
+	struct difBatchThreadPool *pool;
+#endif /* !DIF_DISABLE_THREADING */
+};
+
+struct difBatch
+{
+	const struct difBuffer *buffers;
+	unsigned int flags;
+	uint64_t *prints;
+	int *results;
+};
+
+/* A pair found by a range of a parallel compare, held until the ranges
+ * before it are reported */
+struct difPair
+{
+	size_t left;
+	size_t right;
+	unsigned int distance;
+};
+
+struct difPairList
+{
+	struct difPair *pairs;
+	size_t len;
+	size_t cap;
+	int failed;
+};
+
+struct difCompareRanges
+{
+	const struct difCompareSlot *slots;
+	struct difCompareSlot **replicas; /* One per node, or one interleaved */
+	size_t nodes;
+	unsigned int threshold;
+	struct difPairList *lists; /* One per DIF_COMPARE_GRAIN slots */
+};
+
+#ifndef DIF_DISABLE_THREADING
+/* Everything is handed out through ParallelFor, nothing is queued as a job */
+static void difBatchFunction(int job);
+
+MACRO_THREAD_POOL_COMPLETE(difBatch, int, difBatchFunction);
+
+static void difBatchFunction(int job)
+{
+	(void) job;
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+void difInit(const struct difImageConfig * const config)
+{
+	initializeImageHandling(config);
+}
+
+void difCleanup(void)
+{
+	cleanupImageHandling();
+}
+
+static uint64_t printFromCells(const unsigned char * const cells)
+{
+	uint64_t mean = 0;
+	uint64_t print = 0;
+	size_t i;
+
+	for (i = 0; i < DIF_PRINT_BITS; i++)
+	{
+		mean += cells[i];
+	}
+
+	mean /= DIF_PRINT_BITS;
+
+	for (i = 0; i < DIF_PRINT_BITS; i++)
+	{
+		/* casting here is important as otherwise it tries to use an
+		 * int for the mask */
+		if (cells[i] > mean)
+		{
+			print |= (((uint64_t) 1) << i);
+		}
+	}
+
+	return print;
+}
+
+/* flags are the DIF_READ_* accepted by readImageFile */
+int difFingerprintFile(const char * const path, const unsigned int flags,
+	uint64_t * const print)
+{
+	unsigned char cells[DIF_PRINT_BITS];
+	int loaded;
+
+	if ((path == NULL) || (print == NULL))
+	{
+		return -1;
+	}
+
+	if ((loaded = readImageFile(path, DIF_PRINT_WIDTH, DIF_PRINT_HEIGHT,
+		cells, flags)) < 0)
+	{
+		return (loaded == DIF_DEFERRED) ? DIF_DEFERRED : -1;
+	}
+
+	*print = printFromCells(cells);
+
+	return loaded;
+}
+
+/* data is an encoded image, left untouched and still owned by the caller */
+int difFingerprintMemory(const void * const data, const size_t len,
+	const unsigned int flags, uint64_t * const print)
+{
+	unsigned char cells[DIF_PRINT_BITS];
+	int loaded;
+
+	if ((data == NULL) || (print == NULL))
+	{
+		return -1;
+	}
+
+	if ((loaded = readImageMemory((const unsigned char *) data, len,
+		DIF_PRINT_WIDTH, DIF_PRINT_HEIGHT, cells, flags)) < 0)
+	{
+		return (loaded == DIF_DEFERRED) ? DIF_DEFERRED : -1;
+	}
+
+	*print = printFromCells(cells);
+
+	return loaded;
+}
+
+static void fingerprintRange(void *ctx, const size_t begin, const size_t end)
+{
+	const struct difBatch * const batch = (const struct difBatch *) ctx;
+	size_t i;
+
+	for (i = begin; i < end; i++)
+	{
+		batch->results[i] = difFingerprintMemory(batch->buffers[i].data,
+			batch->buffers[i].len, batch->flags, &batch->prints[i]);
+	}
+}
+
+/* Runs func over [0, len) in ranges of grain, on the pool when there is one
+ * and on the calling thread alone otherwise */
+static void poolFor(struct difPool * const pool, const size_t len,
+	const size_t grain, void (*func)(void *, size_t, size_t), void *ctx)
+{
+	size_t i;
+
+#ifndef DIF_DISABLE_THREADING
+	if ((pool != NULL) && (pool->pool != NULL))
+	{
+		difBatchParallelFor(pool->pool, 0, len, grain, func, ctx);
+
+		return;
+	}
+#else
+	(void) pool;
+#endif /* DIF_DISABLE_THREADING */
+
+	for (i = 0; i < len; i += grain)
+	{
+		func(ctx, i, ((len - i) < grain) ? len : i + grain);
+	}
+}
+
+/* Fingerprints every buffer, results[i] being what difFingerprintMemory gave
+ * for buffers[i] and prints[i] only set where that wasn't negative. The 
+ * calling thread fingerprints buffers alongside the pool's, or alone without 
+ * one. A pool may be shared by several callers, the buffers are never copied.
+ * The pool's threads never wait on the memory budget, what they are turned 
+ * away from is left to the calling thread once they are done, unless flags 
+ * has DIF_READ_DEFER and it is left as DIF_DEFERRED for the caller. */
+void difFingerprintBatch(struct difPool *pool,
+	const struct difBuffer * const buffers, const size_t count,
+	const unsigned int flags, uint64_t * const prints, int * const results)
+{
+	struct difBatch batch;
+	size_t i;
+
+	if ((buffers == NULL) || (prints == NULL) || (results == NULL))
+	{
+		return;
+	}
+
+	batch.buffers = buffers;
+	batch.flags = flags | DIF_READ_DEFER;
+	batch.prints = prints;
+	batch.results = results;
+	poolFor(pool, count, 1, fingerprintRange, &batch);
+
+	for (i = 0; ((flags & DIF_READ_DEFER) == 0) && (i < count); i++)
+	{
+		if (results[i] == DIF_DEFERRED)
+		{
+			results[i] = difFingerprintMemory(buffers[i].data,
+				buffers[i].len, flags, &prints[i]);
+		}
+	}
+}
+
+unsigned long difBudgetReleases(void)
+{
+	return imageBudgetReleases();
+}
+
+/* The config given to difInit should count these threads among its workers.
+ * Without threading support, or with threads as 0, everything runs on the
+ * calling thread. */
+struct difPool* difPoolNew(const size_t threads)
+{
+	struct difPool *pool;
+
+	if ((pool = calloc(1, sizeof(struct difPool))) == NULL)
+	{
+		return NULL;
+	}
+
+	pool->threads = threads;
+
+#ifndef DIF_DISABLE_THREADING
+	if ((threads != 0) && ((pool->pool = difBatchNewThreadPool(threads,
+		DIF_BATCH_RING_PER_THREAD * threads)) == NULL))
+	{
+		free(pool);
+
+		return NULL;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	return pool;
+}
+
+void difPoolFree(struct difPool *pool)
+{
+	if (pool == NULL)
+	{
+		return;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	difBatchCleanupThreadPool(pool->pool);
+#endif /* !DIF_DISABLE_THREADING */
+
+	free(pool);
+}
+
+/* Pins each thread of the pool to a CPU of its own where there are enough,
+ * returns -1 if any of them couldn't be */
+int difPoolPin(struct difPool *pool)
+{
+	int ret = 0;
+#ifndef DIF_DISABLE_THREADING
+	size_t i;
+
+	if ((pool == NULL) || (pool->pool == NULL))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < pool->pool->num_threads; i++)
+	{
+		if (cpuSetPinThread(pool->pool->threads[i], i) != 0)
+		{
+			ret = -1;
+		}
+	}
+#else
+	(void) pool;
+#endif /* !DIF_DISABLE_THREADING */
+
+	return ret;
+}
+
+/* pixels is a decoded frame still owned by the caller, its rows starting
+ * stride bytes apart, or packed when stride is 0, and laid out as one of 
+ * DIF_PIXELS_*. Nothing is decoded or copied beyond a row of luma. */
+int difFingerprintPixels(const unsigned char * const pixels,
+	const size_t width, const size_t height, const size_t stride,
+	const int layout, uint64_t * const print)
+{
+	unsigned char cells[DIF_PRINT_BITS];
+
+	if ((print == NULL) || (reduceImagePixels(pixels, width, height,
+		stride, layout, DIF_PRINT_WIDTH, DIF_PRINT_HEIGHT, cells) != 0))
+	{
+		return -1;
+	}
+
+	*print = printFromCells(cells);
+
+	return DIF_LOADED_FULL;
+}
+
+unsigned int difDensity(const uint64_t print)
+{
+	uint64_t val = print;
+
+	val = val - ((val >> 1) & 0x5555555555555555ULL);
+	val = (val & 0x3333333333333333ULL)
+		+ ((val >> 2) & 0x3333333333333333ULL);
+	val = (val + (val >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (unsigned int) ((val * 0x0101010101010101ULL) >> 56);
+}
+
+unsigned int difDistance(const uint64_t left, const uint64_t right)
+{
+	return difDensity(left ^ right);
+}
+
+static int compareSlots(const void * const l_ptr, const void * const r_ptr)
+{
+	const struct difCompareSlot * const left
+		= (const struct difCompareSlot *) l_ptr;
+	const struct difCompareSlot * const right
+		= (const struct difCompareSlot *) r_ptr;
+
+	if (left->density != right->density)
+	{
+		return (left->density < right->density) ? -1 : 1;
+	}
+
+	return (left->index > right->index) - (left->index < right->index);
+}
+
+/* First slot with at least the given density, len if there is none */
+static size_t densityBound(const struct difCompareSlot * const slots,
+	const size_t len, const unsigned int density)
+{
+	size_t left = 0;
+	size_t right = len;
+
+	while (left < right)
+	{
+		const size_t mid = ((left + right) >> 1);
+
+		if (slots[mid].density < density)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+struct difSlotFill
+{
+	const uint64_t *prints;
+	struct difCompareSlot *slots;
+};
+
+static void fillSlotRange(void *ctx, const size_t begin, const size_t end)
+{
+	const struct difSlotFill * const fill = (const struct difSlotFill *) ctx;
+	size_t i;
+
+	for (i = begin; i < end; i++)
+	{
+		fill->slots[i].print = fill->prints[i];
+		fill->slots[i].index = i;
+		fill->slots[i].density = difDensity(fill->prints[i]);
+	}
+}
+
+/* The prints sorted by density, NULL if they couldn't be allocated. Filled
+ * over the pool when there is one, so the pages of a large copy are first
+ * touched, and placed, on the nodes its threads run on rather than all on
+ * the caller's. Sorting moves the slots but not the pages. */
+static struct difCompareSlot* sortedSlots(struct difPool * const pool,
+	const uint64_t * const prints, const size_t len)
+{
+	struct difCompareSlot *slots;
+	struct difSlotFill fill;
+
+	if ((slots = malloc(sizeof(struct difCompareSlot)
+		* ((len == 0) ? 1 : len))) == NULL)
+	{
+		return NULL;
+	}
+
+	fill.prints = prints;
+	fill.slots = slots;
+	poolFor(pool, len, DIF_COMPARE_GRAIN, fillSlotRange, &fill);
+
+	qsort(slots, len, sizeof(struct difCompareSlot), compareSlots);
+
+	return slots;
+}
+
+/* Compares each of the slots from begin up to end against those before it */
+static void compareSlotRange(const struct difCompareSlot * const slots,
+	const size_t begin, const size_t end, const unsigned int threshold,
+	difPairFound found, void *ctx)
+{
+	size_t i, j;
+
+	for (i = begin; i < end; i++)
+	{
+		const size_t fnd = densityBound(slots, i,
+			(slots[i].density < threshold)
+				? 0 : slots[i].density - threshold);
+
+		for (j = fnd; j < i; j++)
+		{
+			const unsigned int distance
+				= difDistance(slots[i].print, slots[j].print);
+
+			if (distance <= threshold)
+			{
+				found(ctx, slots[i].index, slots[j].index,
+					distance);
+			}
+		}
+	}
+}
+
+/* Reports every pair of prints within threshold of one another as it's found,
+ * returns -1 if the working copy couldn't be allocated */
+int difCompare(const uint64_t * const prints, const size_t len,
+	const unsigned int threshold, difPairFound found, void *ctx)
+{
+	struct difCompareSlot *slots;
+
+	if ((found == NULL) || ((prints == NULL) && (len != 0)))
+	{
+		return -1;
+	}
+
+	if ((slots = sortedSlots(NULL, prints, len)) == NULL)
+	{
+		return -1;
+	}
+
+	compareSlotRange(slots, 0, len, threshold, found, ctx);
+	free(slots);
+
+	return 0;
+}
+
+static void keepPair(void *ctx, const size_t left, const size_t right,
+	const unsigned int distance)
+{
+	struct difPairList * const list = (struct difPairList *) ctx;
+
+	if (list->failed)
+	{
+		return;
+	}
+
+	if (list->len == list->cap)
+	{
+		const size_t cap = (list->cap == 0) ? 16 : list->cap * 2;
+		struct difPair * const pairs = realloc(list->pairs,
+			sizeof(struct difPair) * cap);
+
+		if (pairs == NULL)
+		{
+			list->failed = 1;
+
+			return;
+		}
+
+		list->pairs = pairs;
+		list->cap = cap;
+	}
+
+	list->pairs[list->len].left = left;
+	list->pairs[list->len].right = right;
+	list->pairs[list->len].distance = distance;
+	list->len++;
+}
+
+static void compareRange(void *ctx, const size_t begin, const size_t end)
+{
+	const struct difCompareRanges * const ranges
+		= (const struct difCompareRanges *) ctx;
+	const struct difCompareSlot *slots = ranges->slots;
+
+	/* Whichever node the range is run on, it reads the copy kept there */
+	if (ranges->nodes > 1)
+	{
+		slots = ranges->replicas[cpuSetNode() % ranges->nodes];
+	}
+	else if (ranges->replicas != NULL)
+	{
+		slots = ranges->replicas[0];
+	}
+
+	compareSlotRange(slots, begin, end, ranges->threshold, keepPair,
+		&ranges->lists[begin / DIF_COMPARE_GRAIN]);
+}
+
+/* Comparing reads the whole window behind every slot, from every thread, so
+ * on more than one node the sorted slots are copied onto each of them and
+ * nothing is read across the interconnect. Should a copy not fit, the pages
+ * of a single one are interleaved over the nodes instead, spreading the load
+ * on their memory. Otherwise the first touch placement is left as it is. */
+static void placeSlots(struct difCompareRanges * const ranges,
+	const size_t len)
+{
+#ifdef DIF_NUMA
+	const size_t size = sizeof(struct difCompareSlot) * len;
+	const size_t nodes = cpuSetNodes();
+	size_t i;
+
+	if ((nodes < 2) || ((ranges->replicas = calloc(nodes,
+		sizeof(struct difCompareSlot *))) == NULL))
+	{
+		return;
+	}
+
+	for (i = 0; i < nodes; i++)
+	{
+		if ((ranges->replicas[i] = numa_alloc_onnode(size, (int) i))
+			== NULL)
+		{
+			break;
+		}
+
+		memcpy(ranges->replicas[i], ranges->slots, size);
+	}
+
+	if (i == nodes)
+	{
+		ranges->nodes = nodes;
+
+		return;
+	}
+
+	while (i-- > 0)
+	{
+		numa_free(ranges->replicas[i], size);
+		ranges->replicas[i] = NULL;
+	}
+
+	if ((ranges->replicas[0] = numa_alloc_interleaved(size)) == NULL)
+	{
+		free(ranges->replicas);
+		ranges->replicas = NULL;
+
+		return;
+	}
+
+	memcpy(ranges->replicas[0], ranges->slots, size);
+#else
+	(void) ranges;
+	(void) len;
+#endif /* DIF_NUMA */
+}
+
+static void freeSlotCopies(struct difCompareRanges * const ranges,
+	const size_t len)
+{
+#ifdef DIF_NUMA
+	const size_t size = sizeof(struct difCompareSlot) * len;
+	size_t i;
+
+	if (ranges->replicas == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < ((ranges->nodes > 1) ? ranges->nodes : 1); i++)
+	{
+		numa_free(ranges->replicas[i], size);
+	}
+
+	free(ranges->replicas);
+#else
+	(void) ranges;
+	(void) len;
+#endif /* DIF_NUMA */
+}
+
+/* As difCompare, reporting the same pairs in the same order and only ever
+ * calling found from the calling thread, but with the slots shared out over
+ * the pool's threads. Each range's pairs are kept until those of the ranges
+ * before it have been reported. Returns -1 if anything couldn't be
+ * allocated, in which case nothing is reported. */
+int difCompareParallel(struct difPool *pool, const uint64_t * const prints,
+	const size_t len, const unsigned int threshold, difPairFound found,
+	void *ctx)
+{
+	struct difCompareRanges ranges;
+	struct difCompareSlot *slots;
+	const size_t count = (len / DIF_COMPARE_GRAIN)
+		+ ((len % DIF_COMPARE_GRAIN) != 0);
+	int ret = 0;
+	size_t i, j;
+
+	if (count < 2)
+	{
+		return difCompare(prints, len, threshold, found, ctx);
+	}
+
+	if ((found == NULL) || (prints == NULL))
+	{
+		return -1;
+	}
+
+	if ((ranges.lists = calloc(count, sizeof(struct difPairList))) == NULL)
+	{
+		return -1;
+	}
+
+	if ((slots = sortedSlots(pool, prints, len)) == NULL)
+	{
+		free(ranges.lists);
+
+		return -1;
+	}
+
+	ranges.slots = slots;
+	ranges.replicas = NULL;
+	ranges.nodes = 1;
+	ranges.threshold = threshold;
+
+	if (pool != NULL)
+	{
+		placeSlots(&ranges, len);
+	}
+
+	poolFor(pool, len, DIF_COMPARE_GRAIN, compareRange, &ranges);
+
+	for (i = 0; i < count; i++)
+	{
+		if (ranges.lists[i].failed)
+		{
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		const struct difPairList * const list = &ranges.lists[i];
+
+		for (j = 0; (ret == 0) && (j < list->len); j++)
+		{
+			found(ctx, list->pairs[j].left, list->pairs[j].right,
+				list->pairs[j].distance);
+		}
+
+		free(list->pairs);
+	}
+
+	freeSlotCopies(&ranges, len);
+	free(slots);
+	free(ranges.lists);
+
+	return ret;
+}
+
+/* The index is hammingIndex under a name of libdif's own, the match callbacks
+ * of the two have the same type */
+struct difIndex* difIndexNew(const unsigned int threshold)
+{
+	return (struct difIndex *) hammingIndexNew(threshold);
+}
+
+int difIndexInsert(struct difIndex * const index, const uint64_t print,
+	const size_t id)
+{
+	return hammingIndexInsert((struct difHammingIndex *) index, print, id);
+}
+
+int difIndexRemove(struct difIndex * const index, const uint64_t print,
+	const size_t id)
+{
+	return hammingIndexRemove((struct difHammingIndex *) index, print, id);
+}
+
+size_t difIndexQuery(const struct difIndex * const index,
+	const uint64_t print, const unsigned int within, difIndexMatch match,
+	void *ctx)
+{
+	return hammingIndexQuery((const struct difHammingIndex *) index, print,
+		within, match, ctx);
+}
+
+size_t difIndexSize(const struct difIndex * const index)
+{
+	return hammingIndexSize((const struct difHammingIndex *) index);
+}
+
+void difIndexFree(struct difIndex * const index)
+{
+	hammingIndexFree((struct difHammingIndex *) index);
+}
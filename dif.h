@@ -0,0 +1,127 @@
+#ifndef DIF_H
+#define DIF_H
+
+/* Public interface of libdif, the fingerprinting and matching difDemo is
+ * built on. An image's print is 64 bits, one per cell of an 8x8 grey
+ * reduction, set where the cell is brighter than the mean of them all. Two
+ * images are similar when their prints differ in only a few bits. */
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+
+/* Only what's declared here is exported from libdif.so, the rest of the
+ * library is built hidden */
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+#define DIF_API __attribute__((visibility("default")))
+#else
+#define DIF_API
+#endif
+
+/* Flags accepted when fingerprinting an encoded image */
+#define DIF_READ_DEFAULT     (0)
+#define DIF_READ_THUMBNAIL   (1 << 0) /* Prefer an embedded EXIF thumbnail */
+#define DIF_READ_DEFER       (1 << 1) /* Don't wait on the memory budget */
+
+/* Non-negative results of fingerprinting an encoded image, failure is -1 */
+#define DIF_LOADED_FULL      (0)
+#define DIF_LOADED_THUMBNAIL (1)
+
+/* Returned in place of waiting for room in the memory budget when reading with
+ * DIF_READ_DEFER, nothing has been decoded. The read has to be retried, and 
+ * until it is other reads may be held back for it. */
+#define DIF_DEFERRED         (-2)
+
+/* How decode work is divided between the loader threads and the backend's own
+ * internal threading, currently only acted upon by the ImageMagick backend */
+#define DIF_PARALLEL_AUTO   (0) /* Split the cores between the workers */
+#define DIF_PARALLEL_IMAGES (1) /* One thread per decode, many decodes */
+#define DIF_PARALLEL_PIXELS (2) /* One decode at a time using every core */
+
+/* Byte order of each pixel given to difFingerprintPixels, colour is converted
+ * to grey as stbi does it and alpha, or padding, is ignored */
+#define DIF_PIXELS_GRAY       (0)
+#define DIF_PIXELS_GRAY_ALPHA (1)
+#define DIF_PIXELS_RGB        (2)
+#define DIF_PIXELS_BGR        (3)
+#define DIF_PIXELS_RGBA       (4)
+#define DIF_PIXELS_BGRA       (5)
+
+struct difImageConfig
+{
+	const char *program;
+	size_t workers;  /* Threads that may fingerprint concurrently */
+	int parallelism; /* One of DIF_PARALLEL_* */
+	size_t mem_budget; /* Bytes of decoded pixels in flight, 0 for no limit */
+};
+
+#define DIF_PRINT_WIDTH  (8)
+#define DIF_PRINT_HEIGHT (8)
+#define DIF_PRINT_BITS   (DIF_PRINT_WIDTH * DIF_PRINT_HEIGHT)
+
+/* Called for every pair of prints within the threshold, as indices into the
+ * prints compared. left never has fewer bits set than right. */
+typedef void (*difPairFound)(void *ctx, size_t left, size_t right,
+	unsigned int distance);
+
+/* An encoded image held by the caller */
+struct difBuffer
+{
+	const void *data;
+	size_t len;
+};
+
+/* Threads for fingerprinting batches of buffers and comparing prints */
+struct difPool;
+
+DIF_API void difInit(const struct difImageConfig * const config);
+DIF_API void difCleanup(void);
+
+/* Each returns DIF_LOADED_FULL or DIF_LOADED_THUMBNAIL, or -1 on failure. 
+ * With DIF_READ_DEFER in flags they may also return DIF_DEFERRED, to be 
+ * retried once difBudgetReleases has moved on from before the call. */
+DIF_API int difFingerprintFile(const char * const path, 
+	const unsigned int flags, uint64_t * const print);
+DIF_API int difFingerprintMemory(const void * const data, const size_t len,
+	const unsigned int flags, uint64_t * const print);
+DIF_API void difFingerprintBatch(struct difPool *pool,
+	const struct difBuffer * const buffers, const size_t count,
+	const unsigned int flags, uint64_t * const prints, int * const results);
+DIF_API int difFingerprintPixels(const unsigned char * const pixels,
+	const size_t width, const size_t height, const size_t stride,
+	const int layout, uint64_t * const print);
+
+DIF_API unsigned long difBudgetReleases(void);
+
+DIF_API struct difPool* difPoolNew(const size_t threads);
+DIF_API void difPoolFree(struct difPool *pool);
+DIF_API int difPoolPin(struct difPool *pool);
+
+DIF_API unsigned int difDistance(const uint64_t left, const uint64_t right);
+DIF_API unsigned int difDensity(const uint64_t print);
+
+DIF_API int difCompare(const uint64_t * const prints, const size_t len,
+	const unsigned int threshold, difPairFound found, void *ctx);
+DIF_API int difCompareParallel(struct difPool *pool, 
+	const uint64_t * const prints, const size_t len, 
+	const unsigned int threshold, difPairFound found, void *ctx);
+
+/* Prints held for querying one at a time, by the caller's own ids. Queries
+ * within the threshold the index was made with only look at the prints that
+ * could match, wider ones scan them all. Any number of queries may run at
+ * once as long as nothing is inserted or removed meanwhile. */
+typedef void (*difIndexMatch)(void *ctx, size_t id, unsigned int distance);
+
+struct difIndex;
+
+DIF_API struct difIndex* difIndexNew(const unsigned int threshold);
+DIF_API int difIndexInsert(struct difIndex * const index, 
+	const uint64_t print, const size_t id);
+DIF_API int difIndexRemove(struct difIndex * const index, 
+	const uint64_t print, const size_t id);
+DIF_API size_t difIndexQuery(const struct difIndex * const index,
+	const uint64_t print, const unsigned int within, difIndexMatch match,
+	void *ctx);
+DIF_API size_t difIndexSize(const struct difIndex * const index);
+DIF_API void difIndexFree(struct difIndex * const index);
+
+#endif /* DIF_H */
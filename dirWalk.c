@@ -0,0 +1,647 @@
+/* Recursive directory walker. Each directory is a job on the walker's pool 
+ * that reads its entries and queues a job for every subdirectory, walking it
+ * inline instead when the ring is full so the pool's threads never block on
+ * one another. A queued job is only a path, the directory is opened once it
+ * runs, and subdirectories walked inline wait until the one listing them has
+ * been closed, so descriptors are only held by directories being read. Files
+ * that pass the extension or magic filter are handed to
+ * the found callback as soon as they are seen. Directories are tracked by 
+ * device and inode so symlink loops are cut, and files likewise so that a 
+ * file reached by more than one path is only reported once. Given a cache, a
+ * directory it holds as unchanged isn't read at all, its files are reported
+ * straight from the cache and only its subdirectories are opened. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* strlen, memcpy */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_WALK_POSIX
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h> /* nanosleep */
+#endif /* POSIX */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#include "thirdparty/macroThreadPool.h"
+#endif /* !DIF_DISABLE_THREADING */
+
+#include "imageHandling.h"
+#include "pathArena.h"
+#include "printCache.h"
+#include "dirWalk.h"
+
+#ifndef DIF_DISABLE_THREADING
+#define DIF_WALK_LOCK(mutex)   pthread_mutex_lock((mutex))
+#define DIF_WALK_UNLOCK(mutex) pthread_mutex_unlock((mutex))
+#else
+#define DIF_WALK_LOCK(mutex)   ((void) 0)
+#define DIF_WALK_UNLOCK(mutex) ((void) 0)
+#endif /* DIF_DISABLE_THREADING */
+
+#define DIF_INODE_SET_MIN (1024)
+
+/* Directory jobs queued per walker thread before they are walked inline */
+#define DIF_WALK_RING_PER_THREAD (16)
+
+/* Running out of descriptors is taken as back-pressure rather than a reason
+ * to skip an entry, the open is retried with the wait doubling from 1ms up to
+ * DIF_WALK_BACKOFF_MAX_MS, for DIF_WALK_BACKOFF_TRIES tries in all */
+#define DIF_WALK_BACKOFF_MAX_MS (128)
+#define DIF_WALK_BACKOFF_TRIES  (64)
+
+struct difInode
+{
+	uint64_t dev;
+	uint64_t ino;
+	int used;
+};
+
+struct difInodeSet
+{
+	struct difInode *slots;
+	size_t cap;
+	size_t len;
+};
+
+struct difWalk
+{
+	struct difPathArena arena;
+	struct difInodeSet dirs;
+	struct difInodeSet files;
+	difWalkFound found;
+	void *ctx;
+	struct difPrintCache *cache;
+#ifndef DIF_DISABLE_THREADING
+	struct walkThreadPool *pool;
+	pthread_mutex_t arena_mutex;
+	pthread_mutex_t inode_mutex;
+#endif /* !DIF_DISABLE_THREADING */
+};
+
+static char* arenaJoin(struct difWalk * const walk, const char * const dir,
+	const char * const name)
+{
+	const size_t dir_len = (dir != NULL) ? strlen(dir) : 0;
+	const size_t name_len = strlen(name);
+	const int slash = (dir_len != 0) && (dir[dir_len - 1] != '/');
+	const size_t len = dir_len + (size_t) slash + name_len + 1;
+	char *out;
+
+	DIF_WALK_LOCK(&walk->arena_mutex);
+	out = pathArenaAlloc(&walk->arena, len);
+	DIF_WALK_UNLOCK(&walk->arena_mutex);
+
+	if (out == NULL)
+	{
+		return NULL;
+	}
+
+	if (dir_len != 0)
+	{
+		memcpy(out, dir, dir_len);
+	}
+
+	if (slash)
+	{
+		out[dir_len] = '/';
+	}
+
+	memcpy(out + dir_len + slash, name, name_len + 1);
+
+	return out;
+}
+
+static size_t inodeHash(const uint64_t dev, const uint64_t ino)
+{
+	uint64_t hash = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+
+	hash ^= hash >> 31;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	hash ^= hash >> 29;
+
+	return (size_t) hash;
+}
+
+static int inodeSetGrow(struct difInodeSet * const set)
+{
+	const size_t cap = (set->cap == 0) ? DIF_INODE_SET_MIN : set->cap * 2;
+	struct difInode *slots;
+	size_t i;
+
+	if ((slots = calloc(cap, sizeof(struct difInode))) == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < set->cap; i++)
+	{
+		size_t pos;
+
+		if (set->slots[i].used == 0)
+		{
+			continue;
+		}
+
+		pos = inodeHash(set->slots[i].dev, set->slots[i].ino) 
+			& (cap - 1);
+
+		while (slots[pos].used != 0)
+		{
+			pos = (pos + 1) & (cap - 1);
+		}
+
+		slots[pos] = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->cap = cap;
+
+	return 0;
+}
+
+/* Returns 1 if the inode hadn't been seen before, 0 if it had. Should the set
+ * fail to grow the inode is let through, a repeat is better than a loss. */
+static int inodeSetInsert(struct difWalk * const walk, 
+	struct difInodeSet * const set, const uint64_t dev, const uint64_t ino)
+{
+	int ret = 1;
+	size_t pos;
+
+	DIF_WALK_LOCK(&walk->inode_mutex);
+
+	if (((set->len + 1) * 2 > set->cap) && (inodeSetGrow(set) != 0))
+	{
+		DIF_WALK_UNLOCK(&walk->inode_mutex);
+
+		return 1;
+	}
+
+	pos = inodeHash(dev, ino) & (set->cap - 1);
+
+	while (set->slots[pos].used != 0)
+	{
+		if ((set->slots[pos].dev == dev) && (set->slots[pos].ino == ino))
+		{
+			ret = 0;
+
+			break;
+		}
+
+		pos = (pos + 1) & (set->cap - 1);
+	}
+
+	if (ret != 0)
+	{
+		set->slots[pos].dev = dev;
+		set->slots[pos].ino = ino;
+		set->slots[pos].used = 1;
+		set->len++;
+	}
+
+	DIF_WALK_UNLOCK(&walk->inode_mutex);
+
+	return ret;
+}
+
+#ifdef DIF_WALK_POSIX
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif /* O_DIRECTORY */
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif /* O_CLOEXEC */
+
+static void walkDirectory(struct difWalk * const walk, 
+	const char * const path, const struct difCacheDirKey parent);
+
+#ifndef DIF_DISABLE_THREADING
+struct walkJob
+{
+	struct difWalk *walk;
+	const char *path;
+	struct difCacheDirKey parent;
+};
+
+static void walkFunction(struct walkJob job);
+
+MACRO_THREAD_POOL_COMPLETE(walk, struct walkJob, walkFunction);
+
+static void walkFunction(struct walkJob job)
+{
+	walkDirectory(job.walk, job.path, job.parent);
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+/* Subdirectories the pool had no room for, all of the same parent */
+struct walkPending
+{
+	const char **paths;
+	size_t len;
+	size_t cap;
+};
+
+/* Queues the directory, or leaves it in pending to be walked on this thread
+ * once the caller has closed its own directory */
+static void walkSubmit(struct difWalk * const walk, const char * const path,
+	const struct difCacheDirKey parent, struct walkPending * const pending)
+{
+#ifndef DIF_DISABLE_THREADING
+	struct walkJob job;
+
+	job.walk = walk;
+	job.path = path;
+	job.parent = parent;
+
+	if ((walk->pool != NULL) && (walkTryEnqueueJob(walk->pool, job)))
+	{
+		return;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	if (pending->len == pending->cap)
+	{
+		const size_t cap = (pending->cap == 0) ? 16 : 2 * pending->cap;
+		const char **grown = realloc(pending->paths, 
+			cap * sizeof(const char *));
+
+		/* Walking it now holds the caller's descriptor a while longer,
+		 * which beats losing the subtree */
+		if (grown == NULL)
+		{
+			walkDirectory(walk, path, parent);
+
+			return;
+		}
+
+		pending->paths = grown;
+		pending->cap = cap;
+	}
+
+	pending->paths[pending->len++] = path;
+}
+
+static void walkPendingRun(struct difWalk * const walk, 
+	struct walkPending * const pending, const struct difCacheDirKey parent)
+{
+	size_t i;
+
+	for (i = 0; i < pending->len; i++)
+	{
+		walkDirectory(walk, pending->paths[i], parent);
+	}
+
+	free(pending->paths);
+	pending->paths = NULL;
+	pending->len = 0;
+	pending->cap = 0;
+}
+
+/* openat that waits out EMFILE and ENFILE, the descriptors held elsewhere 
+ * are all short lived */
+static int walkOpen(const int dir_fd, const char * const name, 
+	const int flags)
+{
+	struct timespec wait = {0, 1000000L};
+	size_t tries;
+	int fd = -1;
+
+	for (tries = 0; tries < DIF_WALK_BACKOFF_TRIES; tries++)
+	{
+		if (((fd = openat(dir_fd, name, flags | O_CLOEXEC)) >= 0)
+		|| ((errno != EMFILE) && (errno != ENFILE)))
+		{
+			break;
+		}
+
+		(void) nanosleep(&wait, NULL);
+
+		if (wait.tv_nsec < DIF_WALK_BACKOFF_MAX_MS * 1000000L)
+		{
+			wait.tv_nsec *= 2;
+		}
+	}
+
+	return fd;
+}
+
+/* Files without a known extension are only taken if their leading bytes 
+ * match one of the formats that can be decoded */
+static int walkAccepts(const int dir_fd, const char * const name)
+{
+	unsigned char head[DIF_IMAGE_HEAD_LEN];
+	ssize_t got;
+	int fd;
+
+	if (isImageName(name))
+	{
+		return 1;
+	}
+
+	if ((fd = walkOpen(dir_fd, name, O_RDONLY)) < 0)
+	{
+		return 0;
+	}
+
+	got = read(fd, head, sizeof(head));
+	close(fd);
+
+	return (got > 0) && isImageHead(head, (size_t) got);
+}
+
+static const char* baseName(const char * const path)
+{
+	const char * const slash = strrchr(path, '/');
+
+	return (slash != NULL) ? slash + 1 : path;
+}
+
+/* Reports the files of a directory the cache holds as unchanged and walks
+ * its subdirectories, all without reading the directory itself */
+static void walkKnown(struct difWalk * const walk, const char * const path,
+	const struct stat * const info, const size_t known, 
+	const struct difCacheDirKey parent)
+{
+	struct walkPending pending = {NULL, 0, 0};
+	struct difWalkFile file;
+	size_t files, subdirs, i;
+
+	file.dir.dev = (uint64_t) info->st_dev;
+	file.dir.ino = (uint64_t) info->st_ino;
+	printCacheDirContents(walk->cache, known, &files, &subdirs);
+
+	for (i = 0; i < files; i++)
+	{
+		const char *cached;
+		uint64_t ent_dev, ent_ino;
+		char *ent_path;
+
+		if (((file.record = printCacheDirFile(walk->cache, known, i, 
+			&cached, &ent_dev, &ent_ino)) != 0)
+		&& (inodeSetInsert(walk, &walk->files, ent_dev, ent_ino) != 0)
+		&& ((ent_path = arenaJoin(walk, path, baseName(cached))) 
+			!= NULL))
+		{
+			walk->found(walk->ctx, ent_path, &file);
+		}
+	}
+
+	for (i = 0; i < subdirs; i++)
+	{
+		const char * const cached 
+			= printCacheDirSubdir(walk->cache, known, i);
+		char *ent_path;
+
+		if ((cached != NULL) 
+		&& ((ent_path = arenaJoin(walk, path, baseName(cached))) 
+			!= NULL))
+		{
+			walkSubmit(walk, ent_path, file.dir, &pending);
+		}
+	}
+
+	printCacheDirVisit(walk->cache, known, info, &parent, path, 0);
+	walkPendingRun(walk, &pending, file.dir);
+}
+
+static void walkDirectory(struct difWalk * const walk, 
+	const char * const path, const struct difCacheDirKey parent)
+{
+	struct walkPending pending = {NULL, 0, 0};
+	struct dirent *ent;
+	struct stat info;
+	struct stat dir_info;
+	struct difWalkFile file;
+	DIR *dir = NULL;
+	size_t entries = 0;
+	size_t known;
+	uint64_t dev;
+	int fd;
+
+	if ((fd = walkOpen(AT_FDCWD, path, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		fprintf(stderr, "Failed to open directory: '%s'\n", path);
+
+		return;
+	}
+
+	if ((fstat(fd, &dir_info) != 0) 
+	|| (inodeSetInsert(walk, &walk->dirs, (uint64_t) dir_info.st_dev, 
+		(uint64_t) dir_info.st_ino) == 0))
+	{
+		close(fd);
+
+		return;
+	}
+
+	if ((known = printCacheDirUnchanged(walk->cache, &dir_info)) != 0)
+	{
+		close(fd);
+		walkKnown(walk, path, &dir_info, known, parent);
+
+		return;
+	}
+
+	if ((dir = fdopendir(fd)) == NULL)
+	{
+		fprintf(stderr, "Failed to read directory: '%s'\n", path);
+		close(fd);
+
+		return;
+	}
+
+	dev = (uint64_t) dir_info.st_dev;
+	file.dir.dev = dev;
+	file.dir.ino = (uint64_t) dir_info.st_ino;
+	file.record = 0;
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		const char * const name = ent->d_name;
+		uint64_t ent_dev = dev;
+		uint64_t ent_ino = (uint64_t) ent->d_ino;
+		int is_dir = 0;
+		int is_file = 0;
+		char *ent_path;
+
+		if ((name[0] == '.') && ((name[1] == '\0') 
+		|| ((name[1] == '.') && (name[2] == '\0'))))
+		{
+			continue;
+		}
+
+		entries++;
+
+#ifdef DT_UNKNOWN
+		is_dir = (ent->d_type == DT_DIR);
+		is_file = (ent->d_type == DT_REG);
+
+		/* Symlinks are followed, the inode sets catch any loops */
+		if ((ent->d_type == DT_LNK) || (ent->d_type == DT_UNKNOWN))
+#endif /* DT_UNKNOWN */
+		{
+			if (fstatat(dirfd(dir), name, &info, 0) != 0)
+			{
+				continue;
+			}
+
+			is_dir = S_ISDIR(info.st_mode);
+			is_file = S_ISREG(info.st_mode);
+			ent_dev = (uint64_t) info.st_dev;
+			ent_ino = (uint64_t) info.st_ino;
+		}
+
+		if (is_dir)
+		{
+			if ((ent_path = arenaJoin(walk, path, name)) != NULL)
+			{
+				walkSubmit(walk, ent_path, file.dir, &pending);
+			}
+		}
+		else if ((is_file) && (walkAccepts(dirfd(dir), name))
+		&& (inodeSetInsert(walk, &walk->files, ent_dev, ent_ino) != 0)
+		&& ((ent_path = arenaJoin(walk, path, name)) != NULL))
+		{
+			walk->found(walk->ctx, ent_path, &file);
+		}
+	}
+
+	closedir(dir);
+
+	/* Only recorded once every entry has been seen so an interrupted read
+	 * is never taken as the whole directory */
+	printCacheDirVisit(walk->cache, 0, &dir_info, &parent, path, entries);
+	walkPendingRun(walk, &pending, file.dir);
+}
+
+#endif /* DIF_WALK_POSIX */
+
+struct difWalk* dirWalkNew(const size_t threads, difWalkFound found, 
+	void *ctx)
+{
+	struct difWalk *walk;
+
+	if ((found == NULL)
+	|| ((walk = calloc(1, sizeof(struct difWalk))) == NULL))
+	{
+		return NULL;
+	}
+
+	walk->found = found;
+	walk->ctx = ctx;
+	pathArenaInit(&walk->arena);
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_init(&walk->arena_mutex, NULL);
+	pthread_mutex_init(&walk->inode_mutex, NULL);
+
+#ifdef DIF_WALK_POSIX
+	if ((threads != 0) && ((walk->pool = walkNewThreadPool(threads, 
+		DIF_WALK_RING_PER_THREAD * threads)) == NULL))
+	{
+		dirWalkFree(walk);
+
+		return NULL;
+	}
+#endif /* DIF_WALK_POSIX */
+#else
+	(void) threads;
+#endif /* DIF_DISABLE_THREADING */
+
+	return walk;
+}
+
+/* Directories the cache holds as unchanged are taken from it, and every 
+ * directory walked is recorded in it. The cache must outlive the walk. */
+void dirWalkSetCache(struct difWalk *walk, struct difPrintCache *cache)
+{
+	if (walk != NULL)
+	{
+		walk->cache = cache;
+	}
+}
+
+/* Returns once every directory below root has been read, the found callback
+ * may still be running work it queued elsewhere */
+int dirWalkRun(struct difWalk *walk, const char * const root)
+{
+#ifdef DIF_WALK_POSIX
+	const struct difCacheDirKey none = {0, 0};
+	struct stat info;
+	const char *path;
+
+	if ((walk == NULL) || (root == NULL))
+	{
+		return -1;
+	}
+
+	/* Only checked here for the return value, the walk opens it itself */
+	if ((stat(root, &info) != 0) || (!S_ISDIR(info.st_mode)))
+	{
+		fprintf(stderr, "Failed to open directory: '%s'\n", root);
+
+		return -1;
+	}
+
+	if ((path = arenaJoin(walk, NULL, root)) == NULL)
+	{
+		return -1;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if (walk->pool != NULL)
+	{
+		struct walkJob job;
+
+		job.walk = walk;
+		job.path = path;
+		job.parent = none;
+		walkEnqueueJob(walk->pool, job);
+		walkWaitOnIdle(walk->pool);
+
+		return 0;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	walkDirectory(walk, path, none);
+
+	return 0;
+#else
+	(void) walk;
+	(void) root;
+	fputs("Directory walking isn't supported on this platform\n", stderr);
+
+	return -1;
+#endif /* !DIF_WALK_POSIX */
+}
+
+void dirWalkFree(struct difWalk *walk)
+{
+	if (walk == NULL)
+	{
+		return;
+	}
+
+#if !defined(DIF_DISABLE_THREADING) && defined(DIF_WALK_POSIX)
+	walkCleanupThreadPool(walk->pool);
+#endif /* !DIF_DISABLE_THREADING && DIF_WALK_POSIX */
+
+	pathArenaFree(&walk->arena);
+	free(walk->dirs.slots);
+	free(walk->files.slots);
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_destroy(&walk->arena_mutex);
+	pthread_mutex_destroy(&walk->inode_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	free(walk);
+}
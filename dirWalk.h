@@ -0,0 +1,29 @@
+#ifndef DIF_DIR_WALK_H
+#define DIF_DIR_WALK_H
+
+#include <stddef.h> /* size_t */
+
+#include "printCache.h"
+
+/* Where a found file came from. record is 1 + the index of its cache record
+ * if its directory was unchanged and the file wasn't looked at, else 0. */
+struct difWalkFile
+{
+	struct difCacheDirKey dir;
+	size_t record;
+};
+
+/* Called for every image file found, possibly from several walker threads at
+ * once. The path stays valid until the walker is freed. */
+typedef void (*difWalkFound)(void *ctx, const char *path, 
+	const struct difWalkFile *file);
+
+struct difWalk;
+
+struct difWalk* dirWalkNew(const size_t threads, difWalkFound found, 
+	void *ctx);
+void dirWalkSetCache(struct difWalk *walk, struct difPrintCache *cache);
+int dirWalkRun(struct difWalk *walk, const char * const root);
+void dirWalkFree(struct difWalk *walk);
+
+#endif /* DIF_DIR_WALK_H */
@@ -0,0 +1,607 @@
+/* Directory watcher built on inotify. Every directory below a root gets a
+ * watch of its own, directories created or moved in later are added as their
+ * events arrive and the images already inside them reported, since they may
+ * have been written before the watch was in place. A file is reported once
+ * it has been closed after writing or moved into a watched directory, never
+ * while still being written. inotify hands back the same watch descriptor for
+ * a directory reached twice, which is what cuts symlink loops. Directories
+ * are kept as their parent's watch descriptor and their name. A directory
+ * deleted or moved out of the tree is reported once, for everything below it,
+ * and unwatched. Moves aren't paired up by their cookies, so one renamed
+ * within the tree is reported removed under its old path and its images
+ * reported again under the new one. Should the event queue overflow the
+ * roots are rescanned and every image in them reported as changed, files
+ * deleted while events were being dropped aren't noticed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h> /* strlen, memcpy */
+#include <errno.h>
+
+#if defined(__linux__)
+#define DIF_WATCH_INOTIFY
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* __linux__ */
+
+#include "imageHandling.h"
+#include "pathArena.h"
+#include "dirWatch.h"
+
+#define DIF_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+	| IN_DELETE | IN_CREATE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+/* Enough for a few hundred events per read */
+#define DIF_WATCH_BUFFER (64 * 1024)
+
+struct difWatchDir
+{
+	const char *name; /* The whole path of a root, NULL once unwatched */
+	int parent; /* Watch descriptor of the directory holding it, -1 if none */
+};
+
+struct difWatch
+{
+	int fd;
+	struct difWatchDir *dirs; /* Indexed by watch descriptor */
+	size_t dirs_cap;
+	struct difPathArena arena; /* Names of the watched directories */
+	char *scratch; /* Paths of events, only valid until the next path */
+	size_t scratch_cap;
+	difWatchEvent event;
+	void *ctx;
+};
+
+#ifdef DIF_WATCH_INOTIFY
+static int watchKnown(const struct difWatch * const watch, const int wd)
+{
+	return (wd >= 0) && ((size_t) wd < watch->dirs_cap)
+		&& (watch->dirs[wd].name != NULL);
+}
+
+/* Bytes the path of the directory takes, 0 if one above it is no longer
+ * watched. A slash is counted after every name whether it's needed or not. */
+static size_t watchPathLen(const struct difWatch * const watch, const int wd,
+	const size_t depth)
+{
+	size_t above = 0;
+
+	if ((!watchKnown(watch, wd)) || (depth > watch->dirs_cap))
+	{
+		return 0;
+	}
+
+	if ((watch->dirs[wd].parent >= 0) && ((above = watchPathLen(watch,
+		watch->dirs[wd].parent, depth + 1)) == 0))
+	{
+		return 0;
+	}
+
+	return above + strlen(watch->dirs[wd].name) + 1;
+}
+
+/* Writes the path of a directory known to watchPathLen, returns its end */
+static char* watchPathFill(const struct difWatch * const watch, const int wd,
+	char *out)
+{
+	const struct difWatchDir * const dir = &watch->dirs[wd];
+	const size_t len = strlen(dir->name);
+
+	if (dir->parent >= 0)
+	{
+		out = watchPathFill(watch, dir->parent, out);
+
+		if (out[-1] != '/')
+		{
+			*out++ = '/';
+		}
+	}
+
+	memcpy(out, dir->name, len);
+
+	return out + len;
+}
+
+/* The path of the watched directory, with name below it unless NULL. Returns
+ * NULL on allocation failure or if a directory above is no longer watched.
+ * The result is overwritten by the next path, a daemon sees too many events
+ * to keep every one. */
+static char* watchPath(struct difWatch * const watch, const int wd,
+	const char * const name)
+{
+	const size_t dir_len = watchPathLen(watch, wd, 0);
+	const size_t name_len = (name != NULL) ? strlen(name) : 0;
+	const size_t len = dir_len + name_len + 1;
+	char *out;
+
+	if (dir_len == 0)
+	{
+		return NULL;
+	}
+
+	if (len > watch->scratch_cap)
+	{
+		if ((out = realloc(watch->scratch, len * 2)) == NULL)
+		{
+			return NULL;
+		}
+
+		watch->scratch = out;
+		watch->scratch_cap = len * 2;
+	}
+
+	out = watchPathFill(watch, wd, watch->scratch);
+
+	if (name != NULL)
+	{
+		if (out[-1] != '/')
+		{
+			*out++ = '/';
+		}
+
+		memcpy(out, name, name_len);
+		out += name_len;
+	}
+
+	*out = '\0';
+
+	return watch->scratch;
+}
+
+/* As with the walker, files without a known extension are only taken if
+ * their leading bytes match a format that can be decoded */
+static int watchAccepts(const char * const path, const char * const name)
+{
+	unsigned char head[DIF_IMAGE_HEAD_LEN];
+	ssize_t got;
+	int fd;
+
+	if (isImageName(name))
+	{
+		return 1;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		return 0;
+	}
+
+	got = read(fd, head, sizeof(head));
+	close(fd);
+
+	return (got > 0) && isImageHead(head, (size_t) got);
+}
+
+static int watchRemember(struct difWatch * const watch, const int wd,
+	const int parent, const char * const name)
+{
+	const size_t at = (size_t) wd;
+
+	if (at >= watch->dirs_cap)
+	{
+		size_t cap = (watch->dirs_cap == 0) ? 64 : watch->dirs_cap;
+		struct difWatchDir *dirs;
+
+		while (cap <= at)
+		{
+			cap *= 2;
+		}
+
+		if ((dirs = realloc(watch->dirs, sizeof(struct difWatchDir) 
+			* cap)) == NULL)
+		{
+			return -1;
+		}
+
+		memset(dirs + watch->dirs_cap, 0,
+			sizeof(struct difWatchDir) * (cap - watch->dirs_cap));
+		watch->dirs = dirs;
+		watch->dirs_cap = cap;
+	}
+
+	watch->dirs[at].name = name;
+	watch->dirs[at].parent = parent;
+
+	return 0;
+}
+
+/* Whether the directory is the other one or somewhere below it */
+static int watchBelow(const struct difWatch * const watch, int wd,
+	const int other)
+{
+	size_t depth;
+
+	for (depth = 0; (watchKnown(watch, wd)) && (depth <= watch->dirs_cap);
+		depth++)
+	{
+		if (wd == other)
+		{
+			return 1;
+		}
+
+		wd = watch->dirs[wd].parent;
+	}
+
+	return 0;
+}
+
+/* The watch descriptor of the directory called name in parent, -1 if it 
+ * isn't watched */
+static int watchChild(const struct difWatch * const watch, const int parent,
+	const char * const name)
+{
+	size_t i;
+
+	for (i = 0; i < watch->dirs_cap; i++)
+	{
+		if ((watch->dirs[i].name != NULL)
+		&& (watch->dirs[i].parent == parent)
+		&& (strcmp(watch->dirs[i].name, name) == 0))
+		{
+			return (int) i;
+		}
+	}
+
+	return -1;
+}
+
+/* Reports the directory as removed, which stands for everything below it,
+ * and stops watching it and every directory below it */
+static void watchForget(struct difWatch * const watch, const int wd)
+{
+	unsigned char *drop;
+	char *path;
+	size_t i;
+
+	if ((path = watchPath(watch, wd, NULL)) != NULL)
+	{
+		watch->event(watch->ctx, path, DIF_WATCH_REMOVED_DIR);
+	}
+
+	/* Marked first, clearing a directory cuts those below it off */
+	if ((drop = calloc(watch->dirs_cap, 1)) != NULL)
+	{
+		for (i = 0; i < watch->dirs_cap; i++)
+		{
+			drop[i] = (unsigned char) watchBelow(watch, (int) i, wd);
+		}
+
+		for (i = 0; i < watch->dirs_cap; i++)
+		{
+			if ((drop[i]) && (i != (size_t) wd))
+			{
+				inotify_rm_watch(watch->fd, (int) i);
+				watch->dirs[i].name = NULL;
+			}
+		}
+
+		free(drop);
+	}
+
+	inotify_rm_watch(watch->fd, wd);
+	watch->dirs[wd].name = NULL;
+}
+
+/* Watches the directory called name in parent, or the root at the path name
+ * without a parent, and every directory below it, the name is copied. With
+ * announce set the images found along the way are reported as changed. A
+ * directory moved in that's already watched under its old path, its move
+ * away not having been seen, is reported removed there and watched afresh.
+ * A rescan goes through directories already watched where they are too.
+ */
+static void watchTree(struct difWatch * const watch, const int parent,
+	const char * const name, const int announce, const int moved,
+	const int rescan)
+{
+	struct dirent *ent;
+	const char *at, *copy;
+	DIR *dir;
+	int wd, known;
+
+	if ((at = (parent < 0) ? name : watchPath(watch, parent, name)) 
+		== NULL)
+	{
+		return;
+	}
+
+	if ((wd = inotify_add_watch(watch->fd, at, DIF_WATCH_MASK)) < 0)
+	{
+		fprintf(stderr, "Failed to watch directory: '%s'\n", at);
+
+		return;
+	}
+
+	if (!watchKnown(watch, wd))
+	{
+		known = 0;
+	}
+	else if ((watch->dirs[wd].parent == parent) 
+	&& (strcmp(watch->dirs[wd].name, name) == 0))
+	{
+		known = 1;
+	}
+	else if (moved)
+	{
+		watchForget(watch, wd);
+		known = 0;
+
+		if (((at = watchPath(watch, parent, name)) == NULL)
+		|| ((wd = inotify_add_watch(watch->fd, at, DIF_WATCH_MASK)) < 0))
+		{
+			return;
+		}
+	}
+	else
+	{
+		/* Reached again through a link */
+		return;
+	}
+
+	if ((known) && (!rescan))
+	{
+		return;
+	}
+
+	if ((!known) 
+	&& (((copy = pathArenaCopy(&watch->arena, name, strlen(name))) 
+		== NULL)
+	|| (watchRemember(watch, wd, parent, copy) != 0)))
+	{
+		return;
+	}
+
+	if ((dir = opendir(at)) == NULL)
+	{
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		const char * const ent_name = ent->d_name;
+		struct stat info;
+		char *ent_path;
+
+		if (((ent_name[0] == '.') && ((ent_name[1] == '\0')
+		|| ((ent_name[1] == '.') && (ent_name[2] == '\0'))))
+		|| ((ent_path = watchPath(watch, wd, ent_name)) == NULL)
+		|| (stat(ent_path, &info) != 0))
+		{
+			continue;
+		}
+
+		if (S_ISDIR(info.st_mode))
+		{
+			watchTree(watch, wd, ent_name, announce, 0, rescan);
+		}
+		else if ((announce) && (S_ISREG(info.st_mode))
+		&& (watchAccepts(ent_path, ent_name)))
+		{
+			watch->event(watch->ctx, ent_path, DIF_WATCH_CHANGED);
+		}
+	}
+
+	closedir(dir);
+}
+
+/* Events were dropped, directories no longer where they were watched are
+ * forgotten and the roots gone through again, reporting every image */
+static void watchRescan(struct difWatch * const watch)
+{
+	struct stat info;
+	char *path;
+	size_t i;
+
+	for (i = 0; i < watch->dirs_cap; i++)
+	{
+		if ((watch->dirs[i].name != NULL)
+		&& ((path = watchPath(watch, (int) i, NULL)) != NULL)
+		&& ((stat(path, &info) != 0) || (!S_ISDIR(info.st_mode))))
+		{
+			watchForget(watch, (int) i);
+		}
+	}
+
+	for (i = 0; i < watch->dirs_cap; i++)
+	{
+		if ((watch->dirs[i].name != NULL) 
+		&& (watch->dirs[i].parent < 0))
+		{
+			watchTree(watch, -1, watch->dirs[i].name, 1, 0, 1);
+		}
+	}
+}
+
+static void watchDispatch(struct difWatch * const watch,
+	const struct inotify_event * const ev)
+{
+	char *path;
+	int child;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+	{
+		fputs("Watch event queue overflowed, rescanning\n", stderr);
+		watchRescan(watch);
+
+		return;
+	}
+
+	if (!watchKnown(watch, ev->wd))
+	{
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED)
+	{
+		watch->dirs[ev->wd].name = NULL;
+
+		return;
+	}
+
+	/* Below a root these arrive after the parent's own events did */
+	if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+	{
+		if (watch->dirs[ev->wd].parent < 0)
+		{
+			watchForget(watch, ev->wd);
+		}
+
+		return;
+	}
+
+	if ((ev->len == 0)
+	|| ((path = watchPath(watch, ev->wd, ev->name)) == NULL))
+	{
+		return;
+	}
+
+	if (ev->mask & IN_ISDIR)
+	{
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			watchTree(watch, ev->wd, ev->name, 1,
+				(ev->mask & IN_MOVED_TO) != 0, 0);
+		}
+		else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			/* Unless its own watch went first, as on a delete */
+			if ((child = watchChild(watch, ev->wd, ev->name)) >= 0)
+			{
+				watchForget(watch, child);
+			}
+			else
+			{
+				watch->event(watch->ctx, path, 
+					DIF_WATCH_REMOVED_DIR);
+			}
+		}
+	}
+	else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+	{
+		watch->event(watch->ctx, path, DIF_WATCH_REMOVED);
+	}
+	else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+	&& (watchAccepts(path, ev->name)))
+	{
+		watch->event(watch->ctx, path, DIF_WATCH_CHANGED);
+	}
+}
+#endif /* DIF_WATCH_INOTIFY */
+
+struct difWatch* dirWatchNew(difWatchEvent event, void *ctx)
+{
+#ifdef DIF_WATCH_INOTIFY
+	struct difWatch *watch;
+
+	if ((event == NULL)
+	|| ((watch = calloc(1, sizeof(struct difWatch))) == NULL))
+	{
+		return NULL;
+	}
+
+	if ((watch->fd = inotify_init1(IN_CLOEXEC)) < 0)
+	{
+		free(watch);
+
+		return NULL;
+	}
+
+	watch->event = event;
+	watch->ctx = ctx;
+	pathArenaInit(&watch->arena);
+
+	return watch;
+#else
+	(void) event;
+	(void) ctx;
+	fputs("Watching directories isn't supported on this platform\n",
+		stderr);
+
+	return NULL;
+#endif /* DIF_WATCH_INOTIFY */
+}
+
+/* Images already below root aren't reported, only later changes */
+int dirWatchAdd(struct difWatch *watch, const char * const root)
+{
+#ifdef DIF_WATCH_INOTIFY
+	if ((watch == NULL) || (root == NULL))
+	{
+		return -1;
+	}
+
+	watchTree(watch, -1, root, 0, 0, 0);
+
+	return 0;
+#else
+	(void) watch;
+	(void) root;
+
+	return -1;
+#endif /* DIF_WATCH_INOTIFY */
+}
+
+/* Blocks until at least one event arrives and dispatches everything read.
+ * Returns the number of events read, or -1 with errno set, EINTR if a
+ * signal arrived first. */
+int dirWatchPoll(struct difWatch *watch)
+{
+#ifdef DIF_WATCH_INOTIFY
+	union
+	{
+		struct inotify_event ev;
+		char bytes[DIF_WATCH_BUFFER];
+	} buf;
+	ssize_t got;
+	size_t at = 0;
+	int count = 0;
+
+	if (watch == NULL)
+	{
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	if ((got = read(watch->fd, buf.bytes, sizeof(buf.bytes))) < 0)
+	{
+		return -1;
+	}
+
+	while (at + sizeof(struct inotify_event) <= (size_t) got)
+	{
+		const struct inotify_event * const ev
+			= (const struct inotify_event *) (buf.bytes + at);
+
+		watchDispatch(watch, ev);
+		at += sizeof(struct inotify_event) + ev->len;
+		count++;
+	}
+
+	return count;
+#else
+	(void) watch;
+	errno = ENOSYS;
+
+	return -1;
+#endif /* DIF_WATCH_INOTIFY */
+}
+
+void dirWatchFree(struct difWatch *watch)
+{
+	if (watch == NULL)
+	{
+		return;
+	}
+
+#ifdef DIF_WATCH_INOTIFY
+	close(watch->fd);
+#endif /* DIF_WATCH_INOTIFY */
+
+	pathArenaFree(&watch->arena);
+	free(watch->scratch);
+	free(watch->dirs);
+	free(watch);
+}
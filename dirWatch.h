@@ -0,0 +1,22 @@
+#ifndef DIF_DIR_WATCH_H
+#define DIF_DIR_WATCH_H
+
+#include <stddef.h> /* size_t */
+
+/* What happened to a path */
+#define DIF_WATCH_CHANGED (1) /* Written and closed, or moved into place */
+#define DIF_WATCH_REMOVED (2) /* Deleted or moved away */
+#define DIF_WATCH_REMOVED_DIR (3) /* A directory and all below it gone */
+
+/* Called from dirWatchPoll for each image file event, the path is only valid
+ * for the duration of the call */
+typedef void (*difWatchEvent)(void *ctx, const char *path, int kind);
+
+struct difWatch;
+
+struct difWatch* dirWatchNew(difWatchEvent event, void *ctx);
+int dirWatchAdd(struct difWatch *watch, const char * const root);
+int dirWatchPoll(struct difWatch *watch);
+void dirWatchFree(struct difWatch *watch);
+
+#endif /* DIF_DIR_WATCH_H */
@@ -0,0 +1,380 @@
+/* Hamming distance index over 64 bit prints using multi-index hashing. With a
+ * threshold of t the print is split into t + 1 chunks of contiguous bits, and
+ * by the pigeonhole principle two prints within t bits of one another must
+ * agree exactly on at least one of those chunks. Each chunk gets a chained
+ * hash table from its value to the prints holding it, so a query only looks
+ * at prints sharing a chunk rather than at every print. Once the chunks would
+ * be too narrow to tell prints apart the index falls back to a plain scan.
+ * Queries only read the index, so any number may run at once as long as
+ * nothing is inserted or removed meanwhile. */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hammingIndex.h"
+#include "dif.h" /* difDistance */
+
+#define DIF_INDEX_MAX_CHUNKS (16)
+#define DIF_INDEX_MIN_CAP    (256)
+#define DIF_INDEX_NONE       ((size_t) -1)
+
+struct difHammingItem
+{
+	uint64_t print;
+	size_t id;
+	int used;
+};
+
+struct difHammingIndex
+{
+	unsigned int threshold;
+	unsigned int chunks; /* 0 when scanning every print instead */
+	unsigned int links;  /* Chain links per item, at least 1 */
+	unsigned int shift[DIF_INDEX_MAX_CHUNKS];
+	uint64_t mask[DIF_INDEX_MAX_CHUNKS];
+	struct difHammingItem *items;
+	size_t *next; /* links per item, the first doubles as the free list */
+	size_t len;
+	size_t cap;
+	size_t live;
+	size_t free_head;
+	size_t *heads; /* chunks * buckets chain heads */
+	size_t buckets;
+};
+
+static uint64_t chunkKey(const struct difHammingIndex * const index,
+	const unsigned int chunk, const uint64_t print)
+{
+	return (print >> index->shift[chunk]) & index->mask[chunk];
+}
+
+static size_t chunkBucket(const struct difHammingIndex * const index,
+	const uint64_t key)
+{
+	uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+
+	hash ^= hash >> 29;
+
+	return (size_t) hash & (index->buckets - 1);
+}
+
+static void linkItem(struct difHammingIndex * const index, const size_t slot)
+{
+	unsigned int c;
+
+	for (c = 0; c < index->chunks; c++)
+	{
+		size_t * const head = &index->heads[c * index->buckets
+			+ chunkBucket(index, chunkKey(index, c,
+			index->items[slot].print))];
+
+		index->next[slot * index->links + c] = *head;
+		*head = slot;
+	}
+}
+
+/* Keeps at least one bucket per print so chains stay short */
+static int rehash(struct difHammingIndex * const index, const size_t buckets)
+{
+	size_t *heads;
+	size_t i;
+
+	if ((heads = malloc(sizeof(size_t) * buckets * index->chunks)) == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < buckets * index->chunks; i++)
+	{
+		heads[i] = DIF_INDEX_NONE;
+	}
+
+	free(index->heads);
+	index->heads = heads;
+	index->buckets = buckets;
+
+	for (i = 0; i < index->len; i++)
+	{
+		if (index->items[i].used)
+		{
+			linkItem(index, i);
+		}
+	}
+
+	return 0;
+}
+
+static size_t allocItem(struct difHammingIndex * const index)
+{
+	size_t slot;
+
+	if (index->free_head != DIF_INDEX_NONE)
+	{
+		slot = index->free_head;
+		index->free_head = index->next[slot * index->links];
+
+		return slot;
+	}
+
+	if (index->len == index->cap)
+	{
+		const size_t cap = index->cap * 2;
+		struct difHammingItem *items;
+		size_t *next;
+
+		if ((items = realloc(index->items,
+			sizeof(struct difHammingItem) * cap)) == NULL)
+		{
+			return DIF_INDEX_NONE;
+		}
+
+		index->items = items;
+
+		if ((next = realloc(index->next,
+			sizeof(size_t) * cap * index->links)) == NULL)
+		{
+			return DIF_INDEX_NONE;
+		}
+
+		index->next = next;
+		index->cap = cap;
+	}
+
+	return index->len++;
+}
+
+struct difHammingIndex* hammingIndexNew(const unsigned int threshold)
+{
+	struct difHammingIndex *index;
+	unsigned int c, bit = 0;
+
+	if ((index = calloc(1, sizeof(struct difHammingIndex))) == NULL)
+	{
+		return NULL;
+	}
+
+	index->threshold = threshold;
+	index->chunks = (threshold < DIF_INDEX_MAX_CHUNKS) ? threshold + 1 : 0;
+	index->links = (index->chunks != 0) ? index->chunks : 1;
+	index->free_head = DIF_INDEX_NONE;
+	index->cap = DIF_INDEX_MIN_CAP;
+
+	/* The first 64 % chunks chunks take one bit more than the rest */
+	for (c = 0; c < index->chunks; c++)
+	{
+		const unsigned int width = (64 / index->chunks)
+			+ (c < 64 % index->chunks);
+
+		index->shift[c] = bit;
+		index->mask[c] = (width >= 64)
+			? ~((uint64_t) 0) : (((uint64_t) 1) << width) - 1;
+		bit += width;
+	}
+
+	if (((index->items = malloc(sizeof(struct difHammingItem)
+		* index->cap)) == NULL)
+	|| ((index->next = malloc(sizeof(size_t) * index->cap
+		* index->links)) == NULL)
+	|| ((index->chunks != 0)
+		&& (rehash(index, DIF_INDEX_MIN_CAP) != 0)))
+	{
+		hammingIndexFree(index);
+
+		return NULL;
+	}
+
+	return index;
+}
+
+/* The same id may be inserted with several prints, each is its own entry */
+int hammingIndexInsert(struct difHammingIndex * const index,
+	const uint64_t print, const size_t id)
+{
+	size_t slot;
+
+	if (index == NULL)
+	{
+		return -1;
+	}
+
+	if ((index->chunks != 0) && (index->live + 1 > index->buckets)
+	&& (rehash(index, index->buckets * 2) != 0))
+	{
+		return -1;
+	}
+
+	if ((slot = allocItem(index)) == DIF_INDEX_NONE)
+	{
+		return -1;
+	}
+
+	index->items[slot].print = print;
+	index->items[slot].id = id;
+	index->items[slot].used = 1;
+	index->live++;
+	linkItem(index, slot);
+
+	return 0;
+}
+
+/* Returns -1 if no entry with that print and id was indexed */
+int hammingIndexRemove(struct difHammingIndex * const index,
+	const uint64_t print, const size_t id)
+{
+	size_t slot = DIF_INDEX_NONE;
+	unsigned int c;
+
+	if (index == NULL)
+	{
+		return -1;
+	}
+
+	if (index->chunks == 0)
+	{
+		size_t i;
+
+		for (i = 0; i < index->len; i++)
+		{
+			if ((index->items[i].used)
+			&& (index->items[i].print == print)
+			&& (index->items[i].id == id))
+			{
+				slot = i;
+
+				break;
+			}
+		}
+	}
+	else
+	{
+		slot = index->heads[chunkBucket(index,
+			chunkKey(index, 0, print))];
+
+		while ((slot != DIF_INDEX_NONE)
+		&& ((index->items[slot].print != print)
+		|| (index->items[slot].id != id)))
+		{
+			slot = index->next[slot * index->links];
+		}
+	}
+
+	if (slot == DIF_INDEX_NONE)
+	{
+		return -1;
+	}
+
+	for (c = 0; c < index->chunks; c++)
+	{
+		size_t *at = &index->heads[c * index->buckets
+			+ chunkBucket(index, chunkKey(index, c, print))];
+
+		while (*at != slot)
+		{
+			at = &index->next[*at * index->links + c];
+		}
+
+		*at = index->next[slot * index->links + c];
+	}
+
+	index->items[slot].used = 0;
+	index->next[slot * index->links] = index->free_head;
+	index->free_head = slot;
+	index->live--;
+
+	return 0;
+}
+
+/* Reports every print within the given distance and returns how many there
+ * were. The chunks only cover distances up to the index's own threshold, a
+ * wider query scans every print. A print held in several chunks is only
+ * reported from the first one the two prints agree on. */
+size_t hammingIndexQuery(const struct difHammingIndex * const index,
+	const uint64_t print, const unsigned int within, difHammingMatch match,
+	void *ctx)
+{
+	size_t found = 0;
+	unsigned int c;
+
+	if (index == NULL)
+	{
+		return 0;
+	}
+
+	if ((index->chunks == 0) || (within > index->threshold))
+	{
+		size_t i;
+
+		for (i = 0; i < index->len; i++)
+		{
+			const unsigned int distance
+				= difDistance(index->items[i].print, print);
+
+			if ((index->items[i].used) && (distance <= within))
+			{
+				match(ctx, index->items[i].id, distance);
+				found++;
+			}
+		}
+
+		return found;
+	}
+
+	for (c = 0; c < index->chunks; c++)
+	{
+		const uint64_t key = chunkKey(index, c, print);
+		size_t slot = index->heads[c * index->buckets
+			+ chunkBucket(index, key)];
+
+		for (; slot != DIF_INDEX_NONE;
+			slot = index->next[slot * index->links + c])
+		{
+			const uint64_t other = index->items[slot].print;
+			unsigned int distance, prior;
+
+			if (chunkKey(index, c, other) != key)
+			{
+				continue;
+			}
+
+			for (prior = 0; prior < c; prior++)
+			{
+				if (chunkKey(index, prior, other)
+					== chunkKey(index, prior, print))
+				{
+					break;
+				}
+			}
+
+			if (prior < c)
+			{
+				continue;
+			}
+
+			if ((distance = difDistance(other, print)) <= within)
+			{
+				match(ctx, index->items[slot].id, distance);
+				found++;
+			}
+		}
+	}
+
+	return found;
+}
+
+size_t hammingIndexSize(const struct difHammingIndex * const index)
+{
+	return (index != NULL) ? index->live : 0;
+}
+
+void hammingIndexFree(struct difHammingIndex * const index)
+{
+	if (index == NULL)
+	{
+		return;
+	}
+
+	free(index->heads);
+	free(index->next);
+	free(index->items);
+	free(index);
+}
@@ -0,0 +1,23 @@
+#ifndef DIF_HAMMING_INDEX_H
+#define DIF_HAMMING_INDEX_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+
+/* Called once for every indexed print within the distance of a query */
+typedef void (*difHammingMatch)(void *ctx, size_t id, unsigned int distance);
+
+struct difHammingIndex;
+
+struct difHammingIndex* hammingIndexNew(const unsigned int threshold);
+int hammingIndexInsert(struct difHammingIndex * const index,
+	const uint64_t print, const size_t id);
+int hammingIndexRemove(struct difHammingIndex * const index,
+	const uint64_t print, const size_t id);
+size_t hammingIndexQuery(const struct difHammingIndex * const index,
+	const uint64_t print, const unsigned int within, difHammingMatch match,
+	void *ctx);
+size_t hammingIndexSize(const struct difHammingIndex * const index);
+void hammingIndexFree(struct difHammingIndex * const index);
+
+#endif /* DIF_HAMMING_INDEX_H */
@@ -1,16 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h> /* memcmp, memcpy */
+#include <ctype.h> /* tolower */
 #include <limits.h>
 
+#if !defined(DIF_DISABLE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define DIF_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif /* !DIF_DISABLE_MMAP && POSIX */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#endif /* !DIF_DISABLE_THREADING */
+
 #ifdef DIF_USE_IMAGEMAGICK
+#include <math.h> /* pow */
 #include <MagickCore/MagickCore.h>
 #else
 #include "thirdparty/stb_image.h"
-#include "thirdparty/stb_image_resize.h"
+#include "thirdparty/stb_image_resize.h" /* UNUSED */
 #include "thirdparty/stb_image_write.h" /* UNUSED */
 #endif /* !DIF_USE_IMAGEMAGICK */
 
+#include "imageHandling.h"
+
 #define DIF_CHECKED_FUNC(ptr, func) \
 do                                  \
 {                                   \
@@ -22,142 +40,1774 @@ do                                  \
 
 #define DIF_CHECKED_FREE(ptr) DIF_CHECKED_FUNC((ptr), free)
 
-void initializeImageHandling(const char * const program)
+#ifdef DIF_USE_MMAP
+/* Files smaller than this are read with a single pread into a buffer that is
+ * reused by the calling thread, mapping them would cost more in page faults
+ * and unmapping than the copy does */
+#define DIF_MMAP_THRESHOLD (128 * 1024)
+
+struct difReadBuffer
 {
-#ifdef DIF_USE_IMAGEMAGICK
-	MagickCoreGenesis(program, MagickTrue);
-#else
-	(void) program;
-#endif /* !DIF_USE_IMAGEMAGICK */
+	unsigned char *data;
+	size_t cap;
+};
+
+struct difFileView
+{
+	const unsigned char *data;
+	size_t len;
+	void *map; /* Non-NULL when data is a mapping to be released */
+};
+
+#ifndef DIF_DISABLE_THREADING
+static pthread_once_t read_buffer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t read_buffer_key;
+
+static void readBufferDestroy(void *ptr)
+{
+	struct difReadBuffer * const buf = (struct difReadBuffer *) ptr;
+
+	DIF_CHECKED_FREE(buf->data);
+	free(buf);
 }
 
-void cleanupImageHandling(void)
+static void readBufferKeyCreate(void)
 {
-#ifdef DIF_USE_IMAGEMAGICK
-	MagickCoreTerminus();
-#endif /* DIF_USE_IMAGEMAGICK */
+	pthread_key_create(&read_buffer_key, readBufferDestroy);
 }
 
-#ifdef DIF_USE_IMAGEMAGICK
-static int magickLoadAndScaleImage(const char * const path, 
-	const unsigned int width, const unsigned int height, 
-	unsigned char * const out)
+static struct difReadBuffer* getReadBuffer(void)
 {
-	CacheView *cache = NULL;
-	ExceptionInfo *exception = NULL;
-	ImageInfo *image_info = NULL;
-	Image *src_image = NULL;
-	Image *dst_image = NULL;
-	const Quantum *pixels;
-	int ret = 0;
-	const size_t lim = width * height;
-	size_t i;
+	struct difReadBuffer *buf;
 
-	if ((path == NULL) || (out == NULL))
+	pthread_once(&read_buffer_once, readBufferKeyCreate);
+
+	if (((buf = pthread_getspecific(read_buffer_key)) == NULL)
+	&& ((buf = calloc(1, sizeof(struct difReadBuffer))) != NULL))
 	{
-		ret = -1;
+		pthread_setspecific(read_buffer_key, buf);
+	}
 
-		goto CLEANUP;
+	return buf;
+}
+#else
+static struct difReadBuffer read_buffer = {NULL, 0};
+
+static struct difReadBuffer* getReadBuffer(void)
+{
+	return &read_buffer;
+}
+#endif /* DIF_DISABLE_THREADING */
+
+/* Reads at most limit bytes, or the whole file when limit is 0. Small reads
+ * land in the thread's buffer and are only valid until its next view. */
+static int openFileView(const char * const path, const size_t limit, 
+	struct difFileView * const view)
+{
+	struct difReadBuffer *buf;
+	struct stat info;
+	size_t len, done = 0;
+	int fd;
+
+	view->data = NULL;
+	view->len = 0;
+	view->map = NULL;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		return -1;
 	}
 
-	image_info = CloneImageInfo(NULL);
-	exception = AcquireExceptionInfo();
+	if ((fstat(fd, &info) != 0) || (info.st_size <= 0))
+	{
+		close(fd);
 
-	/* The handling on failure for all of these is the exact same */
-	if (((src_image = ReadImages(image_info, path, exception)) == NULL)
-	|| (TransformImageColorspace(src_image, GRAYColorspace, exception) 
-		!= MagickTrue)
-	|| (SetImageAlphaChannel(src_image, OffAlphaChannel, exception) 
-		!= MagickTrue)
-	|| ((dst_image = ResizeImage(src_image, width, height, TriangleFilter,
-		exception)) == NULL)
-	|| ((cache = AcquireVirtualCacheView(dst_image, exception)) == NULL)
-	|| ((pixels = GetCacheViewVirtualPixels(cache, 0, 0, width, height,
-		exception)) == NULL))
+		return -1;
+	}
+
+	len = (size_t) info.st_size;
+	len = ((limit != 0) && (limit < len)) ? limit : len;
+
+	if (len >= DIF_MMAP_THRESHOLD)
 	{
-		ret = -1;
-		MagickError(exception->severity, exception->reason,
-			exception->description);
+		void * const map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
 
-		goto CLEANUP;
+		if (map != MAP_FAILED)
+		{
+			(void) madvise(map, len, MADV_SEQUENTIAL);
+			close(fd);
+			view->data = map;
+			view->len = len;
+			view->map = map;
+
+			return 0;
+		}
 	}
 
-	for (i = 0; i < lim; i++)
+	if ((buf = getReadBuffer()) == NULL)
 	{
-		out[i] = (pixels[i] * UCHAR_MAX) / QuantumRange;
+		close(fd);
+
+		return -1;
 	}
 
-CLEANUP:
-	
-	DIF_CHECKED_FUNC(cache, DestroyCacheView);
-	DIF_CHECKED_FUNC(exception, DestroyExceptionInfo);
-	DIF_CHECKED_FUNC(image_info, DestroyImageInfo);
-	DIF_CHECKED_FUNC(src_image, DestroyImage);
-	DIF_CHECKED_FUNC(dst_image, DestroyImage);
+	/* The old buffer is kept on failure, it is still owned by the thread */
+	if (buf->cap < len)
+	{
+		unsigned char * const grown = realloc(buf->data, len);
 
-	return ret;
+		if (grown == NULL)
+		{
+			close(fd);
+
+			return -1;
+		}
+
+		buf->data = grown;
+		buf->cap = len;
+	}
+
+	while (done < len)
+	{
+		const ssize_t got = pread(fd, buf->data + done, len - done, 
+			(off_t) done);
+
+		if ((got < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+
+		if (got <= 0)
+		{
+			break;
+		}
+
+		done += (size_t) got;
+	}
+
+	close(fd);
+
+	if (done == 0)
+	{
+		return -1;
+	}
+
+	view->data = buf->data;
+	view->len = done;
+
+	return 0;
 }
 
-#else
+static void closeFileView(struct difFileView * const view)
+{
+	if (view->map != NULL)
+	{
+		munmap(view->map, view->len);
+	}
 
-static int scaleImage(unsigned char * const src_data, 
-	const size_t src_width, const size_t src_height, 
-	unsigned char * const dst_data, const size_t dst_width, 
-	const size_t dst_height)
+	view->data = NULL;
+	view->len = 0;
+	view->map = NULL;
+}
+#endif /* DIF_USE_MMAP */
+
+/* Decodes are only started once their estimated footprint fits in what is left
+ * of the budget, so a burst of huge images is taken a few at a time while the
+ * small ones keep going around them. An image bigger than the whole budget is
+ * let through once nothing else is held rather than never, and while one is 
+ * waiting for that nothing new is let in so it can't be passed over forever.
+ * Readers given DIF_READ_DEFER are turned away rather than made to wait. */
+static size_t mem_budget = 0; /* 0 for unlimited */
+static size_t mem_held = 0;
+static unsigned long mem_releases = 0;
+#ifndef DIF_DISABLE_THREADING
+static int mem_oversized = 0; /* An oversized decode is waiting to go alone */
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_released = PTHREAD_COND_INITIALIZER;
+#endif /* !DIF_DISABLE_THREADING */
+
+#ifndef DIF_DISABLE_THREADING
+static int budgetFits(const size_t bytes)
 {
-	if ((src_data == NULL) || (dst_data == NULL))
+	if (bytes > mem_budget)
 	{
-		fputs("Bad arguments to scaleImage\n", stderr);
+		return mem_held == 0;
+	}
 
-		return -1;
+	return (mem_oversized == 0) && (mem_held < mem_budget) 
+		&& (bytes <= mem_budget - mem_held);
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+/* On success held is what has to be handed back to budgetRelease once decoded.
+ * Returns -1, holding nothing, if flags has DIF_READ_DEFER and the decode 
+ * doesn't fit yet, otherwise the calling thread waits until it does. */
+static int budgetAcquire(const size_t bytes, const unsigned int flags,
+	size_t * const held)
+{
+	*held = 0;
+
+	if ((mem_budget == 0) || (bytes == 0))
+	{
+		return 0;
 	}
 
-	if (stbir_resize_uint8_generic(src_data, src_width, src_height, 0,
-		dst_data, dst_width, dst_height, 0, 1, 
-		STBIR_ALPHA_CHANNEL_NONE, 0, STBIR_EDGE_WRAP, 
-		STBIR_FILTER_TRIANGLE, STBIR_COLORSPACE_LINEAR, NULL) == 0)
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_lock(&mem_mutex);
+
+	while (!budgetFits(bytes))
 	{
-		fputs("Failed to rescale image\n", stderr);
+		if (bytes > mem_budget)
+		{
+			mem_oversized = 1;
+		}
+
+		if ((flags & DIF_READ_DEFER) != 0)
+		{
+			pthread_mutex_unlock(&mem_mutex);
 
-		goto BAIL_OUT;
+			return -1;
+		}
+
+		pthread_cond_wait(&mem_released, &mem_mutex);
+	}
+
+	if (bytes > mem_budget)
+	{
+		mem_oversized = 0;
 	}
+#else
+	(void) flags;
+#endif /* !DIF_DISABLE_THREADING */
+
+	mem_held += bytes;
 
-	free(src_data);
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_unlock(&mem_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	*held = bytes;
 
 	return 0;
+}
 
-BAIL_OUT:
+static void budgetRelease(const size_t bytes)
+{
+	if (bytes == 0)
+	{
+		return;
+	}
 
-	DIF_CHECKED_FREE(src_data);
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_lock(&mem_mutex);
+#endif /* !DIF_DISABLE_THREADING */
 
-	return -1;
+	mem_held -= bytes;
+	mem_releases++;
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_cond_broadcast(&mem_released);
+	pthread_mutex_unlock(&mem_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+}
+
+unsigned long imageBudgetReleases(void)
+{
+	unsigned long releases;
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_lock(&mem_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	releases = mem_releases;
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_unlock(&mem_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	return releases;
+}
+
+#ifdef DIF_USE_IMAGEMAGICK
+/* Private to the thumbnail path, which decodes outside the budget just as the
+ * stb one does since a thumbnail is never more than DIF_THUMB_HEAD_SIZE */
+#define DIF_READ_UNBUDGETED (1U << 31)
+
+/* Pixels are assumed to be held as RGBA when sizing the area limit */
+#define DIF_MAGICK_CACHE_CHANNELS (4)
 
+static MagickBooleanType magick_instantiated = MagickFalse;
+
+/* MagickCore's resource limits are process wide. The thread limit applies to
+ * each parallel region so it is what every worker's decode may fan out to, 
+ * while the area limit is checked per image and so is what each worker may 
+ * hold in memory before the pixel cache spills to disk. */
+static void magickSetResourceLimits(const struct difImageConfig * const config)
+{
+	const MagickSizeType cores = GetMagickResourceLimit(ThreadResource);
+	MagickSizeType memory = GetMagickResourceLimit(MemoryResource);
+	MagickSizeType workers = (config->workers == 0) 
+		? 1 : (MagickSizeType) config->workers;
+	MagickSizeType threads;
+
+	switch (config->parallelism)
+	{
+		case DIF_PARALLEL_IMAGES:
+			threads = 1;
+
+			break;
+		case DIF_PARALLEL_PIXELS:
+			threads = cores;
+
+			break;
+		case DIF_PARALLEL_AUTO: /* fallthrough */
+		default:
+			threads = cores / workers;
+
+			break;
+	}
+
+	(void) SetMagickResourceLimit(ThreadResource, 
+		(threads == 0) ? 1 : threads);
+
+	/* Admission already keeps the decodes in flight within the budget so 
+	 * any one of them may use all of it */
+	if ((config->mem_budget != 0) 
+	&& ((MagickSizeType) config->mem_budget < memory))
+	{
+		memory = (MagickSizeType) config->mem_budget;
+		workers = 1;
+		(void) SetMagickResourceLimit(MemoryResource, memory);
+	}
+
+	(void) SetMagickResourceLimit(AreaResource, 
+		memory / (workers * DIF_MAGICK_CACHE_CHANNELS * sizeof(Quantum)));
+}
+
+/* Gray levels of the 8 bit CIE L* values, filled once at initialisation.
+ * L* is turned back into relative luminance and then gamma encoded the way
+ * sRGB is, so a Lab source gets the same luma its sRGB conversion would. */
+static unsigned char magick_lab_gray[256];
+
+static void magickFillLabGray(void)
+{
+	size_t i;
+
+	for (i = 0; i < 256; i++)
+	{
+		const double l = ((double) i * 100.0) / 255.0;
+		const double lum = (l > 8.0) ? pow((l + 16.0) / 116.0, 3.0)
+			: l / 903.3;
+		const double enc = (lum <= 0.0031308) ? lum * 12.92
+			: (1.055 * pow(lum, 1.0 / 2.4)) - 0.055;
+
+		magick_lab_gray[i] = (unsigned char) ((enc * 255.0) + 0.5);
+	}
 }
+#endif /* DIF_USE_IMAGEMAGICK */
+
+void initializeImageHandling(const struct difImageConfig * const config)
+{
+	mem_budget = config->mem_budget;
+	mem_held = 0;
 
+#ifdef DIF_USE_IMAGEMAGICK
+	MagickCoreGenesis(config->program, MagickTrue);
+	magick_instantiated = MagickTrue;
+	magickSetResourceLimits(config);
+	magickFillLabGray();
+#else
+	(void) config;
 #endif /* !DIF_USE_IMAGEMAGICK */
+}
 
-int readImageFile(const char * const in_path, const size_t dst_width,
-	const size_t dst_height, unsigned char *output)
+void cleanupImageHandling(void)
 {
-#ifndef DIF_USE_IMAGEMAGICK
-	int src_width;
-	int src_height;
-	int dummy;
-	unsigned char *src_data = NULL;
+#if defined(DIF_USE_MMAP) && defined(DIF_DISABLE_THREADING)
+	DIF_CHECKED_FREE(read_buffer.data);
+	read_buffer.data = NULL;
+	read_buffer.cap = 0;
+#endif /* DIF_USE_MMAP && DIF_DISABLE_THREADING */
+
+#ifdef DIF_USE_IMAGEMAGICK
+	if (magick_instantiated == MagickTrue)
+	{
+		MagickCoreTerminus();
+		magick_instantiated = MagickFalse;
+	}
+#endif /* DIF_USE_IMAGEMAGICK */
+}
+
+/* Area averaging reduction fed one source row at a time. Every source pixel is
+ * added to each destination cell its footprint overlaps so only the target
+ * sized accumulators are ever held, the source rows can be discarded as soon
+ * as they have been folded in. The source columns overlapping a destination 
+ * column are always a contiguous run, so each row is folded in as one sum per
+ * destination column rather than pixel by pixel. */
+struct difReducer
+{
+	size_t src_width;
+	size_t src_height;
+	size_t dst_width;
+	size_t dst_height;
+	size_t channels;
+	size_t *col_first;  /* dst_width, first source column per cell */
+	size_t *col_last;   /* dst_width, last source column per cell */
+	uint64_t *row_sums; /* dst_width * channels, the row being folded in */
+	uint64_t *sums;     /* dst_width * dst_height * channels */
+	uint64_t *count;    /* dst_width * dst_height */
+};
+
+static void reducerSpan(const size_t pos, const size_t src, const size_t dst,
+	size_t *lo, size_t *hi)
+{
+	*lo = (pos * dst) / src;
+	*hi = (((pos + 1) * dst) - 1) / src;
+}
+
+static void reducerCleanup(struct difReducer * const red)
+{
+	DIF_CHECKED_FREE(red->col_first);
+	DIF_CHECKED_FREE(red->col_last);
+	DIF_CHECKED_FREE(red->row_sums);
+	DIF_CHECKED_FREE(red->sums);
+	DIF_CHECKED_FREE(red->count);
+	red->col_first = NULL;
+	red->col_last = NULL;
+	red->row_sums = NULL;
+	red->sums = NULL;
+	red->count = NULL;
+}
+
+static int reducerInit(struct difReducer * const red, const size_t src_width,
+	const size_t src_height, const size_t dst_width, 
+	const size_t dst_height, const size_t channels)
+{
+	const size_t cells = dst_width * dst_height;
+	size_t i, lo, hi, dx, prev_hi = 0;
+
+	red->col_first = NULL;
+	red->col_last = NULL;
+	red->row_sums = NULL;
+	red->sums = NULL;
+	red->count = NULL;
 
-	if ((output == NULL)
-	|| (src_data = stbi_load(in_path, &src_width, &src_height, &dummy, 1))
+	if ((src_width == 0) || (src_height == 0) || (cells == 0)
+	|| ((channels != 1) && (channels != 3))
+	|| ((red->col_first = malloc(sizeof(size_t) * dst_width)) == NULL)
+	|| ((red->col_last = malloc(sizeof(size_t) * dst_width)) == NULL)
+	|| ((red->row_sums = malloc(sizeof(uint64_t) * dst_width * channels))
 		== NULL)
+	|| ((red->sums = calloc(cells * channels, sizeof(uint64_t))) == NULL)
+	|| ((red->count = calloc(cells, sizeof(uint64_t))) == NULL))
 	{
-		fprintf(stderr, "Failed load: '%s'\n", in_path);
+		reducerCleanup(red);
 
 		return -1;
 	}
 
-	return scaleImage(src_data, src_width, src_height, output, dst_width, 
-		dst_height);
-#else
-	return magickLoadAndScaleImage(in_path, dst_width, dst_height, output);
-#endif /* DIF_USE_IMAGEMAGICK */
+	red->src_width = src_width;
+	red->src_height = src_height;
+	red->dst_width = dst_width;
+	red->dst_height = dst_height;
+	red->channels = channels;
+
+	/* Spans only ever move right, so a cell is first touched by whichever
+	 * source column reaches past the previous column's span */
+	for (i = 0; i < src_width; i++)
+	{
+		reducerSpan(i, src_width, dst_width, &lo, &hi);
+
+		for (dx = lo; dx <= hi; dx++)
+		{
+			if ((i == 0) || (dx > prev_hi))
+			{
+				red->col_first[dx] = i;
+			}
+
+			red->col_last[dx] = i;
+		}
+
+		prev_hi = hi;
+	}
+
+	return 0;
 }
 
+/* row holds src_width interleaved pixels of red->channels bytes each */
+static void reducerFeedRow(struct difReducer * const red, const size_t y,
+	const unsigned char * const row)
+{
+	const size_t ch = red->channels;
+	size_t row_lo, row_hi, x, dy, dx, c;
+
+	if (y >= red->src_height)
+	{
+		return;
+	}
+
+	for (dx = 0; dx < red->dst_width; dx++)
+	{
+		const size_t last = red->col_last[dx];
+
+		for (c = 0; c < ch; c++)
+		{
+			uint64_t total = 0;
+
+			for (x = red->col_first[dx]; x <= last; x++)
+			{
+				total += row[(x * ch) + c];
+			}
+
+			red->row_sums[(dx * ch) + c] = total;
+		}
+	}
+
+	reducerSpan(y, red->src_height, red->dst_height, &row_lo, &row_hi);
+
+	for (dy = row_lo; dy <= row_hi; dy++)
+	{
+		uint64_t * const sums = &red->sums[dy * red->dst_width * ch];
+		uint64_t * const count = &red->count[dy * red->dst_width];
+
+		for (dx = 0; dx < red->dst_width; dx++)
+		{
+			for (c = 0; c < ch; c++)
+			{
+				sums[(dx * ch) + c] += red->row_sums[(dx * ch) + c];
+			}
+
+			count[dx] += red->col_last[dx] - red->col_first[dx] + 1;
+		}
+	}
+}
+
+/* Writes the single channel averages to out, colour sources are converted to
+ * luma here on the reduced cells using the same weights stbi uses */
+static int reducerFinish(struct difReducer * const red, 
+	unsigned char * const out)
+{
+	const size_t cells = red->dst_width * red->dst_height;
+	size_t i;
+
+	for (i = 0; i < cells; i++)
+	{
+		const uint64_t * const sums = &red->sums[i * red->channels];
+		const uint64_t count = red->count[i];
+
+		if (count == 0)
+		{
+			return -1;
+		}
+
+		if (red->channels == 1)
+		{
+			out[i] = (unsigned char) (sums[0] / count);
+		}
+		else
+		{
+			out[i] = (unsigned char) (((sums[0] * 77) + (sums[1] * 150)
+				+ (sums[2] * 29)) / (count << 8));
+		}
+	}
+
+	return 0;
+}
+
+#ifdef DIF_USE_IMAGEMAGICK
+/* Decoders that can scale while decoding are asked for at least this many
+ * times the target size, leaving the reducer enough pixels to average */
+#define DIF_MAGICK_HINT_SCALE (8)
+
+/* Only the first frame of a multi-frame file is ever fingerprinted and the
+ * JPEG decoder can drop straight to 1/2, 1/4 or 1/8 scale in the DCT */
+static void magickSetDecodeHints(ImageInfo * const image_info, 
+	const unsigned int width, const unsigned int height)
+{
+	char geometry[MagickPathExtent];
+
+	(void) FormatLocaleString(geometry, MagickPathExtent, "%ux%u", 
+		width * DIF_MAGICK_HINT_SCALE, height * DIF_MAGICK_HINT_SCALE);
+	(void) SetImageOption(image_info, "jpeg:size", geometry);
+	(void) SetImageOption(image_info, "jpeg:dct-method", "ifast");
+	image_info->scene = 0;
+	image_info->number_scenes = 1;
+}
+
+/* Returns how many channels a source is reduced with, or 0 when it has to be
+ * transformed to sRGB first. Each row is brought down to gray or RGB as it is
+ * read, so the colorspaces handled here never need the whole raster. Gray,
+ * Lab and the luma carrying YCbCr family reduce their lightness channel,
+ * RGB and CMYK reduce as RGB and are converted to luma once target sized. */
+static size_t magickReduceChannels(const Image * const image)
+{
+	switch (image->colorspace)
+	{
+		case GRAYColorspace: /* fallthrough */
+		case LinearGRAYColorspace: /* fallthrough */
+		case LabColorspace: /* fallthrough */
+		case LCHabColorspace: /* fallthrough */
+		case YCbCrColorspace: /* fallthrough */
+		case Rec601YCbCrColorspace: /* fallthrough */
+		case Rec709YCbCrColorspace: /* fallthrough */
+		case YPbPrColorspace: /* fallthrough */
+		case YUVColorspace: /* fallthrough */
+		case YIQColorspace:
+			return 1;
+		case sRGBColorspace: /* fallthrough */
+		case RGBColorspace: /* fallthrough */
+		case CMYKColorspace:
+			return 3;
+		default:
+			return 0;
+	}
+}
+
+/* Alpha and any other extra channels are simply not read. CMYK is undone with
+ * the same profile-less formula TransformImageColorspace uses. */
+static void magickConvertRow(const Image * const image, 
+	const Quantum *pixels, const size_t columns, const size_t channels,
+	unsigned char *dst)
+{
+	const ColorspaceType space = image->colorspace;
+	size_t x;
+
+	for (x = 0; x < columns; x++)
+	{
+		if (space == CMYKColorspace)
+		{
+			const unsigned int k = 255U - ScaleQuantumToChar(
+				GetPixelBlack(image, pixels));
+
+			*(dst++) = (unsigned char) ((((255U - ScaleQuantumToChar(
+				GetPixelCyan(image, pixels))) * k) + 127U) / 255U);
+			*(dst++) = (unsigned char) ((((255U - ScaleQuantumToChar(
+				GetPixelMagenta(image, pixels))) * k) + 127U) / 255U);
+			*(dst++) = (unsigned char) ((((255U - ScaleQuantumToChar(
+				GetPixelYellow(image, pixels))) * k) + 127U) / 255U);
+		}
+		else if ((space == LabColorspace) || (space == LCHabColorspace))
+		{
+			/* L* is held in the first channel */
+			*(dst++) = magick_lab_gray[ScaleQuantumToChar(
+				GetPixelRed(image, pixels))];
+		}
+		else if ((channels == 1) && (space != GRAYColorspace)
+		&& (space != LinearGRAYColorspace))
+		{
+			/* Y, already gamma encoded luma, is held in the first
+			 * channel */
+			*(dst++) = ScaleQuantumToChar(GetPixelRed(image, pixels));
+		}
+		else if (channels == 1)
+		{
+			*(dst++) = ScaleQuantumToChar(GetPixelGray(image, pixels));
+		}
+		else
+		{
+			*(dst++) = ScaleQuantumToChar(GetPixelRed(image, pixels));
+			*(dst++) = ScaleQuantumToChar(GetPixelGreen(image, 
+				pixels));
+			*(dst++) = ScaleQuantumToChar(GetPixelBlue(image, pixels));
+		}
+
+		pixels += GetPixelChannels(image);
+	}
+}
+
+/* Takes ownership of src_image, which is destroyed before returning */
+static int magickScaleImage(Image *src_image, const unsigned int width, 
+	const unsigned int height, unsigned char * const out, 
+	ExceptionInfo *exception)
+{
+	struct difReducer red = {0};
+	CacheView *cache = NULL;
+	unsigned char *row = NULL;
+	size_t channels;
+	int ret = 0;
+	size_t y;
+
+	if (src_image == NULL)
+	{
+		MagickError(exception->severity, exception->reason,
+			exception->description);
+
+		return -1;
+	}
+
+	if (((channels = magickReduceChannels(src_image)) == 0)
+	&& (TransformImageColorspace(src_image, sRGBColorspace, exception)
+		== MagickTrue))
+	{
+		channels = 3;
+	}
+
+	/* The handling on failure for all of these is the exact same */
+	if ((channels == 0)
+	|| (reducerInit(&red, src_image->columns, src_image->rows, width, 
+		height, channels) != 0)
+	|| ((row = malloc(src_image->columns * channels)) == NULL)
+	|| ((cache = AcquireVirtualCacheView(src_image, exception)) == NULL))
+	{
+		ret = -1;
+		MagickError(exception->severity, exception->reason,
+			exception->description);
+
+		goto CLEANUP;
+	}
+
+	/* Pulls the pixel stream a row at a time rather than resizing into a
+	 * second image */
+	for (y = 0; y < src_image->rows; y++)
+	{
+		const Quantum * const pixels = GetCacheViewVirtualPixels(cache, 
+			0, (ssize_t) y, src_image->columns, 1, exception);
+
+		if (pixels == NULL)
+		{
+			ret = -1;
+			MagickError(exception->severity, exception->reason,
+				exception->description);
+
+			goto CLEANUP;
+		}
+
+		magickConvertRow(src_image, pixels, src_image->columns, channels,
+			row);
+		reducerFeedRow(&red, y, row);
+	}
+
+	ret = reducerFinish(&red, out);
+
+CLEANUP:
+	
+	DIF_CHECKED_FUNC(cache, DestroyCacheView);
+	DIF_CHECKED_FUNC(src_image, DestroyImage);
+	DIF_CHECKED_FREE(row);
+	reducerCleanup(&red);
+
+	return ret;
+}
+
+/* Sources with at least this many pixels, after any decode hints, are read
+ * through the pixel stream so they never become resident in the cache */
+#define DIF_MAGICK_STREAM_AREA (16 * 1024 * 1024)
+
+struct difMagickStream
+{
+	struct difReducer red;
+	unsigned char *row;
+	size_t channels;
+	size_t y;
+	int failed;
+};
+
+/* Called by the coder for each row it produces, returning anything other than
+ * columns aborts the read. Tiled sources aren't supported: the coder hands
+ * over one tile wide run at a time with nothing saying where it belongs, so
+ * anything that isn't a whole row in order is refused and the source is left
+ * to the rasterising path. */
+static size_t magickStreamRow(const Image *image, const void *pixels, 
+	const size_t columns)
+{
+	struct difMagickStream * const stream 
+		= (struct difMagickStream *) image->client_data;
+
+	if ((stream == NULL) || (stream->failed != 0))
+	{
+		return 0;
+	}
+
+	if ((stream->row == NULL)
+	&& (((stream->channels = magickReduceChannels(image)) == 0)
+	|| (reducerInit(&stream->red, image->columns, image->rows, 
+		stream->red.dst_width, stream->red.dst_height, stream->channels) 
+		!= 0)
+	|| ((stream->row = malloc(image->columns * stream->channels)) 
+		== NULL)))
+	{
+		stream->failed = 1;
+
+		return 0;
+	}
+
+	if ((columns != stream->red.src_width) 
+	|| (stream->y >= stream->red.src_height))
+	{
+		stream->failed = 1;
+
+		return 0;
+	}
+
+	magickConvertRow(image, (const Quantum *) pixels, columns, 
+		stream->channels, stream->row);
+	reducerFeedRow(&stream->red, stream->y++, stream->row);
+
+	return columns;
+}
+
+/* Returns -1 without having written out if the source couldn't be streamed */
+static int magickStreamAndScaleImage(ImageInfo * const image_info, 
+	const unsigned int width, const unsigned int height, 
+	unsigned char * const out, ExceptionInfo *exception)
+{
+	struct difMagickStream stream = {{0}};
+	Image *image = NULL;
+	int ret = -1;
+
+	stream.red.dst_width = width;
+	stream.red.dst_height = height;
+	image_info->client_data = &stream;
+
+	if (((image = ReadStream(image_info, magickStreamRow, exception)) 
+		!= NULL)
+	&& (stream.failed == 0) && (stream.row != NULL)
+	&& (stream.y == stream.red.src_height))
+	{
+		ret = reducerFinish(&stream.red, out);
+	}
+
+	image_info->client_data = NULL;
+	DIF_CHECKED_FUNC(image, DestroyImage);
+	DIF_CHECKED_FREE(stream.row);
+	reducerCleanup(&stream.red);
+
+	return ret;
+}
+
+static size_t magickFootprint(const Image * const ping)
+{
+	return (ping == NULL) ? 0 : (size_t) ping->columns * ping->rows 
+		* DIF_MAGICK_CACHE_CHANNELS * sizeof(Quantum);
+}
+
+static int magickLoadAndScaleImage(const char * const path, 
+	const unsigned int width, const unsigned int height, 
+	unsigned char * const out, const unsigned int flags)
+{
+	ExceptionInfo *exception = NULL;
+	ImageInfo *image_info = NULL;
+	Image *ping = NULL;
+	size_t held;
+	int streamed = 0;
+	int ret = -1;
+
+	if ((path == NULL) || (out == NULL))
+	{
+		return -1;
+	}
+
+	image_info = CloneImageInfo(NULL);
+	exception = AcquireExceptionInfo();
+	magickSetDecodeHints(image_info, width, height);
+	(void) CopyMagickString(image_info->filename, path, MagickPathExtent);
+
+	if (((ping = PingImage(image_info, exception)) != NULL)
+	&& (ping->columns * ping->rows >= DIF_MAGICK_STREAM_AREA))
+	{
+		ret = magickStreamAndScaleImage(image_info, width, height, out, 
+			exception);
+		ClearMagickException(exception);
+		streamed = 1;
+	}
+
+	if ((ret != 0) && (budgetAcquire(magickFootprint(ping), flags, &held) 
+		!= 0))
+	{
+		ret = DIF_DEFERRED;
+	}
+	else if (ret != 0)
+	{
+		/* Usually a tiled layout or an unusual colorspace */
+		if (streamed)
+		{
+			fprintf(stderr, "'%s' couldn't be streamed, decoding all "
+				"%zux%zu pixels of it\n", path, 
+				(size_t) ping->columns, (size_t) ping->rows);
+		}
+
+		ret = magickScaleImage(ReadImages(image_info, path, exception), 
+			width, height, out, exception);
+		budgetRelease(held);
+	}
+
+	DIF_CHECKED_FUNC(ping, DestroyImage);
+	DIF_CHECKED_FUNC(exception, DestroyExceptionInfo);
+	DIF_CHECKED_FUNC(image_info, DestroyImageInfo);
+
+	return ret;
+}
+
+static int magickLoadAndScaleBlob(const unsigned char * const blob,
+	const size_t len, const unsigned int width, const unsigned int height,
+	unsigned char * const out, const unsigned int flags)
+{
+	ExceptionInfo *exception = NULL;
+	ImageInfo *image_info = NULL;
+	Image *ping = NULL;
+	size_t held;
+	int ret;
+
+	if ((blob == NULL) || (out == NULL))
+	{
+		return -1;
+	}
+
+	image_info = CloneImageInfo(NULL);
+	exception = AcquireExceptionInfo();
+	magickSetDecodeHints(image_info, width, height);
+
+	if ((mem_budget != 0) && ((flags & DIF_READ_UNBUDGETED) == 0))
+	{
+		ping = PingBlob(image_info, blob, len, exception);
+		ClearMagickException(exception);
+	}
+
+	if (budgetAcquire(magickFootprint(ping), flags, &held) != 0)
+	{
+		ret = DIF_DEFERRED;
+	}
+	else
+	{
+		ret = magickScaleImage(BlobToImage(image_info, blob, len, 
+			exception), width, height, out, exception);
+		budgetRelease(held);
+	}
+
+	DIF_CHECKED_FUNC(ping, DestroyImage);
+	DIF_CHECKED_FUNC(exception, DestroyExceptionInfo);
+	DIF_CHECKED_FUNC(image_info, DestroyImageInfo);
+
+	return ret;
+}
+
+/* Whether the image in the blob is at least width by height, only pinged so
+ * nothing is decoded. Without size hints the full dimensions are given. */
+static int magickBlobCovers(const unsigned char * const blob,
+	const size_t len, const size_t width, const size_t height)
+{
+	ExceptionInfo *exception = NULL;
+	ImageInfo *image_info = NULL;
+	Image *ping = NULL;
+	int ret = 0;
+
+	if (blob == NULL)
+	{
+		return 0;
+	}
+
+	image_info = CloneImageInfo(NULL);
+	exception = AcquireExceptionInfo();
+
+	if ((ping = PingBlob(image_info, blob, len, exception)) != NULL)
+	{
+		ret = ((size_t) ping->columns >= width) 
+			&& ((size_t) ping->rows >= height);
+	}
+
+	DIF_CHECKED_FUNC(ping, DestroyImage);
+	DIF_CHECKED_FUNC(exception, DestroyExceptionInfo);
+	DIF_CHECKED_FUNC(image_info, DestroyImageInfo);
+
+	return ret;
+}
+
+#else
+
+/* stb's decoders only hand back complete frames so the rows are folded in
+ * from the decoded buffer, this still avoids the resizer's working copies */
+static int scaleImage(unsigned char * const src_data, 
+	const size_t src_width, const size_t src_height, 
+	unsigned char * const dst_data, const size_t dst_width, 
+	const size_t dst_height)
+{
+	struct difReducer red;
+	int ret;
+	size_t y;
+
+	if ((src_data == NULL) || (dst_data == NULL))
+	{
+		fputs("Bad arguments to scaleImage\n", stderr);
+		DIF_CHECKED_FUNC(src_data, stbi_image_free);
+
+		return -1;
+	}
+
+	if (reducerInit(&red, src_width, src_height, dst_width, dst_height, 1)
+		!= 0)
+	{
+		fputs("Failed to rescale image\n", stderr);
+		stbi_image_free(src_data);
+
+		return -1;
+	}
+
+	for (y = 0; y < src_height; y++)
+	{
+		reducerFeedRow(&red, y, &src_data[y * src_width]);
+	}
+
+	ret = reducerFinish(&red, dst_data);
+	reducerCleanup(&red);
+	stbi_image_free(src_data);
+
+	return ret;
+}
+
+#endif /* !DIF_USE_IMAGEMAGICK */
+
+/* Cameras place the EXIF block, thumbnail included, right after the SOI
+ * marker so the head of the file is all that needs to be read. Anything that
+ * doesn't fit inside of it is simply treated as not having a thumbnail. */
+#define DIF_THUMB_HEAD_SIZE (65536)
+
+static uint32_t readExifInt(const unsigned char * const ptr, 
+	const size_t width, const int big_endian)
+{
+	uint32_t ret = 0;
+	size_t i;
+
+	for (i = 0; i < width; i++)
+	{
+		ret |= ((uint32_t) ptr[(big_endian) ? i : width - 1 - i]) 
+			<< (8 * (width - 1 - i));
+	}
+
+	return ret;
+}
+
+/* Walks the IFD1 of a TIFF structure looking for the JPEGInterchangeFormat
+ * offset and length tags, returns 0 on success */
+static int findExifThumbnail(const unsigned char * const tiff, 
+	const size_t len, const unsigned char **thumb, size_t *thumb_len)
+{
+	uint32_t offset, count, i;
+	uint32_t thumb_off = 0;
+	uint32_t thumb_size = 0;
+	int big_endian;
+
+	if ((len < 8) 
+	|| ((tiff[0] != tiff[1]) || ((tiff[0] != 'I') && (tiff[0] != 'M'))))
+	{
+		return -1;
+	}
+
+	big_endian = (tiff[0] == 'M');
+	offset = readExifInt(&tiff[4], 4, big_endian);
+
+	/* Skip over IFD0 to find the offset of IFD1 */
+	if ((offset > len - 6)
+	|| ((count = readExifInt(&tiff[offset], 2, big_endian)) 
+		> (len - offset - 6) / 12)
+	|| ((offset = readExifInt(&tiff[offset + 2 + (count * 12)], 4, 
+		big_endian)) == 0)
+	|| (offset > len - 2)
+	|| ((count = readExifInt(&tiff[offset], 2, big_endian))
+		> (len - offset - 2) / 12))
+	{
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		const unsigned char * const tag = &tiff[offset + 2 + (i * 12)];
+
+		switch (readExifInt(tag, 2, big_endian))
+		{
+			case 0x0201: /* JPEGInterchangeFormat */
+				thumb_off = readExifInt(&tag[8], 4, big_endian);
+
+				break;
+			case 0x0202: /* JPEGInterchangeFormatLength */
+				thumb_size = readExifInt(&tag[8], 4, 
+					big_endian);
+
+				break;
+			default:
+				break;
+		}
+	}
+
+	if ((thumb_off == 0) || (thumb_size == 0) || (thumb_off > len)
+	|| (thumb_size > len - thumb_off))
+	{
+		return -1;
+	}
+
+	*thumb = &tiff[thumb_off];
+	*thumb_len = thumb_size;
+
+	return 0;
+}
+
+/* Scans the JPEG markers preceding the image data for either an EXIF APP1
+ * segment or a JFIF extension APP0 segment carrying a JPEG coded thumbnail, 
+ * returns 0 on success */
+static int findEmbeddedThumbnail(const unsigned char * const head,
+	const size_t len, const unsigned char **thumb, size_t *thumb_len)
+{
+	size_t pos = 2;
+
+	if ((len < 4) || (head[0] != 0xFF) || (head[1] != 0xD8))
+	{
+		return -1;
+	}
+
+	while ((pos + 4 <= len) && (head[pos] == 0xFF))
+	{
+		const unsigned char marker = head[pos + 1];
+		const unsigned char * const data = &head[pos + 4];
+		size_t seg_len;
+
+		if (marker == 0xFF) /* Fill byte */
+		{
+			pos++;
+
+			continue;
+		}
+
+		/* Thumbnails only ever show up before the scan data */
+		if ((marker == 0xDA) || (marker == 0xD9)
+		|| ((seg_len = readExifInt(&head[pos + 2], 2, 1)) < 2))
+		{
+			break;
+		}
+
+		seg_len -= 2;
+
+		/* Truncated by the head read, it's the rest or nothing */
+		if (seg_len > len - pos - 4)
+		{
+			seg_len = len - pos - 4;
+		}
+
+		if ((marker == 0xE1) && (seg_len > 6) 
+		&& (memcmp(data, "Exif\0\0", 6) == 0)
+		&& (findExifThumbnail(&data[6], seg_len - 6, thumb, 
+			thumb_len) == 0))
+		{
+			return 0;
+		}
+
+		/* JFXX extension code 0x10 is a JPEG coded thumbnail */
+		if ((marker == 0xE0) && (seg_len > 6)
+		&& (memcmp(data, "JFXX\0", 5) == 0) && (data[5] == 0x10))
+		{
+			*thumb = &data[6];
+			*thumb_len = seg_len - 6;
+
+			return 0;
+		}
+
+		pos += 4 + seg_len;
+	}
+
+	return -1;
+}
+
+/* Returns DIF_LOADED_THUMBNAIL on success and -1 if no usable thumbnail could
+ * be found in the given head of the file */
+static int decodeEmbeddedThumbnail(const unsigned char * const head,
+	const size_t head_len, const size_t dst_width, const size_t dst_height,
+	unsigned char * const output)
+{
+	const unsigned char *thumb = NULL;
+	size_t thumb_len;
+	int ret = -1;
+#ifndef DIF_USE_IMAGEMAGICK
+	int src_width;
+	int src_height;
+	int dummy;
+	unsigned char *src_data = NULL;
+#endif /* !DIF_USE_IMAGEMAGICK */
+
+	if (findEmbeddedThumbnail(head, head_len, &thumb, &thumb_len) != 0)
+	{
+		return -1;
+	}
+
+#ifndef DIF_USE_IMAGEMAGICK
+	/* A thumbnail smaller than the target is of no use for hashing */
+	if (((src_data = stbi_load_from_memory(thumb, (int) thumb_len, 
+		&src_width, &src_height, &dummy, 1)) != NULL)
+	&& ((size_t) src_width >= dst_width) 
+	&& ((size_t) src_height >= dst_height))
+	{
+		ret = (scaleImage(src_data, src_width, src_height, output, 
+			dst_width, dst_height) == 0) ? DIF_LOADED_THUMBNAIL : -1;
+		src_data = NULL;
+	}
+
+	DIF_CHECKED_FUNC(src_data, stbi_image_free);
+#else
+	/* As above, a thumbnail would only be upscaled into a different print
+	 * from the one the full image gives */
+	if ((magickBlobCovers(thumb, thumb_len, dst_width, dst_height))
+	&& (magickLoadAndScaleBlob(thumb, thumb_len, dst_width, dst_height,
+		output, DIF_READ_UNBUDGETED) == 0))
+	{
+		ret = DIF_LOADED_THUMBNAIL;
+	}
+#endif /* DIF_USE_IMAGEMAGICK */
+
+	return ret;
+}
+
+/* Returns DIF_LOADED_THUMBNAIL on success and -1 if no usable thumbnail could
+ * be found in which case the caller should fall back to a full decode */
+static int readEmbeddedThumbnail(const char * const in_path, 
+	const size_t dst_width, const size_t dst_height, 
+	unsigned char * const output)
+{
+#ifdef DIF_USE_MMAP
+	struct difFileView view = {NULL, 0, NULL};
+#else
+	FILE *file = NULL;
+	unsigned char *head = NULL;
+	size_t head_len;
+#endif /* !DIF_USE_MMAP */
+	int ret = -1;
+
+#ifdef DIF_USE_MMAP
+	if (openFileView(in_path, DIF_THUMB_HEAD_SIZE, &view) == 0)
+	{
+		ret = decodeEmbeddedThumbnail(view.data, view.len, dst_width,
+			dst_height, output);
+		closeFileView(&view);
+	}
+#else
+	if (((file = fopen(in_path, "rb")) != NULL)
+	&& ((head = malloc(DIF_THUMB_HEAD_SIZE)) != NULL)
+	&& ((head_len = fread(head, 1, DIF_THUMB_HEAD_SIZE, file)) != 0))
+	{
+		ret = decodeEmbeddedThumbnail(head, head_len, dst_width,
+			dst_height, output);
+	}
+
+	DIF_CHECKED_FUNC(file, fclose);
+	DIF_CHECKED_FREE(head);
+#endif /* !DIF_USE_MMAP */
+
+	return ret;
+}
+
+#ifndef DIF_USE_IMAGEMAGICK
+/* stb decodes at the file's own channel count and depth before converting to
+ * the single grey channel asked for, so both buffers are live at once */
+static size_t stbFootprint(const int width, const int height, 
+	const int channels, const int is_16_bit)
+{
+	return (size_t) width * (size_t) height * (size_t) (channels + 1) 
+		* (is_16_bit ? 2 : 1);
+}
+
+/* The hold taken on the budget is left for the caller to release once the 
+ * decoded pixels have been freed. A decode the budget turned away returns NULL
+ * with deferred set. */
+static unsigned char* stbLoadMemory(const unsigned char * const data, 
+	const size_t len, const unsigned int flags, int * const src_width, 
+	int * const src_height, size_t * const held, int * const deferred)
+{
+	unsigned char *src_data = NULL;
+	int dummy;
+
+	*held = 0;
+	*deferred = 0;
+
+	if (len > INT_MAX)
+	{
+		return NULL;
+	}
+
+	if ((mem_budget != 0)
+	&& (stbi_info_from_memory(data, (int) len, src_width, src_height, 
+		&dummy) != 0)
+	&& (budgetAcquire(stbFootprint(*src_width, *src_height, dummy, 
+		stbi_is_16_bit_from_memory(data, (int) len)), flags, held) != 0))
+	{
+		*deferred = 1;
+
+		return NULL;
+	}
+
+	if ((src_data = stbi_load_from_memory(data, (int) len, src_width, 
+		src_height, &dummy, 1)) == NULL)
+	{
+		budgetRelease(*held);
+		*held = 0;
+	}
+
+	return src_data;
+}
+
+/* Hands stb the mapped or pread file contents directly rather than letting it
+ * go through stdio, falling back to stbi_load when that isn't possible */
+static unsigned char* stbLoadFile(const char * const in_path, 
+	const unsigned int flags, int * const src_width, int * const src_height,
+	size_t * const held, int * const deferred)
+{
+	unsigned char *src_data = NULL;
+	int dummy;
+#ifdef DIF_USE_MMAP
+	struct difFileView view;
+
+	if (openFileView(in_path, 0, &view) == 0)
+	{
+		if (view.len <= INT_MAX)
+		{
+			src_data = stbLoadMemory(view.data, view.len, 
+				flags, src_width, src_height, held, deferred);
+			closeFileView(&view);
+
+			return src_data;
+		}
+
+		closeFileView(&view);
+	}
+#endif /* DIF_USE_MMAP */
+
+	*held = 0;
+	*deferred = 0;
+
+	if ((mem_budget != 0)
+	&& (stbi_info(in_path, src_width, src_height, &dummy) != 0)
+	&& (budgetAcquire(stbFootprint(*src_width, *src_height, dummy, 
+		stbi_is_16_bit(in_path)), flags, held) != 0))
+	{
+		*deferred = 1;
+
+		return NULL;
+	}
+
+	if ((src_data = stbi_load(in_path, src_width, src_height, &dummy, 1)) 
+		== NULL)
+	{
+		budgetRelease(*held);
+		*held = 0;
+	}
+
+	return src_data;
+}
+#endif /* !DIF_USE_IMAGEMAGICK */
+
+int readImageFile(const char * const in_path, const size_t dst_width,
+	const size_t dst_height, unsigned char *output, 
+	const unsigned int flags)
+{
+#ifndef DIF_USE_IMAGEMAGICK
+	int src_width;
+	int src_height;
+	unsigned char *src_data = NULL;
+	size_t held;
+	int deferred;
+	int ret;
+#endif /* !DIF_USE_IMAGEMAGICK */
+
+	if ((output == NULL) || (in_path == NULL))
+	{
+		fputs("Bad arguments to readImageFile\n", stderr);
+
+		return -1;
+	}
+
+	if (((flags & DIF_READ_THUMBNAIL) != 0)
+	&& (readEmbeddedThumbnail(in_path, dst_width, dst_height, output) 
+		== DIF_LOADED_THUMBNAIL))
+	{
+		return DIF_LOADED_THUMBNAIL;
+	}
+
+#ifndef DIF_USE_IMAGEMAGICK
+	if ((src_data = stbLoadFile(in_path, flags, &src_width, &src_height, 
+		&held, &deferred)) == NULL)
+	{
+		if (deferred)
+		{
+			return DIF_DEFERRED;
+		}
+
+		fprintf(stderr, "Failed load: '%s'\n", in_path);
+
+		return -1;
+	}
+
+	ret = scaleImage(src_data, src_width, src_height, output, dst_width, 
+		dst_height);
+	budgetRelease(held);
+
+	return ret;
+#else
+	return magickLoadAndScaleImage(in_path, dst_width, dst_height, output,
+		flags);
+#endif /* DIF_USE_IMAGEMAGICK */
+}
+
+/* As readImageFile but decodes a file already read into memory, which is left
+ * untouched and still owned by the caller. Failures aren't reported as there 
+ * is no path to report them against. */
+int readImageMemory(const unsigned char * const data, const size_t len,
+	const size_t dst_width, const size_t dst_height, unsigned char *output,
+	const unsigned int flags)
+{
+#ifndef DIF_USE_IMAGEMAGICK
+	int src_width;
+	int src_height;
+	unsigned char *src_data = NULL;
+	size_t held;
+	int deferred;
+	int ret;
+#endif /* !DIF_USE_IMAGEMAGICK */
+
+	if ((output == NULL) || (data == NULL) || (len == 0))
+	{
+		return -1;
+	}
+
+	if (((flags & DIF_READ_THUMBNAIL) != 0)
+	&& (decodeEmbeddedThumbnail(data, 
+		(len < DIF_THUMB_HEAD_SIZE) ? len : DIF_THUMB_HEAD_SIZE, 
+		dst_width, dst_height, output) == DIF_LOADED_THUMBNAIL))
+	{
+		return DIF_LOADED_THUMBNAIL;
+	}
+
+#ifndef DIF_USE_IMAGEMAGICK
+	if ((src_data = stbLoadMemory(data, len, flags, &src_width, 
+		&src_height, &held, &deferred)) == NULL)
+	{
+		return (deferred) ? DIF_DEFERRED : -1;
+	}
+
+	ret = scaleImage(src_data, src_width, src_height, output, dst_width, 
+		dst_height);
+	budgetRelease(held);
+
+	return ret;
+#else
+	return magickLoadAndScaleBlob(data, len, dst_width, dst_height, output,
+		flags);
+#endif /* DIF_USE_IMAGEMAGICK */
+}
+
+/* Bytes per pixel of each DIF_PIXELS_* layout */
+static const size_t pixel_bytes[] = {1, 2, 3, 3, 4, 4};
+
+#define DIF_PIXEL_LAYOUTS (sizeof(pixel_bytes) / sizeof(pixel_bytes[0]))
+
+/* The weights, out of 256, stbi converts to grey with, so a raw frame gets
+ * the same print as its encoded copy decoded by stb */
+#define DIF_LUMA_R (77)
+#define DIF_LUMA_G (150)
+#define DIF_LUMA_B (29)
+
+/* Colour rows are converted two pixels to a word where the word can be
+ * loaded straight from the row */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define DIF_LUMA_SWAR
+#define DIF_LUMA_LANES (0x00FF00FF00FF00FFULL)
+#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
+
+static unsigned char lumaOf(const unsigned char * const px, const int bgr)
+{
+	const unsigned int red = px[(bgr) ? 2 : 0];
+	const unsigned int blue = px[(bgr) ? 0 : 2];
+
+	return (unsigned char) (((red * DIF_LUMA_R) + (px[1] * DIF_LUMA_G)
+		+ (blue * DIF_LUMA_B)) >> 8);
+}
+
+/* Two pixels are loaded as one word with the colour bytes of the second
+ * moved to the upper half. Each pixel's first and third bytes are then spread
+ * over 16 bit lanes, so that one multiply weights both and sums them into lane
+ * one for the first pixel and lane three for the second. The green bytes are
+ * shifted into those same lanes and weighted with a second multiply. No lane
+ * can carry into the next, the largest sum being 255 * 256. */
+static void lumaRow(const unsigned char * const row, const size_t width,
+	const int layout, unsigned char * const out)
+{
+	const size_t bytes = pixel_bytes[layout];
+	const int bgr = (layout == DIF_PIXELS_BGR) || (layout == DIF_PIXELS_BGRA);
+	size_t x = 0;
+
+	if (bytes < 3)
+	{
+		for (; x < width; x++)
+		{
+			out[x] = row[x * bytes];
+		}
+
+		return;
+	}
+
+#ifdef DIF_LUMA_SWAR
+	{
+		const uint64_t weights = (bgr)
+			? (DIF_LUMA_R | ((uint64_t) DIF_LUMA_B << 16))
+			: (DIF_LUMA_B | ((uint64_t) DIF_LUMA_R << 16));
+
+		/* Leaves a whole word to load, even with three byte pixels */
+		for (; (x + 3) <= width; x += 2)
+		{
+			uint64_t pair, sum;
+
+			memcpy(&pair, &row[x * bytes], sizeof(pair));
+			pair = (bytes == 3)
+				? ((pair & 0xFFFFFFULL) 
+					| ((pair & 0xFFFFFF000000ULL) << 8))
+				: (pair & 0x00FFFFFF00FFFFFFULL);
+			sum = ((pair & DIF_LUMA_LANES) * weights)
+				+ ((((pair >> 8) & DIF_LUMA_LANES) << 16) 
+					* DIF_LUMA_G);
+
+			out[x] = (unsigned char) (sum >> 24);
+			out[x + 1] = (unsigned char) (sum >> 56);
+		}
+	}
+#endif /* DIF_LUMA_SWAR */
+
+	for (; x < width; x++)
+	{
+		out[x] = lumaOf(&row[x * bytes], bgr);
+	}
+}
+
+/* Reduces pixels that are already decoded, exactly as a decoded file would
+ * be. Rows start stride bytes apart, 0 meaning they're packed, and each pixel
+ * is laid out as one of DIF_PIXELS_*. Grey rows are reduced in place, any
+ * other layout is converted to luma a row at a time first. */
+int reduceImagePixels(const unsigned char * const pixels, const size_t width,
+	const size_t height, const size_t stride, const int layout, 
+	const size_t dst_width, const size_t dst_height, unsigned char *output)
+{
+	struct difReducer red;
+	unsigned char *luma = NULL;
+	size_t row_len, y;
+	int ret;
+
+	if ((pixels == NULL) || (output == NULL) || (layout < 0)
+	|| ((size_t) layout >= DIF_PIXEL_LAYOUTS)
+	|| (width > (SIZE_MAX / pixel_bytes[layout])))
+	{
+		return -1;
+	}
+
+	row_len = (stride == 0) ? width * pixel_bytes[layout] : stride;
+
+	if ((row_len < width * pixel_bytes[layout])
+	|| (reducerInit(&red, width, height, dst_width, dst_height, 1) != 0))
+	{
+		return -1;
+	}
+
+	if ((layout != DIF_PIXELS_GRAY) && ((luma = malloc(width)) == NULL))
+	{
+		reducerCleanup(&red);
+
+		return -1;
+	}
+
+	for (y = 0; y < height; y++)
+	{
+		const unsigned char * const row = &pixels[y * row_len];
+
+		if (luma != NULL)
+		{
+			lumaRow(row, width, layout, luma);
+			reducerFeedRow(&red, y, luma);
+		}
+		else
+		{
+			reducerFeedRow(&red, y, row);
+		}
+	}
+
+	ret = reducerFinish(&red, output);
+	reducerCleanup(&red);
+	DIF_CHECKED_FREE(luma);
+
+	return ret;
+}
+
+/* Formats recognised when walking directories along with their decode cost
+ * per pixel relative to a baseline JPEG, in sixteenths. The costs are rough
+ * estimates from how much work each of stb's decoders does per pixel, they 
+ * only have to order files sensibly rather than predict times, and 
+ * MagickCore's decoders are assumed to scale alike. */
+struct difImageFormat
+{
+	const char *name;       /* As MagickCore's ping names the format */
+	const char *magic;      /* Leading bytes, NULL if the format has none */
+	size_t magic_len;
+	const char *extensions; /* Space separated, lower case */
+	uint64_t weight;
+};
+
+#define DIF_COST_MAGIC_LEN (4)
+#define DIF_COST_DEFAULT   (16)
+
+static const struct difImageFormat image_formats[] =
+{
+	{"JPEG", "\xFF\xD8\xFF", 3, "jpg jpeg jpe jfif", 16},
+	{"PNG",  "\x89PNG",      4, "png", 8},
+	{"BMP",  "BM",           2, "bmp dib", 8},
+	{"GIF",  "GIF8",         4, "gif", 12},
+	{"PSD",  "8BPS",         4, "psd", 10},
+	{"HDR",  "#?",           2, "hdr", 24},
+	{"PGM",  "P5",           2, "pgm pnm", 8},
+	{"PPM",  "P6",           2, "ppm pnm", 8},
+#ifdef DIF_USE_IMAGEMAGICK
+	{"TIFF", "II*\0",        4, "tif tiff", 12},
+	{"TIFF", "MM\0*",        4, "tif tiff", 12},
+	{"WEBP", NULL,           0, "webp", 16},
+	{"HEIC", NULL,           0, "heic heif", 24},
+#endif /* DIF_USE_IMAGEMAGICK */
+	{"TGA",  NULL,           0, "tga", 12}
+};
+
+#define DIF_IMAGE_FORMATS (sizeof(image_formats) / sizeof(image_formats[0]))
+
+static uint64_t formatCostWeight(const char * const name, 
+	const unsigned char * const magic, const size_t magic_len)
+{
+	size_t i;
+
+	for (i = 0; i < DIF_IMAGE_FORMATS; i++)
+	{
+		const struct difImageFormat * const fmt = &image_formats[i];
+
+		if (((name != NULL) && (strcmp(name, fmt->name) == 0))
+		|| ((magic != NULL) && (fmt->magic != NULL) 
+		&& (magic_len >= fmt->magic_len)
+		&& (memcmp(magic, fmt->magic, fmt->magic_len) == 0)))
+		{
+			return fmt->weight;
+		}
+	}
+
+	return DIF_COST_DEFAULT;
+}
+
+/* Case insensitive match of the name's extension against the format list */
+int isImageName(const char * const name)
+{
+	const char *ext;
+	size_t ext_len, i;
+
+	if ((name == NULL) || ((ext = strrchr(name, '.')) == NULL)
+	|| ((ext_len = strlen(++ext)) == 0))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < DIF_IMAGE_FORMATS; i++)
+	{
+		const char *cur = image_formats[i].extensions;
+
+		while (*cur != '\0')
+		{
+			const size_t len = strcspn(cur, " ");
+			size_t j;
+
+			for (j = 0; (len == ext_len) && (j < len) 
+			&& (tolower((unsigned char) ext[j]) == cur[j]); j++)
+			{
+				;
+			}
+
+			if ((len == ext_len) && (j == len))
+			{
+				return 1;
+			}
+
+			cur += len + (cur[len] == ' ');
+		}
+	}
+
+	return 0;
+}
+
+int isImageHead(const unsigned char * const head, const size_t len)
+{
+	size_t i;
+
+	for (i = 0; (head != NULL) && (i < DIF_IMAGE_FORMATS); i++)
+	{
+		const struct difImageFormat * const fmt = &image_formats[i];
+
+		if ((fmt->magic != NULL) && (len >= fmt->magic_len)
+		&& (memcmp(head, fmt->magic, fmt->magic_len) == 0))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Used when the header can't be read, undecodable files fail quickly anyway */
+static uint64_t fileSizeCost(FILE * const file)
+{
+	long size;
+
+	if ((fseek(file, 0, SEEK_END) != 0) || ((size = ftell(file)) <= 0))
+	{
+		return 0;
+	}
+
+	return (uint64_t) size;
+}
+
+uint64_t estimateDecodeCost(const char * const in_path)
+{
+	FILE *file = NULL;
+	uint64_t cost = 0;
+#ifndef DIF_USE_IMAGEMAGICK
+	unsigned char magic[DIF_COST_MAGIC_LEN];
+	size_t magic_len;
+	int width, height, channels;
+#else
+	ExceptionInfo *exception = NULL;
+	ImageInfo *image_info = NULL;
+	Image *ping = NULL;
+#endif /* DIF_USE_IMAGEMAGICK */
+
+	if ((in_path == NULL) || ((file = fopen(in_path, "rb")) == NULL))
+	{
+		return 0;
+	}
+
+#ifndef DIF_USE_IMAGEMAGICK
+	magic_len = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+
+	if (stbi_info_from_file(file, &width, &height, &channels) != 0)
+	{
+		cost = ((uint64_t) width * (uint64_t) height 
+			* formatCostWeight(NULL, magic, magic_len)) / 16;
+	}
+#else
+	image_info = CloneImageInfo(NULL);
+	exception = AcquireExceptionInfo();
+	(void) CopyMagickString(image_info->filename, in_path, 
+		MagickPathExtent);
+
+	if ((ping = PingImage(image_info, exception)) != NULL)
+	{
+		cost = ((uint64_t) ping->columns * (uint64_t) ping->rows
+			* formatCostWeight(ping->magick, NULL, 0)) / 16;
+	}
+
+	DIF_CHECKED_FUNC(ping, DestroyImage);
+	DIF_CHECKED_FUNC(exception, DestroyExceptionInfo);
+	DIF_CHECKED_FUNC(image_info, DestroyImageInfo);
+#endif /* DIF_USE_IMAGEMAGICK */
+
+	if (cost == 0)
+	{
+		cost = fileSizeCost(file);
+	}
+
+	fclose(file);
+
+	return cost;
+}
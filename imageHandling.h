@@ -1,10 +1,39 @@
 #ifndef DIF_IMAGE_HANDLING_H
 #define DIF_IMAGE_HANDLING_H
 
-void initializeImageHandling(const char * const program);
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+
+#include "dif.h" /* difImageConfig, DIF_READ_*, DIF_LOADED_*, DIF_PIXELS_* */
+
+void initializeImageHandling(const struct difImageConfig * const config);
 void cleanupImageHandling(void);
 int readImageFile(const char * const in_path, const size_t dst_width,
-	const size_t dst_height, unsigned char *output);
+	const size_t dst_height, unsigned char *output, 
+	const unsigned int flags);
+int readImageMemory(const unsigned char * const data, const size_t len,
+	const size_t dst_width, const size_t dst_height, unsigned char *output,
+	const unsigned int flags);
+/* Counts decodes handing back their share of the memory budget. A deferred
+ * read is worth retrying once this has moved on from its value before the
+ * read was made, until then the budget is as full as when it was turned away.
+ */
+unsigned long imageBudgetReleases(void);
 
-#endif /* DIF_IMAGE_HANDLING_H */
+int reduceImagePixels(const unsigned char * const pixels, const size_t width,
+	const size_t height, const size_t stride, const int layout, 
+	const size_t dst_width, const size_t dst_height, unsigned char *output);
+
+/* Relative cost of decoding the file, taken from its header where that can be
+ * read cheaply and from its size otherwise. Only meaningful as a comparison 
+ * between files, 0 if the file can't be opened. */
+uint64_t estimateDecodeCost(const char * const in_path);
 
+/* Whether a file looks like something that can be decoded, by its name's 
+ * extension or by its first DIF_IMAGE_HEAD_LEN or fewer bytes */
+#define DIF_IMAGE_HEAD_LEN (16)
+
+int isImageName(const char * const name);
+int isImageHead(const unsigned char * const head, const size_t len);
+
+#endif /* DIF_IMAGE_HANDLING_H */
@@ -4,364 +4,2789 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h> /* uint64_t */
+#include <string.h> /* strcmp */
 #include <limits.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_MAIN_POSIX
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h> /* getrlimit */
+#endif /* POSIX */
 
 #include "portopt.h"
 
 #ifndef DIF_DISABLE_THREADING
 #include "thirdparty/macroThreadPool.h"
 #endif
-#include "imageHandling.h"
-
-#define DIF_WIDTH  (8)
-#define DIF_HEIGHT (8)
-#define DIF_LENGTH (DIF_WIDTH * DIF_HEIGHT)
+#include "dif.h"
+#include "imageHandling.h" /* estimateDecodeCost */
+#include "readAhead.h"
+#include "dirWalk.h"
+#include "pathArena.h"
+#include "contentHash.h"
+#include "printCache.h"
+#include "hammingIndex.h"
+#include "dirWatch.h"
+#include "queryServer.h"
+#include "cpuSet.h"
 
 struct entry 
 {
 	uint64_t print;
 	const char *path;
 	unsigned char density;
+	unsigned char thumb_check; /* 0 if unchecked, else distance + 1 */
+	unsigned char source; /* 0 if not fingerprinted, else a DIF_CACHE_* */
+	unsigned char cached; /* The print was taken from the cache */
+	unsigned char queued; /* Waiting in a watch batch */
+	size_t exact; /* 0 if unique, else 1 + index of the copy decoded */
+	size_t cache_slot; /* Pending cache record, 0 if none */
 };
 
-static void fingerprintFile(struct entry * const node);
-static unsigned char calculateHamming(const uint64_t foo, const uint64_t bar);
+static void fingerprintEntry(struct entry * const node, 
+	const unsigned char * const data, const size_t len);
+static int loadEntry(struct entry * const node, 
+	const unsigned char * const data, const size_t len, 
+	const unsigned int extra_flags);
 
-int compareDensities(const void * const l_ptr, const void * const r_ptr)
+struct comparison
 {
-	const struct entry * const left = (struct entry * const) l_ptr;
-	const struct entry * const right = (struct entry * const) r_ptr;
+	const struct entry *src;
+	FILE *output;
+};
 
-	return (left->density - right->density);
-}
+static void reportPair(void *ctx, size_t left, size_t right, 
+	unsigned int distance)
+{
+	const struct comparison * const cmp = (const struct comparison *) ctx;
+	const struct entry * const first = &cmp->src[left];
+	const struct entry * const second = &cmp->src[right];
+	const char * const mark = ((first->exact != 0) 
+		&& (first->exact == second->exact)) ? " exact" : "";
+
+	(void) distance;
+	fprintf(stdout, "\"%s\" \"%s\"%s\n", first->path, second->path, mark);
 
-/* Cast to character pointer to avoid arithmetic on void pointers */
-#define ACCESS_VAR(arr, index, size) (((char *) (arr)) + ((index) * (size)))
+	if (cmp->output != NULL)
+	{
+		fprintf(cmp->output, "\"%s\" \"%s\"%s\n", first->path, 
+			second->path, mark);
+	}
+}
 
-/* returns len on failed to find */
-static size_t leftBinSearch(void *arr, const size_t len, const void *target,
-	const size_t size, int (*CompFunc)(const void *, const void *))
+/* Prints every similar pair, returns -1 if they couldn't be compared. The 
+ * pairs come out in the same order with or without a pool to share the 
+ * comparing out over. */
+static int doComparison(struct difPool * const pool, 
+	const struct entry * const src, const size_t len, 
+	const unsigned char threshold, FILE *output)
 {
-	size_t left = 0;
-	size_t right = len;
+	struct comparison cmp;
+	uint64_t *prints;
+	size_t i;
+	int ret;
 
-	while (left < right)
+	if ((prints = malloc(sizeof(uint64_t) * ((len == 0) ? 1 : len))) 
+		== NULL)
 	{
-		size_t mid = ((left + right) >> 1);
+		return -1;
+	}
 
-		if (CompFunc(ACCESS_VAR(arr, mid, size), target) < 0)
-		{
-			left = mid + 1;
-		}
-		else
-		{
-			right = mid;
-		}
+	for (i = 0; i < len; i++)
+	{
+		prints[i] = src[i].print;
 	}
 
-	return left;
+	cmp.src = src;
+	cmp.output = output;
+	ret = (pool != NULL) 
+		? difCompareParallel(pool, prints, len, threshold, reportPair, 
+			&cmp)
+		: difCompare(prints, len, threshold, reportPair, &cmp);
+	free(prints);
+
+	return ret;
 }
 
-/* The idea here is just to make it so that the comparisons don't always have
- * to start at the beginning of the entry array instead they can start at the
- * density - threshold point found via using a binary search. This is because
- * definitionally a fingerprint differing by more than threshold bit density
- * will not have a hamming distance in the allowable range. The open question
- * is does this optimization warrent the time spent sorting the array */
+/* Entries are kept in fixed size chunks that never move once allocated, so 
+ * the pointers handed to the loader stay valid while inputs are still being
+ * found and added from other threads. Chunks start on a cache line so that
+ * ranges of entries loaded by different threads needn't share one. */
+#define DIF_STORE_CHUNK (4096)
+#define DIF_CACHE_LINE  (64)
 
-/* It's possible that the threads could insertion sort the array while loading
- * the entries but that would require mutex locking a shared destination 
- * array. Furthermore, this isn't currently the performance bottleneck. */
-static void doComparison(struct entry * const src, const size_t len, 
-	const unsigned char threshold, FILE *output)
+struct entryStore
 {
-	size_t i, j;
+	struct entry **chunks;
+	size_t chunks_cap;
+	size_t len;
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_t mutex;
+#endif /* !DIF_DISABLE_THREADING */
+};
 
-	qsort(src, len, sizeof(struct entry), compareDensities);
+static void storeInit(struct entryStore * const store)
+{
+	store->chunks = NULL;
+	store->chunks_cap = 0;
+	store->len = 0;
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_init(&store->mutex, NULL);
+#endif /* !DIF_DISABLE_THREADING */
+}
 
-	for (i = 0; i < len; i++)
-	{
-		const unsigned char target_density 
-			= (src[i].density < threshold) 
-				? 0 : src[i].density - threshold;
-		const struct entry dummy = {0, 0, target_density};
-		const size_t fnd = leftBinSearch(src, len, &dummy, 
-			sizeof(struct entry), compareDensities);
+static struct entry* storeAt(const struct entryStore * const store, 
+	const size_t i)
+{
+	return &store->chunks[i / DIF_STORE_CHUNK][i % DIF_STORE_CHUNK];
+}
+
+/* Returns NULL on allocation failure */
+static struct entry* storeAdd(struct entryStore * const store, 
+	const char * const path)
+{
+	struct entry *node = NULL;
+	size_t chunk;
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_lock(&store->mutex);
+#endif /* !DIF_DISABLE_THREADING */
 
-		for (j = fnd; j < i; j++)
+	chunk = store->len / DIF_STORE_CHUNK;
+
+	if (store->len % DIF_STORE_CHUNK == 0)
+	{
+		if (chunk == store->chunks_cap)
 		{
-			const unsigned char score = calculateHamming(
-				src[i].print, src[j].print);
+			const size_t cap = (store->chunks_cap == 0) 
+				? 16 : store->chunks_cap * 2;
+			struct entry **chunks = realloc(store->chunks, 
+				sizeof(struct entry *) * cap);
 
-			if ((score <= threshold) && (j != i))
+			if (chunks == NULL)
 			{
-				fprintf(stdout, "\"%s\" \"%s\"\n",
-					src[i].path, src[j].path);
-
-				if (output != NULL)
-				{
-					fprintf(output, "\"%s\" \"%s\"\n",
-						src[i].path, src[j].path);
-				}
+				goto UNLOCK;
 			}
+
+			store->chunks = chunks;
+			store->chunks_cap = cap;
+		}
+
+		if ((store->chunks[chunk] = aligned_alloc(DIF_CACHE_LINE,
+			sizeof(struct entry) * DIF_STORE_CHUNK)) == NULL)
+		{
+			goto UNLOCK;
 		}
 	}
-}
 
-#ifndef DIF_DISABLE_THREADING
+	node = storeAt(store, store->len++);
+	node->print = 0;
+	node->path = path;
+	node->density = 0;
+	node->thumb_check = 0;
+	node->source = 0;
+	node->cached = 0;
+	node->queued = 0;
+	node->exact = 0;
+	node->cache_slot = 0;
+
+UNLOCK:
 
-static void threadFunction(struct entry *node);
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_unlock(&store->mutex);
+#endif /* !DIF_DISABLE_THREADING */
 
-MACRO_THREAD_POOL_COMPLETE(loader, struct entry *, threadFunction);
+	return node;
+}
 
-static void threadFunction(struct entry *node)
+/* Copies the entries out into one array for sorting, releasing each chunk as
+ * it goes so the two are never both held in full */
+static struct entry* storeFlatten(struct entryStore * const store)
 {
-	if (node != NULL)
+	struct entry *arr;
+	size_t i;
+
+	if ((arr = malloc(sizeof(struct entry) 
+		* ((store->len == 0) ? 1 : store->len))) == NULL)
 	{
-		fingerprintFile(node);
+		return NULL;
 	}
-}
 
-#endif /* !DIF_DISABLE_THREADING */
+	for (i = 0; i < store->len; i += DIF_STORE_CHUNK)
+	{
+		const size_t count = (store->len - i < DIF_STORE_CHUNK) 
+			? store->len - i : DIF_STORE_CHUNK;
 
-PORTOPT_BOOL verbose = PORTOPT_FALSE;
+		memcpy(&arr[i], store->chunks[i / DIF_STORE_CHUNK], 
+			sizeof(struct entry) * count);
+		free(store->chunks[i / DIF_STORE_CHUNK]);
+		store->chunks[i / DIF_STORE_CHUNK] = NULL;
+	}
+
+	return arr;
+}
 
-static unsigned char getGrayscaleMean(const unsigned char * const data,
-	const unsigned int width, const unsigned int height)
+static void storeFree(struct entryStore * const store)
 {
-	const size_t lim = width * height;
-	uint64_t mean = 0;
 	size_t i;
 
-	for (i = 0; i < lim; i++)
+	for (i = 0; i < store->len; i += DIF_STORE_CHUNK)
 	{
-		mean += data[i];
+		free(store->chunks[i / DIF_STORE_CHUNK]);
 	}
 
-	return (unsigned char) (mean / lim);
+	free(store->chunks);
+	store->chunks = NULL;
+	store->chunks_cap = 0;
+	store->len = 0;
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_destroy(&store->mutex);
+#endif /* !DIF_DISABLE_THREADING */
 }
 
-static void getFingerprintWithDensity(const unsigned char * const data,
-	struct entry * const out)
+/* Byte identical inputs are found by grouping on size and then on a hash of
+ * the contents of only those files whose size isn't unique. Each member of a
+ * group is compared against its first, those that match take its fingerprint
+ * and only the first is decoded. */
+struct digestSlot
 {
-	unsigned char mean = getGrayscaleMean(data, DIF_WIDTH, DIF_HEIGHT);
-	size_t i, j = 0;
+	uint64_t size;
+	uint64_t hash;
+	size_t index; /* Into the entry store */
+	int valid;
+	int same; /* Byte identical to the first of its group */
+};
 
-	out->density = 0;
-	out->print = 0;
+static int compareDigests(const void * const l_ptr, const void * const r_ptr)
+{
+	const struct digestSlot * const left = (const struct digestSlot *) l_ptr;
+	const struct digestSlot * const right 
+		= (const struct digestSlot *) r_ptr;
 
-	for (i = 0; i < DIF_LENGTH; i++)
+	if (left->size != right->size)
 	{
-		/* casting here is important as otherwise it tries to use an
-		 * int for the mask */
-		if (data[i] > mean)
-		{
-			out->print |= (((uint64_t) 1) << i);
-			out->density++;
-		}
-
-		if (verbose)
-		{
-			if (data[i] > mean)
-			{
-				fputc('#', stdout);
-			}
-			else
-			{
-				fputc('.', stdout);
-			}
+		return (left->size < right->size) ? -1 : 1;
+	}
 
-			if ((j = ((j + 1) % 8)) == 0)
-			{
-				fputc('\n', stdout);
-			}
-		}
+	if (left->hash != right->hash)
+	{
+		return (left->hash < right->hash) ? -1 : 1;
 	}
+
+	return (left->index > right->index) - (left->index < right->index);
 }
 
-static unsigned char calculateHamming(const uint64_t foo, const uint64_t bar)
+/* Most sizes are unique and those files are never opened at all, which
+ * matters on network filesystems where every open is a round trip */
+static void digestSize(struct digestSlot * const slot, const char * const path)
 {
-	const uint64_t diff = foo ^ bar;
-	unsigned char score = 0;
-	size_t i;
+#ifdef DIF_MAIN_POSIX
+	struct stat info;
 
-	for (i = 0; i < DIF_LENGTH; i++)
+	slot->valid = 0;
+
+	if ((stat(path, &info) == 0) && (S_ISREG(info.st_mode))
+	&& (info.st_size > 0))
 	{
-		if (diff & (((uint64_t) 1) << i))
-		{
-			score++;
-		}
+		slot->size = (uint64_t) info.st_size;
+		slot->valid = 1;
+	}
+#else
+	FILE *file;
+	long size;
+
+	slot->valid = 0;
+
+	if ((file = fopen(path, "rb")) == NULL)
+	{
+		return;
+	}
+
+	if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) > 0))
+	{
+		slot->size = (uint64_t) size;
+		slot->valid = 1;
 	}
 
-	return score;
+	fclose(file);
+#endif /* DIF_MAIN_POSIX */
 }
 
-static void fingerprintFile(struct entry * const node)
+static void digestContents(struct digestSlot * const slot, 
+	const char * const path)
 {
-	unsigned char img_data[DIF_LENGTH];
+	uint64_t len;
 
-	if (node == NULL) 
+	if ((contentHashFile(path, &slot->hash, &len) != 0) 
+	|| (len != slot->size))
 	{
-		return;
+		slot->valid = 0;
 	}
+}
 
-	node->print = 0;
-	node->density = 0;
+static void digestSame(struct digestSlot * const slot, 
+	const char * const path, const char * const first)
+{
+	slot->same = contentHashEqual(first, path);
+}
+
+#ifndef DIF_DISABLE_THREADING
+struct digestJob
+{
+	struct digestSlot *slot;
+	const char *path;
+	const char *first; /* Compared against when set, otherwise digested */
+	int contents; /* Otherwise just the size */
+};
 
-	if ((node->path == NULL)
-	|| (readImageFile(node->path, DIF_WIDTH, DIF_HEIGHT, img_data) != 0))
+static void digestFunction(struct digestJob job);
+
+MACRO_THREAD_POOL_COMPLETE(digest, struct digestJob, digestFunction);
+
+static void digestFunction(struct digestJob job)
+{
+	if (job.first != NULL)
 	{
-		return;
+		digestSame(job.slot, job.path, job.first);
 	}
+	else if (job.contents)
+	{
+		digestContents(job.slot, job.path);
+	}
+	else
+	{
+		digestSize(job.slot, job.path);
+	}
+}
+#endif /* !DIF_DISABLE_THREADING */
 
-	getFingerprintWithDensity(img_data, node);
+/* Only the entries of a size shared with another are hashed */
+static int digestNeeded(const struct digestSlot * const slots, 
+	const size_t len, const size_t i)
+{
+	return (slots[i].valid) 
+		&& (((i > 0) && (slots[i - 1].valid) 
+			&& (slots[i - 1].size == slots[i].size))
+		|| ((i + 1 < len) && (slots[i + 1].valid)
+			&& (slots[i + 1].size == slots[i].size)));
 }
 
-static void printHelp(void)
+static int digestMatches(const struct digestSlot * const left, 
+	const struct digestSlot * const right)
 {
-	fputs("Image Comparison Program\n\n", stderr);
-	fputs("Usage:\n", stderr);
-	fputs("\t./difDemo [flags]... [images]...\n\n", stderr);
-	fputs("Command Line Flags:\n", stderr);
-	fputs("\t-t, --threshold <NUM> : Similarity limit, default 5\n", 
-		stderr);
-	fputs("\t-T, --threads   <NUM> : Thread max, if built, default 5\n", 
-		stderr);
-	fputs("\t-o, --output <PATH>   : Path to output file\n", stderr);
-	fputs("\t-v, --verbose         : Enables extra information output\n",
-		stderr);
-	fputs("\t-h, --help            : Prints this message and exits\n",
-		stderr);
-	fputs("\n", stderr);
+	return (left->valid) && (right->valid) && (left->size == right->size)
+		&& (left->hash == right->hash);
 }
 
-int main(int argc, char **argv)
+/* Sets the exact field of every entry with a byte identical copy, returns the
+ * number of entries that won't need decoding or -1 on failure */
+static long markExactCopies(struct entryStore * const store, 
+	const size_t threads)
 {
-	const struct portoptVerboseOpt opts[] =
+	struct digestSlot *slots = NULL;
+	const size_t len = store->len;
+	long copies = 0;
+	size_t i, j, shared;
+#ifndef DIF_DISABLE_THREADING
+	struct digestThreadPool *pool = NULL;
+	struct digestJob job;
+#endif /* !DIF_DISABLE_THREADING */
+
+	if ((slots = calloc((len == 0) ? 1 : len, sizeof(struct digestSlot))) 
+		== NULL)
 	{
-		{'t', "threshold", PORTOPT_TRUE},
-		{'o', "output",    PORTOPT_TRUE},
-		{'T', "threads",   PORTOPT_TRUE},
-		{'v', "verbose",   PORTOPT_FALSE},
-		{'h', "help",      PORTOPT_FALSE}
-	};
-	const size_t num_opts = sizeof(opts) / sizeof(opts[0]);
-	const size_t argl = (size_t) argc;
-	size_t ind = 0;
-	int flag;
+		return -1;
+	}
 
-	unsigned char similar_threshold = 5;
-	FILE *output = NULL;
 #ifndef DIF_DISABLE_THREADING
-	unsigned char num_threads = 5;
-	struct loaderThreadPool *pool = NULL;
-#endif /* !DIF_DISABLE_THREADING */
+	if ((pool = digestNewThreadPool(threads, 2 * threads)) == NULL)
+	{
+		free(slots);
 
-	struct entry *entry_arr = NULL;
-	int ret = 0;
-	size_t lim, i;
+		return -1;
+	}
 
-	initializeImageHandling(argv[0]);
+	job.first = NULL;
+	job.contents = 0;
+#else
+	(void) threads;
+#endif /* !DIF_DISABLE_THREADING */
 
-	while ((flag = portoptVerbose(argl, argv, opts, num_opts, &ind)) != -1)
+	for (i = 0; i < len; i++)
 	{
-		switch (flag)
+		slots[i].index = i;
+
+		/* Cached entries are left out so warm runs don't read them */
+		if (storeAt(store, i)->cached)
 		{
-			case 't':
-				similar_threshold = atol(
-					portoptGetArg(argl, argv, &ind));
+			continue;
+		}
 
-				break;
-			case 'T':
 #ifndef DIF_DISABLE_THREADING
-				num_threads = atol(
-					portoptGetArg(argl, argv, &ind));
+		job.slot = &slots[i];
+		job.path = storeAt(store, i)->path;
+		digestEnqueueJob(pool, job);
 #else
-				fputs("Not built with threading support",
-					stderr);
+		digestSize(&slots[i], storeAt(store, i)->path);
 #endif /* DIF_DISABLE_THREADING */
+	}
 
-				break;
-			case 'o':
-				if ((output = fopen(portoptGetArg(argl, argv, 
-					&ind), "wb")) == NULL)
-				{
-					fputs("Failed to open output file\n",
-						stderr);
+#ifndef DIF_DISABLE_THREADING
+	digestWaitOnIdle(pool);
+	job.contents = 1;
+#endif /* !DIF_DISABLE_THREADING */
 
-					goto CLEANUP;
-				}
+	qsort(slots, len, sizeof(struct digestSlot), compareDigests);
 
-				break;
-			case 'v':
-				verbose = PORTOPT_TRUE;
+	/* Flags are gathered first since hashing invalidates failed slots */
+	for (i = 0; i < len; i++)
+	{
+		slots[i].hash = (uint64_t) digestNeeded(slots, len, i);
+	}
 
-				break;
-			case 'h':
-				printHelp();
+	for (i = 0; i < len; i++)
+	{
+		if (slots[i].hash == 0)
+		{
+			slots[i].valid = 0;
 
-				goto CLEANUP;
-			case '?': /* fallthrough */
-			default:
-				break;
+			continue;
 		}
+
+#ifndef DIF_DISABLE_THREADING
+		job.slot = &slots[i];
+		job.path = storeAt(store, slots[i].index)->path;
+		digestEnqueueJob(pool, job);
+#else
+		digestContents(&slots[i], storeAt(store, slots[i].index)->path);
+#endif /* DIF_DISABLE_THREADING */
 	}
 
-	ind += (ind == 0);
+#ifndef DIF_DISABLE_THREADING
+	digestWaitOnIdle(pool);
+#endif /* !DIF_DISABLE_THREADING */
 
-	if (argl - ind < 2)
-	{
-		printHelp();
+	qsort(slots, len, sizeof(struct digestSlot), compareDigests);
 
-		goto CLEANUP;
+	/* A matching hash only makes a copy all but certain, so the bytes are
+	 * compared before a print is shared */
+	for (i = 0; i < len; i = j)
+	{
+		for (j = i + 1; (j < len) 
+		&& (digestMatches(&slots[i], &slots[j])); j++)
+		{
+#ifndef DIF_DISABLE_THREADING
+			job.slot = &slots[j];
+			job.path = storeAt(store, slots[j].index)->path;
+			job.first = storeAt(store, slots[i].index)->path;
+			digestEnqueueJob(pool, job);
+#else
+			digestSame(&slots[j], 
+				storeAt(store, slots[j].index)->path,
+				storeAt(store, slots[i].index)->path);
+#endif /* DIF_DISABLE_THREADING */
+		}
 	}
 
 #ifndef DIF_DISABLE_THREADING
-	if ((pool = loaderNewThreadPool(num_threads, num_threads)) == NULL)
+	digestWaitOnIdle(pool);
+	digestCleanupThreadPool(pool);
+#endif /* !DIF_DISABLE_THREADING */
+
+	for (i = 0; i < len; i = j)
 	{
-		fputs("Failed to initialize thread pool\n", stderr);
-		ret = 1;
+		shared = 0;
 
-		goto CLEANUP;
+		for (j = i + 1; (j < len) 
+		&& (digestMatches(&slots[i], &slots[j])); j++)
+		{
+			if (!slots[j].same)
+			{
+				continue;
+			}
+
+			storeAt(store, slots[j].index)->exact 
+				= slots[i].index + 1;
+			copies++;
+			shared++;
+		}
+
+		if (shared != 0)
+		{
+			storeAt(store, slots[i].index)->exact 
+				= slots[i].index + 1;
+		}
 	}
-#endif /* !DIF_DISABLE_THREADING */
 
-	lim = argl - ind;
+	free(slots);
 
-	if ((entry_arr = malloc(sizeof(struct entry) * lim)) == NULL)
-	{
-		fputs("Allocation failure\n", stderr);
-		ret = 1;
+	return copies;
+}
 
-		goto CLEANUP;
-	}
+/* Copies aren't decoded themselves */
+static int isExactCopy(const struct entryStore * const store, 
+	const struct entry * const node)
+{
+	return (node->exact != 0) && (storeAt(store, node->exact - 1) != node);
+}
 
-#ifndef DIF_DISABLE_THREADING
-	for (i = 0; (i < lim) && (ind < argl); i++, ind++)
-	{
-		entry_arr[i].path = argv[ind];
-		loaderEnqueueJob(pool, &entry_arr[i]);
-	}
+static int needsDecode(const struct entryStore * const store, 
+	const struct entry * const node)
+{
+	return (!node->cached) && (node->source == 0) 
+		&& (!isExactCopy(store, node));
+}
 
-	loaderWaitOnIdle(pool);
-#else
-	for (i = 0; (i < lim) && (ind < argl); i++, ind++)
+static void inheritExactCopies(const struct entryStore * const store)
+{
+	size_t i;
+
+	for (i = 0; i < store->len; i++)
 	{
-		entry_arr[i].path = argv[ind];
-		fingerprintFile(&entry_arr[i]);
-	}
-#endif /* DIF_DISABLE_THREADING */
+		struct entry * const node = storeAt(store, i);
 
-	fputs("loading complete\n", stderr);
-	doComparison(entry_arr, lim, similar_threshold, output);
+		if (isExactCopy(store, node))
+		{
+			const struct entry * const src 
+				= storeAt(store, node->exact - 1);
 
-CLEANUP:
+			node->print = src->print;
+			node->density = src->density;
+			node->source = src->source;
+		}
+	}
+}
 
-#ifndef DIF_DISABLE_THREADING
-	loaderCleanupThreadPool(pool);
+/* For largest first scheduling, jobs are submitted in descending order of 
+ * estimated decode cost so that the last ones still running when the queue 
+ * empties are the cheap ones rather than whichever huge file came last */
+struct costSlot
+{
+	uint64_t cost;
+	size_t index; /* Into the entry array */
+};
+
+static struct entry* scheduledEntry(const struct entryStore * const store, 
+	const struct costSlot * const order, const size_t i)
+{
+	return storeAt(store, (order != NULL) ? order[i].index : i);
+}
+
+#ifndef DIF_DISABLE_THREADING
+
+struct loaderJob
+{
+	struct entry *node;
+	unsigned char *data; /* Whole file when read ahead, otherwise NULL */
+	size_t len;
+};
+
+static void threadFunction(struct loaderJob job);
+
+MACRO_THREAD_POOL_COMPLETE(loader, struct loaderJob, threadFunction);
+
+/* Decodes the memory budget had no room for when a loader thread got to them.
+ * Rather than hold the thread up they are parked here, and every decode that
+ * finishes, so handing its share back, puts them back on the pool. A job is
+ * only parked if nothing was handed back since it was turned away, else it
+ * could be left waiting on a release that already happened. */
+struct budgetWait
+{
+	pthread_mutex_t mutex;
+	struct loaderThreadPool *pool;
+	struct loaderJob *jobs;
+	size_t len;
+	size_t cap;
+};
+
+static struct budgetWait budget_wait = {PTHREAD_MUTEX_INITIALIZER, NULL, 
+	NULL, 0, 0};
+
+/* Returns 0 once parked, 1 if the budget was released meanwhile and the job
+ * should be tried again, -1 if it couldn't be parked */
+static int budgetWaitPark(const struct loaderJob job, 
+	const unsigned long releases)
+{
+	struct loaderJob *grown;
+	int ret = 1;
+
+	pthread_mutex_lock(&budget_wait.mutex);
+
+	if (difBudgetReleases() != releases)
+	{
+		goto CLEANUP;
+	}
+
+	if (budget_wait.len == budget_wait.cap)
+	{
+		const size_t cap = (budget_wait.cap == 0) 
+			? 16 : 2 * budget_wait.cap;
+
+		if ((grown = realloc(budget_wait.jobs, 
+			cap * sizeof(struct loaderJob))) == NULL)
+		{
+			ret = -1;
+
+			goto CLEANUP;
+		}
+
+		budget_wait.jobs = grown;
+		budget_wait.cap = cap;
+	}
+
+	budget_wait.jobs[budget_wait.len++] = job;
+	ret = 0;
+
+CLEANUP:
+	pthread_mutex_unlock(&budget_wait.mutex);
+
+	return ret;
+}
+
+/* Returns 0 if the job was parked, 1 once it has been run and so may have 
+ * handed some of the budget back */
+static int loaderRun(const struct loaderJob job)
+{
+	unsigned long releases;
+	int parked;
+
+	if (job.node == NULL)
+	{
+		free(job.data);
+
+		return 1;
+	}
+
+	do
+	{
+		releases = difBudgetReleases();
+
+		if (loadEntry(job.node, job.data, job.len, DIF_READ_DEFER) 
+			!= DIF_DEFERRED)
+		{
+			free(job.data);
+
+			return 1;
+		}
+	} while ((parked = budgetWaitPark(job, releases)) == 1);
+
+	/* Out of memory to park it, waiting is all that's left */
+	if (parked != 0)
+	{
+		(void) loadEntry(job.node, job.data, job.len, 
+			DIF_READ_DEFAULT);
+		free(job.data);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Hands every parked job back to the pool, any it has no room for are run on
+ * this thread, over again if those free up room for jobs parked meanwhile */
+static void budgetWaitDrain(void)
+{
+	struct loaderJob *jobs;
+	size_t len, i;
+	int ran;
+
+	do
+	{
+		pthread_mutex_lock(&budget_wait.mutex);
+		jobs = budget_wait.jobs;
+		len = budget_wait.len;
+		budget_wait.jobs = NULL;
+		budget_wait.len = 0;
+		budget_wait.cap = 0;
+		pthread_mutex_unlock(&budget_wait.mutex);
+
+		for (i = 0, ran = 0; i < len; i++)
+		{
+			if (loaderTryEnqueueJob(budget_wait.pool, jobs[i]) 
+				== MTP_FALSE)
+			{
+				ran |= loaderRun(jobs[i]);
+			}
+		}
+
+		free(jobs);
+	} while (ran);
+}
+
+/* Once the pool is idle nothing holds any of the budget, so whatever is still
+ * parked is let in */
+static void loaderSettle(struct loaderThreadPool *pool)
+{
+	size_t parked;
+
+	for (;;)
+	{
+		loaderWaitOnIdle(pool);
+		pthread_mutex_lock(&budget_wait.mutex);
+		parked = budget_wait.len;
+		pthread_mutex_unlock(&budget_wait.mutex);
+
+		if (parked == 0)
+		{
+			return;
+		}
+
+		budgetWaitDrain();
+	}
+}
+
+/* Only left non-empty if loading was abandoned */
+static void budgetWaitFree(void)
+{
+	size_t i;
+
+	for (i = 0; i < budget_wait.len; i++)
+	{
+		free(budget_wait.jobs[i].data);
+	}
+
+	free(budget_wait.jobs);
+	budget_wait.jobs = NULL;
+	budget_wait.len = 0;
+	budget_wait.cap = 0;
+}
+
+static void threadFunction(struct loaderJob job)
+{
+	if (loaderRun(job))
+	{
+		budgetWaitDrain();
+	}
+}
+
+/* The optional I/O stage in front of the loader, its threads only ever block
+ * on reads and hand whole files on to the decoders. Both stages are bounded
+ * by their rings so a stalled decoder side backs the readers up in turn. */
+struct ioJob
+{
+	struct entry *node;
+	struct loaderThreadPool *decoders;
+};
+
+static void ioFunction(struct ioJob job);
+
+MACRO_THREAD_POOL_COMPLETE(io, struct ioJob, ioFunction);
+
+static void ioFunction(struct ioJob job)
+{
+	struct loaderJob next;
+
+	next.node = job.node;
+	next.data = NULL;
+	next.len = 0;
+
+	/* Failed reads are left for the decoder to retry and report */
+	if ((job.node != NULL) && (job.node->path != NULL))
+	{
+		(void) readWholeFile(job.node->path, &next.data, &next.len);
+	}
+
+	loaderEnqueueJob(job.decoders, next);
+}
+
+/* Header reads for the cost estimates are small and mostly wait on storage so
+ * they are spread over a pool of their own before any decoding starts */
+struct costJob
+{
+	struct costSlot *slot;
+	const char *path;
+};
+
+static void costFunction(struct costJob job);
+
+MACRO_THREAD_POOL_COMPLETE(cost, struct costJob, costFunction);
+
+static void costFunction(struct costJob job)
+{
+	job.slot->cost = estimateDecodeCost(job.path);
+}
+
+static int compareCosts(const void * const l_ptr, const void * const r_ptr)
+{
+	const struct costSlot * const left = (const struct costSlot *) l_ptr;
+	const struct costSlot * const right = (const struct costSlot *) r_ptr;
+
+	if (left->cost != right->cost)
+	{
+		return (left->cost < right->cost) ? 1 : -1;
+	}
+
+	return (left->index > right->index) - (left->index < right->index);
+}
+
+/* Returns NULL if the entries should just be taken in their given order */
+static struct costSlot* orderByCost(const struct entryStore * const store,
+	const size_t threads)
+{
+	struct costThreadPool *pool = NULL;
+	struct costSlot *order = NULL;
+	struct costJob job;
+	const size_t len = store->len;
+	size_t i;
+
+	if ((order = malloc(sizeof(struct costSlot) * len)) == NULL)
+	{
+		return NULL;
+	}
+
+	if ((pool = costNewThreadPool(threads, 2 * threads)) == NULL)
+	{
+		free(order);
+
+		return NULL;
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		order[i].cost = 0;
+		order[i].index = i;
+		job.slot = &order[i];
+		job.path = storeAt(store, i)->path;
+		costEnqueueJob(pool, job);
+	}
+
+	costWaitOnIdle(pool);
+	costCleanupThreadPool(pool);
+	qsort(order, len, sizeof(struct costSlot), compareCosts);
+
+	return order;
+}
+
+#endif /* !DIF_DISABLE_THREADING */
+
+PORTOPT_BOOL verbose = PORTOPT_FALSE;
+static unsigned int read_flags = DIF_READ_DEFAULT;
+static unsigned long thumb_check_rate = 0;
+
+/* The cells above the mean, as the print holds them */
+static void showPrint(const uint64_t print)
+{
+	size_t i;
+
+	for (i = 0; i < DIF_PRINT_BITS; i++)
+	{
+		fputc((print & (((uint64_t) 1) << i)) ? '#' : '.', stdout);
+
+		if ((i + 1) % DIF_PRINT_WIDTH == 0)
+		{
+			fputc('\n', stdout);
+		}
+	}
+}
+
+/* FNV-1a, only used to pick a stable sample of files independent of the
+ * order in which they were given or loaded */
+static unsigned long hashPath(const char *path)
+{
+	unsigned long hash = 2166136261UL;
+
+	for (; *path != '\0'; path++)
+	{
+		hash = ((hash ^ (unsigned char) *path) * 16777619UL) 
+			& 0xFFFFFFFFUL;
+	}
+
+	return hash;
+}
+
+/* Re-fingerprints a thumbnail loaded file from the full image and records how
+ * far apart the two prints are so the embedded thumbnails can be trusted, 
+ * returns DIF_DEFERRED if the memory budget turned the full image away */
+static int checkThumbnail(struct entry * const node, 
+	const unsigned char * const data, const size_t len, 
+	const unsigned int flags)
+{
+	uint64_t full;
+	const int loaded = (data != NULL)
+		? difFingerprintMemory(data, len, flags, &full)
+		: difFingerprintFile(node->path, flags, &full);
+
+	if (loaded == DIF_LOADED_FULL)
+	{
+		node->thumb_check = (unsigned char) (1 
+			+ difDistance(node->print, full));
+	}
+
+	return (loaded == DIF_DEFERRED) ? DIF_DEFERRED : 0;
+}
+
+/* data is the already read file or NULL to have it read from node->path */
+static void fingerprintEntry(struct entry * const node, 
+	const unsigned char * const data, const size_t len)
+{
+	(void) loadEntry(node, data, len, DIF_READ_DEFAULT);
+}
+
+/* As fingerprintEntry with extra_flags added to the read flags. Returns 
+ * DIF_DEFERRED, with nothing reported yet, if DIF_READ_DEFER was given and
+ * the memory budget turned it away, 0 otherwise. */
+static int loadEntry(struct entry * const node, 
+	const unsigned char * const data, const size_t len, 
+	const unsigned int extra_flags)
+{
+	const unsigned int flags = read_flags | extra_flags;
+	int loaded;
+
+	if (node == NULL) 
+	{
+		return 0;
+	}
+
+	node->print = 0;
+	node->density = 0;
+	node->thumb_check = 0;
+	node->source = 0;
+
+	if (node->path == NULL)
+	{
+		return 0;
+	}
+
+	if (data == NULL)
+	{
+		loaded = difFingerprintFile(node->path, flags, &node->print);
+	}
+	else if (((loaded = difFingerprintMemory(data, len, flags, 
+		&node->print)) < 0) && (loaded != DIF_DEFERRED))
+	{
+		fprintf(stderr, "Failed load: '%s'\n", node->path);
+	}
+
+	if (loaded == DIF_DEFERRED)
+	{
+		return DIF_DEFERRED;
+	}
+
+	if (loaded < 0)
+	{
+		return 0;
+	}
+
+	/* The check decides whether all of it has to be tried again, so it 
+	 * goes before anything is reported */
+	if ((loaded == DIF_LOADED_THUMBNAIL) && (thumb_check_rate != 0)
+	&& ((hashPath(node->path) % thumb_check_rate) == 0)
+	&& (checkThumbnail(node, data, len, DIF_READ_DEFAULT 
+		| (extra_flags & DIF_READ_DEFER)) == DIF_DEFERRED))
+	{
+		node->print = 0;
+		node->thumb_check = 0;
+
+		return DIF_DEFERRED;
+	}
+
+	node->density = (unsigned char) difDensity(node->print);
+
+	if (verbose)
+	{
+		showPrint(node->print);
+	}
+
+	node->source = (loaded == DIF_LOADED_THUMBNAIL) 
+		? DIF_CACHE_THUMBNAIL : DIF_CACHE_FULL;
+
+	if ((verbose) && (node->thumb_check != 0))
+	{
+		fprintf(stdout, "thumbnail check: '%s' distance %d\n", 
+			node->path, node->thumb_check - 1);
+	}
+
+	return 0;
+}
+
+/* Runs on the thread submitting reads, failed reads are retried from the path
+ * by the loader so that they are reported the same way as any other */
+static void readAheadDone(void *ctx, void *tag, unsigned char *data, 
+	size_t len)
+{
+#ifndef DIF_DISABLE_THREADING
+	struct loaderJob job;
+
+	job.node = (struct entry *) tag;
+	job.data = data;
+	job.len = len;
+	loaderEnqueueJob((struct loaderThreadPool *) ctx, job);
+#else
+	(void) ctx;
+
+	fingerprintEntry((struct entry *) tag, data, len);
+	free(data);
+#endif /* DIF_DISABLE_THREADING */
+}
+
+/* Where newly found inputs are sent, shared by the argument list and the
+ * directory walker whose threads may call in concurrently */
+struct loadTarget
+{
+	struct entryStore *store;
+#ifndef DIF_DISABLE_THREADING
+	struct loaderThreadPool *decoders;
+	struct ioThreadPool *readers;
+#endif /* !DIF_DISABLE_THREADING */
+	struct difPrintCache *cache;
+	PORTOPT_BOOL defer; /* Only collect, they're all submitted afterwards */
+};
+
+static void submitEntry(const struct loadTarget * const target, 
+	struct entry * const node)
+{
+#ifndef DIF_DISABLE_THREADING
+	if (target->readers != NULL)
+	{
+		struct ioJob job;
+
+		job.node = node;
+		job.decoders = target->decoders;
+		ioEnqueueJob(target->readers, job);
+	}
+	else
+	{
+		struct loaderJob job;
+
+		job.node = node;
+		job.data = NULL;
+		job.len = 0;
+		loaderEnqueueJob(target->decoders, job);
+	}
+#else
+	(void) target;
+
+	fingerprintEntry(node, NULL, 0);
+#endif /* DIF_DISABLE_THREADING */
+}
+
+#ifndef DIF_DISABLE_THREADING
+/* Aiming for a few ranges a thread so that uneven files still even out */
+#define DIF_LOAD_RANGES_PER_THREAD (8)
+
+struct deferredLoad
+{
+	const struct entryStore *store;
+	const struct costSlot *order;
+};
+
+static void loadRange(void *ctx, size_t begin, size_t end)
+{
+	const struct deferredLoad * const load 
+		= (const struct deferredLoad *) ctx;
+	size_t i;
+
+	for (i = begin; i < end; i++)
+	{
+		struct entry * const node 
+			= scheduledEntry(load->store, load->order, i);
+		struct loaderJob job;
+
+		job.node = node;
+		job.data = NULL;
+		job.len = 0;
+
+		if ((needsDecode(load->store, node)) && (loaderRun(job)))
+		{
+			budgetWaitDrain();
+		}
+	}
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+/* Inputs that were held back until all of them had been found. Unless they
+ * go to the readers first, rather than being queued one by one the loader's
+ * threads and this one claim ranges of them directly. */
+static void submitDeferred(const struct loadTarget * const target, 
+	const struct costSlot * const order, const size_t len)
+{
+	size_t i;
+
+#ifndef DIF_DISABLE_THREADING
+	if (target->readers == NULL)
+	{
+		const size_t threads = (target->decoders->num_threads == 0) 
+			? 1 : target->decoders->num_threads;
+		const size_t line = mtpLineGrain(sizeof(struct entry));
+		size_t grain = len / (threads * DIF_LOAD_RANGES_PER_THREAD);
+		struct deferredLoad load;
+
+		/* Largest first wants every file started as soon as possible,
+		 * and scattered entries have no lines to keep apart anyway */
+		grain = ((order != NULL) || (grain < line)) 
+			? 1 : grain - (grain % line);
+		load.store = target->store;
+		load.order = order;
+		loaderParallelFor(target->decoders, 0, len, grain, loadRange, 
+			&load);
+
+		return;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	for (i = 0; i < len; i++)
+	{
+		struct entry * const node 
+			= scheduledEntry(target->store, order, i);
+
+		if (needsDecode(target->store, node))
+		{
+			submitEntry(target, node);
+		}
+	}
+}
+
+/* file is where the walker found the path, NULL for a named input */
+static void addEntry(struct loadTarget * const target, const char *path,
+	const struct difWalkFile * const file)
+{
+	struct entry *node;
+
+	if ((node = storeAdd(target->store, path)) == NULL)
+	{
+		fprintf(stderr, "Allocation failure, skipping: '%s'\n", path);
+
+		return;
+	}
+
+	/* Files of an unchanged directory are taken without a stat, falling
+	 * back to a lookup should their print be of the wrong kind */
+	if ((target->cache != NULL)
+	&& (((file != NULL) && (printCacheReuse(target->cache, file->record,
+		&node->print, &node->density, &node->source)))
+	|| (printCacheLookup(target->cache, path, 
+		(file != NULL) ? &file->dir : NULL, &node->print, 
+		&node->density, &node->source, &node->cache_slot))))
+	{
+		node->cached = 1;
+
+		return;
+	}
+
+	if (!target->defer)
+	{
+		submitEntry(target, node);
+	}
+}
+
+/* An image piped in is fingerprinted straight from memory on this thread,
+ * named "-" after the stream it came from */
+static void addStdin(struct loadTarget * const target)
+{
+	struct entry piped = {0, "-", 0, 0, 0, 0, 0, 0, 0};
+	unsigned char *data;
+	struct entry *node;
+	size_t len;
+
+	if (readWholeStream(stdin, &data, &len) != 0)
+	{
+		fputs("Failed to read an image from stdin\n", stderr);
+
+		return;
+	}
+
+	fingerprintEntry(&piped, data, len);
+	free(data);
+
+	if (piped.source == 0)
+	{
+		return;
+	}
+
+	if ((node = storeAdd(target->store, piped.path)) == NULL)
+	{
+		fputs("Allocation failure, skipping: '-'\n", stderr);
+
+		return;
+	}
+
+	*node = piped;
+}
+
+static void addInput(void *ctx, const char *path)
+{
+	addEntry((struct loadTarget *) ctx, path, NULL);
+}
+
+static void addWalked(void *ctx, const char *path, 
+	const struct difWalkFile *file)
+{
+	addEntry((struct loadTarget *) ctx, path, file);
+}
+
+/* Paths are read a block at a time and each is submitted as soon as its 
+ * delimiter is seen, so loading starts before the list has been read. 
+ * Returns -1 on a read or allocation failure. */
+#define DIF_LIST_BLOCK (64 * 1024)
+
+static int readFileList(FILE * const in, const int delim, 
+	struct difPathArena * const arena, struct loadTarget * const target)
+{
+	char *buf = NULL;
+	size_t cap = DIF_LIST_BLOCK;
+	size_t len = 0;
+	size_t got;
+	int ret = 0;
+
+	if ((buf = malloc(cap)) == NULL)
+	{
+		return -1;
+	}
+
+	do
+	{
+		size_t start = 0;
+		char *end;
+
+		got = fread(buf + len, 1, cap - len, in);
+		len += got;
+
+		/* The last path needn't be terminated */
+		if ((got == 0) && (len != 0) && (buf[len - 1] != delim))
+		{
+			buf[len++] = (char) delim;
+		}
+
+		while ((end = memchr(buf + start, delim, len - start)) != NULL)
+		{
+			size_t path_len = (size_t) (end - (buf + start));
+			char *path;
+
+			if ((delim == '\n') && (path_len != 0) 
+			&& (buf[start + path_len - 1] == '\r'))
+			{
+				path_len--;
+			}
+
+			if (path_len != 0)
+			{
+				if ((path = pathArenaCopy(arena, buf + start, 
+					path_len)) == NULL)
+				{
+					ret = -1;
+
+					goto CLEANUP;
+				}
+
+				addInput(target, path);
+			}
+
+			start = (size_t) (end - buf) + 1;
+		}
+
+		/* Carry the partial path over, growing if it fills the block */
+		memmove(buf, buf + start, len - start);
+		len -= start;
+
+		if (len + 1 >= cap)
+		{
+			char * const tmp = realloc(buf, cap * 2);
+
+			if (tmp == NULL)
+			{
+				ret = -1;
+
+				goto CLEANUP;
+			}
+
+			buf = tmp;
+			cap *= 2;
+		}
+	} while (got != 0);
+
+	if (ferror(in))
+	{
+		ret = -1;
+	}
+
+CLEANUP:
+
+	free(buf);
+
+	return ret;
+}
+
+/* The watch and serve daemons keep every print in memory with a hamming index
+ * over them, ids being indices into the set's own entry store. Paths are 
+ * mapped to ids so a file written again replaces its old print rather than 
+ * adding one. */
+#define DIF_SET_MAP_MIN (1024)
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+struct printSet
+{
+	struct entryStore store;
+	struct difPathArena paths;
+	struct difHammingIndex *index;
+	size_t *map; /* 1 + id by path hash, 0 for an empty slot */
+	size_t map_cap;
+#ifndef DIF_DISABLE_THREADING
+	pthread_rwlock_t lock; /* Only taken while serving */
+#endif /* !DIF_DISABLE_THREADING */
+};
+
+static void printSetInit(struct printSet * const set)
+{
+	memset(set, 0, sizeof(struct printSet));
+	storeInit(&set->store);
+	pathArenaInit(&set->paths);
+#ifndef DIF_DISABLE_THREADING
+	pthread_rwlock_init(&set->lock, NULL);
+#endif /* !DIF_DISABLE_THREADING */
+}
+
+static void printSetFree(struct printSet * const set)
+{
+	storeFree(&set->store);
+	pathArenaFree(&set->paths);
+	hammingIndexFree(set->index);
+	free(set->map);
+#ifndef DIF_DISABLE_THREADING
+	pthread_rwlock_destroy(&set->lock);
+#endif /* !DIF_DISABLE_THREADING */
+}
+
+static size_t setSlot(const struct printSet * const set, 
+	const char * const path)
+{
+	size_t pos = (size_t) hashPath(path) & (set->map_cap - 1);
+
+	while ((set->map[pos] != 0) && (strcmp(storeAt(&set->store, 
+		set->map[pos] - 1)->path, path) != 0))
+	{
+		pos = (pos + 1) & (set->map_cap - 1);
+	}
+
+	return pos;
+}
+
+/* Returns 1 + the id held for path, 0 if there isn't one */
+static size_t setFind(const struct printSet * const set, 
+	const char * const path)
+{
+	return (set->map_cap != 0) ? set->map[setSlot(set, path)] : 0;
+}
+
+/* Keeps the map at most half full, every stored entry is mapped */
+static int setMapReserve(struct printSet * const set)
+{
+	const size_t cap = (set->map_cap == 0) 
+		? DIF_SET_MAP_MIN : set->map_cap * 2;
+	size_t i;
+
+	if ((set->store.len + 1) * 2 <= set->map_cap)
+	{
+		return 0;
+	}
+
+	free(set->map);
+
+	if ((set->map = calloc(cap, sizeof(size_t))) == NULL)
+	{
+		set->map_cap = 0;
+
+		return -1;
+	}
+
+	set->map_cap = cap;
+
+	for (i = 0; i < set->store.len; i++)
+	{
+		set->map[setSlot(set, storeAt(&set->store, i)->path)] = i + 1;
+	}
+
+	return 0;
+}
+
+/* Returns the entry's id, adding it if the path is new or SIZE_MAX if it 
+ * couldn't be. A path already held is given back as it is. */
+static size_t setTrack(struct printSet * const set, const char * const path,
+	const struct entry * const from)
+{
+	struct entry *node;
+	size_t pos;
+
+	if (setMapReserve(set) != 0)
+	{
+		return SIZE_MAX;
+	}
+
+	if (set->map[pos = setSlot(set, path)] != 0)
+	{
+		return set->map[pos] - 1;
+	}
+
+	if ((node = storeAdd(&set->store, path)) == NULL)
+	{
+		return SIZE_MAX;
+	}
+
+	if (from != NULL)
+	{
+		*node = *from;
+	}
+
+	set->map[pos] = set->store.len;
+
+	return set->store.len - 1;
+}
+
+/* Indexes the entries of the initial run */
+static int printSetSeed(struct printSet * const set, 
+	const struct entry * const src, const size_t len, 
+	const unsigned char threshold)
+{
+	size_t i;
+
+	if ((set->index = hammingIndexNew(threshold)) == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		const size_t id = setTrack(set, src[i].path, &src[i]);
+
+		if ((id == SIZE_MAX) || ((src[i].source != 0) 
+		&& (hammingIndexInsert(set->index, src[i].print, id) != 0)))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void daemonSignal(int sig)
+{
+	(void) sig;
+	daemon_stop = 1;
+}
+
+/* Without SA_RESTART so a blocked read or poll returns to see the flag */
+static void catchStopSignals(void)
+{
+#ifdef DIF_MAIN_POSIX
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = daemonSignal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+#endif /* DIF_MAIN_POSIX */
+}
+
+/* Events are gathered a read at a time and the new files fingerprinted on 
+ * the loader threads together, then each is queried and indexed in turn. */
+struct watchState
+{
+	struct printSet *set;
+	size_t *batch; /* ids waiting to be fingerprinted */
+	size_t batch_len;
+	size_t batch_cap;
+	const struct loadTarget *target;
+	FILE *output;
+	size_t query; /* id being queried, for watchMatch */
+};
+
+static void watchStateInit(struct watchState * const state, 
+	struct printSet * const set)
+{
+	memset(state, 0, sizeof(struct watchState));
+	state->set = set;
+}
+
+static void watchStateFree(struct watchState * const state)
+{
+	free(state->batch);
+}
+
+/* Drops the prints of every entry below the directory, the entries are kept
+ * as for a single file so a path seen again reuses its id */
+static void watchDropTree(struct printSet * const set, const char * const dir)
+{
+	const size_t len = strlen(dir);
+	size_t i;
+
+	for (i = 0; i < set->store.len; i++)
+	{
+		struct entry * const node = storeAt(&set->store, i);
+
+		if ((node->source != 0) && (strncmp(node->path, dir, len) == 0)
+		&& ((node->path[len] == '/') 
+		|| ((len != 0) && (dir[len - 1] == '/'))))
+		{
+			(void) hammingIndexRemove(set->index, node->print, i);
+			node->source = 0;
+		}
+	}
+}
+
+/* Runs on the main thread from inside dirWatchPoll */
+static void watchEvent(void *ctx, const char *path, int kind)
+{
+	struct watchState * const state = (struct watchState *) ctx;
+	struct printSet * const set = state->set;
+	struct entry *node;
+	size_t id;
+
+	if (kind == DIF_WATCH_REMOVED_DIR)
+	{
+		watchDropTree(set, path);
+
+		return;
+	}
+
+	if ((id = setFind(set, path)) != 0)
+	{
+		id--;
+	}
+	else if (kind == DIF_WATCH_REMOVED)
+	{
+		return;
+	}
+	else if ((path = pathArenaCopy(&set->paths, path, strlen(path))) 
+		== NULL)
+	{
+		return;
+	}
+	else if ((id = setTrack(set, path, NULL)) == SIZE_MAX)
+	{
+		fprintf(stderr, "Allocation failure, skipping: '%s'\n", path);
+
+		return;
+	}
+
+	node = storeAt(&set->store, id);
+
+	/* Only fingerprinted entries are indexed */
+	if (node->source != 0)
+	{
+		(void) hammingIndexRemove(set->index, node->print, id);
+		node->source = 0;
+	}
+
+	if ((kind == DIF_WATCH_REMOVED) || (node->queued))
+	{
+		return;
+	}
+
+	if (state->batch_len == state->batch_cap)
+	{
+		const size_t cap = (state->batch_cap == 0) 
+			? 64 : state->batch_cap * 2;
+		size_t * const tmp = realloc(state->batch, sizeof(size_t) * cap);
+
+		if (tmp == NULL)
+		{
+			fprintf(stderr, "Allocation failure, skipping: '%s'\n", 
+				path);
+
+			return;
+		}
+
+		state->batch = tmp;
+		state->batch_cap = cap;
+	}
+
+	node->queued = 1;
+	state->batch[state->batch_len++] = id;
+}
+
+static void watchMatch(void *ctx, size_t id, unsigned int distance)
+{
+	const struct watchState * const state 
+		= (const struct watchState *) ctx;
+	const struct entryStore * const store = &state->set->store;
+	const char * const path = storeAt(store, state->query)->path;
+	const char * const other = storeAt(store, id)->path;
+
+	(void) distance;
+	fprintf(stdout, "\"%s\" \"%s\"\n", path, other);
+
+	if (state->output != NULL)
+	{
+		fprintf(state->output, "\"%s\" \"%s\"\n", path, other);
+	}
+}
+
+static void watchFlush(struct watchState * const state, 
+	const unsigned char threshold)
+{
+	struct printSet * const set = state->set;
+	size_t i;
+
+	for (i = 0; i < state->batch_len; i++)
+	{
+		submitEntry(state->target, storeAt(&set->store, 
+			state->batch[i]));
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if (state->target->readers != NULL)
+	{
+		ioWaitOnIdle(state->target->readers);
+	}
+
+	loaderSettle(state->target->decoders);
+#endif /* !DIF_DISABLE_THREADING */
+
+	for (i = 0; i < state->batch_len; i++)
+	{
+		struct entry * const node 
+			= storeAt(&set->store, state->batch[i]);
+
+		node->queued = 0;
+
+		if (node->source == 0)
+		{
+			continue;
+		}
+
+		state->query = state->batch[i];
+		(void) hammingIndexQuery(set->index, node->print, threshold,
+			watchMatch, state);
+
+		if (hammingIndexInsert(set->index, node->print, 
+			state->batch[i]) != 0)
+		{
+			node->source = 0;
+		}
+	}
+
+	state->batch_len = 0;
+	fflush(stdout);
+
+	if (state->output != NULL)
+	{
+		fflush(state->output);
+	}
+}
+
+/* Indexes the entries of the initial run and then streams the matches of 
+ * every image written below the watched directories until interrupted */
+static int runWatch(struct watchState * const state, 
+	struct difWatch * const watch, const struct entry * const src, 
+	const size_t len, const unsigned char threshold)
+{
+	if (printSetSeed(state->set, src, len, threshold) != 0)
+	{
+		return -1;
+	}
+
+	catchStopSignals();
+
+	if (verbose)
+	{
+		fprintf(stdout, "watch: %lu prints indexed\n", 
+			(unsigned long) hammingIndexSize(state->set->index));
+	}
+
+	fflush(stdout);
+
+	while (!daemon_stop)
+	{
+		if (dirWatchPoll(watch) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			fputs("Failed to read watch events\n", stderr);
+
+			return -1;
+		}
+
+		watchFlush(state, threshold);
+	}
+
+	return 0;
+}
+
+/* The server's threads answer requests against the set concurrently, queries
+ * sharing it under the read lock while an insert takes it whole */
+struct serveState
+{
+	struct printSet *set;
+	unsigned char threshold; /* For requests that don't give their own */
+};
+
+struct serveQuery
+{
+	const struct entryStore *store;
+	difServeMatch match;
+	void *reply;
+	int failed;
+};
+
+#ifndef DIF_DISABLE_THREADING
+#define DIF_SET_READ_LOCK(set)  pthread_rwlock_rdlock(&(set)->lock)
+#define DIF_SET_WRITE_LOCK(set) pthread_rwlock_wrlock(&(set)->lock)
+#define DIF_SET_UNLOCK(set)     pthread_rwlock_unlock(&(set)->lock)
+#else
+#define DIF_SET_READ_LOCK(set)  ((void) 0)
+#define DIF_SET_WRITE_LOCK(set) ((void) 0)
+#define DIF_SET_UNLOCK(set)     ((void) 0)
+#endif /* DIF_DISABLE_THREADING */
+
+/* Files are decoded on the calling thread, the set isn't touched */
+static int serveFingerprint(void *ctx, const char *path, 
+	const unsigned char *data, size_t len, uint64_t *print)
+{
+	struct entry node = {0, NULL, 0, 0, 0, 0, 0, 0, 0};
+
+	(void) ctx;
+	node.path = (path != NULL) ? path : "(buffer)";
+	fingerprintEntry(&node, data, len);
+
+	if (node.source == 0)
+	{
+		return -1;
+	}
+
+	*print = node.print;
+
+	return 0;
+}
+
+static void serveMatch(void *ctx, size_t id, unsigned int distance)
+{
+	struct serveQuery * const query = (struct serveQuery *) ctx;
+
+	if (query->match(query->reply, storeAt(query->store, id)->path, 
+		distance) != 0)
+	{
+		query->failed = 1;
+	}
+}
+
+static int serveQuery(void *ctx, uint64_t print, unsigned int threshold,
+	difServeMatch match, void *reply)
+{
+	const struct serveState * const state 
+		= (const struct serveState *) ctx;
+	struct serveQuery query;
+
+	query.store = &state->set->store;
+	query.match = match;
+	query.reply = reply;
+	query.failed = 0;
+
+	if (threshold == DIF_SERVE_DEFAULT_THRESHOLD)
+	{
+		threshold = state->threshold;
+	}
+
+	DIF_SET_READ_LOCK(state->set);
+	(void) hammingIndexQuery(state->set->index, print, 
+		(threshold > DIF_PRINT_BITS) ? DIF_PRINT_BITS : threshold, 
+		serveMatch, &query);
+	DIF_SET_UNLOCK(state->set);
+
+	return (query.failed) ? -1 : 0;
+}
+
+/* A name already held has its print replaced */
+static int serveInsert(void *ctx, uint64_t print, const char *name,
+	uint64_t *id)
+{
+	struct printSet * const set = ((const struct serveState *) ctx)->set;
+	struct entry *node;
+	size_t at;
+	int ret = -1;
+
+	DIF_SET_WRITE_LOCK(set);
+
+	if ((at = setFind(set, name)) != 0)
+	{
+		at--;
+	}
+	else if (((name = pathArenaCopy(&set->paths, name, strlen(name))) 
+		== NULL) || ((at = setTrack(set, name, NULL)) == SIZE_MAX))
+	{
+		goto UNLOCK;
+	}
+
+	node = storeAt(&set->store, at);
+
+	if (node->source != 0)
+	{
+		(void) hammingIndexRemove(set->index, node->print, at);
+		node->source = 0;
+	}
+
+	if (hammingIndexInsert(set->index, print, at) == 0)
+	{
+		node->print = print;
+		node->density = (unsigned char) difDensity(print);
+		node->source = DIF_CACHE_FULL;
+		*id = at;
+		ret = 0;
+	}
+
+UNLOCK:
+
+	DIF_SET_UNLOCK(set);
+
+	return ret;
+}
+
+static const struct difServeOps serve_ops =
+{
+	serveFingerprint,
+	serveQuery,
+	serveInsert
+};
+
+/* Indexes the entries of the initial run and then answers requests until
+ * interrupted */
+static int runServe(struct serveState * const state, 
+	struct difQueryServer * const server, const struct entry * const src,
+	const size_t len)
+{
+	if (printSetSeed(state->set, src, len, state->threshold) != 0)
+	{
+		return -1;
+	}
+
+	catchStopSignals();
+
+	if (verbose)
+	{
+		fprintf(stdout, "serve: %lu prints indexed\n", 
+			(unsigned long) hammingIndexSize(state->set->index));
+	}
+
+	fflush(stdout);
+
+	return queryServerRun(server, &daemon_stop);
+}
+
+static void reportThumbnailChecks(const struct entry * const src, 
+	const size_t len, const unsigned char threshold)
+{
+	size_t checked = 0;
+	size_t exceeded = 0;
+	size_t total = 0;
+	unsigned char worst = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		if (src[i].thumb_check != 0)
+		{
+			const unsigned char dist = src[i].thumb_check - 1;
+
+			checked++;
+			total += dist;
+			exceeded += (dist > threshold);
+			worst = (dist > worst) ? dist : worst;
+		}
+	}
+
+	if (checked == 0)
+	{
+		fputs("thumbnail check: no thumbnails sampled\n", stderr);
+
+		return;
+	}
+
+	fprintf(stderr, "thumbnail check: %lu sampled, mean distance %.2f, "
+		"max %d, %lu above threshold\n", (unsigned long) checked, 
+		(double) total / (double) checked, worst, 
+		(unsigned long) exceeded);
+}
+
+/* A count is a plain decimal number from 1 to max, anything else is refused 
+ * rather than read as 0 or wrapped */
+static int parseCount(const char * const arg, const unsigned long max,
+	unsigned long * const count)
+{
+	unsigned long value;
+	char *end;
+
+	if ((arg == NULL) || (arg[0] < '0') || (arg[0] > '9'))
+	{
+		return -1;
+	}
+
+	errno = 0;
+	value = strtoul(arg, &end, 10);
+
+	if ((*end != '\0') || (errno != 0) || (value == 0) || (value > max))
+	{
+		return -1;
+	}
+
+	*count = value;
+
+	return 0;
+}
+
+/* Beyond this many outstanding reads there is nothing more to overlap */
+#define DIF_READ_AHEAD_MAX (4096)
+
+/* Descriptors kept back for the walker, the cache and stdio */
+#define DIF_FD_RESERVE (64)
+
+/* Every outstanding read holds a descriptor, so the read ahead also has to 
+ * stay below the open file limit */
+static unsigned long readAheadLimit(void)
+{
+#ifdef DIF_MAIN_POSIX
+	struct rlimit limit;
+
+	if ((getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	&& (limit.rlim_cur != RLIM_INFINITY)
+	&& (limit.rlim_cur < DIF_READ_AHEAD_MAX + DIF_FD_RESERVE))
+	{
+		return (limit.rlim_cur > DIF_FD_RESERVE) 
+			? (unsigned long) (limit.rlim_cur - DIF_FD_RESERVE) : 0;
+	}
+#endif /* DIF_MAIN_POSIX */
+
+	return DIF_READ_AHEAD_MAX;
+}
+
+#ifndef DIF_DISABLE_THREADING
+/* Enough for any host, a typo of an extra digit shouldn't spawn a million */
+#define DIF_THREADS_MAX (1024)
+
+/* A thread count is a number from 1 to DIF_THREADS_MAX, or auto for 0 */
+static int parseThreads(const char * const arg, size_t * const threads)
+{
+	unsigned long count;
+
+	if ((arg != NULL) && (strcmp(arg, "auto") == 0))
+	{
+		*threads = 0;
+
+		return 0;
+	}
+
+	if (parseCount(arg, DIF_THREADS_MAX, &count) != 0)
+	{
+		return -1;
+	}
+
+	*threads = (size_t) count;
+
+	return 0;
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+static void printHelp(void)
+{
+	fputs("Image Comparison Program\n\n", stderr);
+	fputs("Usage:\n", stderr);
+	fputs("\t./difDemo [flags]... [images]...\n", stderr);
+	fputs("\tAn image given as - is read from stdin\n\n", stderr);
+	fputs("Command Line Flags:\n", stderr);
+	fputs("\t-t, --threshold <NUM> : Similarity limit, default 5\n", 
+		stderr);
+	fputs("\t-T, --threads <NUM|auto> : Thread max, if built, default "
+		"auto\n", stderr);
+	fputs("\t    --cpu-threads <NUM|auto> : Same as --threads\n", stderr);
+	fputs("\t-c, --compare-threads <NUM|auto> : Threads comparing "
+		"prints\n", stderr);
+	fputs("\t-p, --pin            : Pin each worker to a CPU of its "
+		"own\n", stderr);
+	fputs("\t-I, --io-threads <NUM|auto> : Threads reading ahead of "
+		"the decoders\n", stderr);
+	fputs("\t-o, --output <PATH>   : Path to output file\n", stderr);
+	fputs("\t-e, --use-embedded-thumbnail : Hash EXIF thumbnails if "
+		"present\n", stderr);
+	fputs("\t-E, --check-thumbnails <NUM> : Verify 1 in NUM thumbnail "
+		"prints\n", stderr);
+	fputs("\t-P, --parallelism <images|pixels|auto> : Where decode "
+		"threads are spent\n", stderr);
+	fputs("\t-R, --read-ahead <NUM> : Files to keep reads outstanding "
+		"for\n", stderr);
+	fputs("\t-M, --mem-budget <MiB> : Cap on decoded pixels in flight\n",
+		stderr);
+	fputs("\t-L, --largest-first  : Decode the costliest images first\n",
+		stderr);
+	fputs("\t-r, --recursive <DIR> : Add the images found below DIR\n",
+		stderr);
+	fputs("\t-f, --files-from <PATH|-> : Add the images listed in PATH\n",
+		stderr);
+	fputs("\t-0, --null           : The list is NUL, not newline, "
+		"delimited\n", stderr);
+	fputs("\t-x, --exact-prefilter : Decode byte identical files once\n",
+		stderr);
+	fputs("\t-C, --cache <PATH>   : Keep fingerprints in a cache file\n",
+		stderr);
+	fputs("\t-F, --full-verify    : Look at every cached file this run\n",
+		stderr);
+	fputs("\t-A, --verify-age <HOURS> : Verify in full once the last is "
+		"older\n", stderr);
+	fputs("\t-W, --watch <DIR>    : Keep watching DIR and stream new "
+		"matches\n", stderr);
+	fputs("\t-S, --serve <SOCKET> : Keep answering queries on SOCKET\n",
+		stderr);
+	fputs("\t-v, --verbose         : Enables extra information output\n",
+		stderr);
+	fputs("\t-h, --help            : Prints this message and exits\n",
+		stderr);
+	fputs("\n", stderr);
+}
+
+int main(int argc, char **argv)
+{
+	const struct portoptVerboseOpt opts[] =
+	{
+		{'t', "threshold", PORTOPT_TRUE},
+		{'o', "output",    PORTOPT_TRUE},
+		{'T', "threads",   PORTOPT_TRUE},
+		{'T', "cpu-threads", PORTOPT_TRUE},
+		{'I', "io-threads", PORTOPT_TRUE},
+		{'c', "compare-threads", PORTOPT_TRUE},
+		{'p', "pin",       PORTOPT_FALSE},
+		{'e', "use-embedded-thumbnail", PORTOPT_FALSE},
+		{'E', "check-thumbnails", PORTOPT_TRUE},
+		{'P', "parallelism", PORTOPT_TRUE},
+		{'R', "read-ahead", PORTOPT_TRUE},
+		{'M', "mem-budget", PORTOPT_TRUE},
+		{'L', "largest-first", PORTOPT_FALSE},
+		{'L', "lpt",       PORTOPT_FALSE},
+		{'r', "recursive", PORTOPT_TRUE},
+		{'f', "files-from", PORTOPT_TRUE},
+		{'0', "null",      PORTOPT_FALSE},
+		{'x', "exact-prefilter", PORTOPT_FALSE},
+		{'C', "cache",     PORTOPT_TRUE},
+		{'F', "full-verify", PORTOPT_FALSE},
+		{'A', "verify-age", PORTOPT_TRUE},
+		{'W', "watch",     PORTOPT_TRUE},
+		{'S', "serve",     PORTOPT_TRUE},
+		{'v', "verbose",   PORTOPT_FALSE},
+		{'h', "help",      PORTOPT_FALSE}
+	};
+	const size_t num_opts = sizeof(opts) / sizeof(opts[0]);
+	const size_t argl = (size_t) argc;
+	size_t ind = 0;
+	int flag;
+
+	unsigned char similar_threshold = 5;
+	FILE *output = NULL;
+	struct difImageConfig image_config = {NULL, 1, DIF_PARALLEL_AUTO, 0};
+	const char *arg;
+	unsigned long count;
+#ifndef DIF_DISABLE_THREADING
+	size_t num_threads = 0;
+	size_t io_threads = 0;
+	size_t cpus;
+	PORTOPT_BOOL pin = PORTOPT_FALSE;
+	struct loaderThreadPool *pool = NULL;
+	struct ioThreadPool *io_pool = NULL;
+	PORTOPT_BOOL largest_first = PORTOPT_FALSE;
+#endif /* !DIF_DISABLE_THREADING */
+	struct costSlot *order = NULL;
+	unsigned long read_ahead = 0;
+	struct difReadAhead *reader = NULL;
+	const char **roots = NULL;
+	size_t num_roots = 0;
+	struct difWalk *walker = NULL;
+	struct entryStore store;
+	struct loadTarget target;
+	const char *files_from = NULL;
+	int list_delim = '\n';
+	FILE *list = NULL;
+	int list_from_stdin;
+	struct difPathArena list_paths;
+	PORTOPT_BOOL exact = PORTOPT_FALSE;
+	long copies;
+	const char *cache_path = NULL;
+	struct difPrintCache *cache = NULL;
+	PORTOPT_BOOL full_verify = PORTOPT_FALSE;
+	long verify_age = 0;
+	int trust_dirs;
+	const char *watch_root = NULL;
+	struct difWatch *watcher = NULL;
+	struct watchState watch_state;
+	const char *serve_path = NULL;
+	struct difQueryServer *server = NULL;
+	struct serveState serve_state;
+	struct printSet prints;
+
+	struct entry *entry_arr = NULL;
+	struct difPool *compare_pool = NULL;
+	size_t num_compare_threads = 0;
+	int ret = 0;
+	size_t lim, i;
+
+	image_config.program = argv[0];
+	storeInit(&store);
+	pathArenaInit(&list_paths);
+	printSetInit(&prints);
+	watchStateInit(&watch_state, &prints);
+
+	if ((roots = malloc(sizeof(const char *) * argl)) == NULL)
+	{
+		fputs("Allocation failure\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	while ((flag = portoptVerbose(argl, argv, opts, num_opts, &ind)) != -1)
+	{
+		switch (flag)
+		{
+			case 't':
+				similar_threshold = atol(
+					portoptGetArg(argl, argv, &ind));
+
+				break;
+			case 'T':
+#ifndef DIF_DISABLE_THREADING
+				if (parseThreads(portoptGetArg(argl, argv, 
+					&ind), &num_threads) != 0)
+				{
+					fprintf(stderr, "Thread count must be "
+						"auto or 1 to %d\n", 
+						DIF_THREADS_MAX);
+					ret = 1;
+
+					goto CLEANUP;
+				}
+#else
+				(void) portoptGetArg(argl, argv, &ind);
+				fputs("Not built with threading support\n",
+					stderr);
+#endif /* DIF_DISABLE_THREADING */
+
+				break;
+			case 'o':
+				if ((output = fopen(portoptGetArg(argl, argv, 
+					&ind), "wb")) == NULL)
+				{
+					fputs("Failed to open output file\n",
+						stderr);
+
+					goto CLEANUP;
+				}
+
+				break;
+			case 'e':
+				read_flags |= DIF_READ_THUMBNAIL;
+
+				break;
+			case 'E':
+				thumb_check_rate = strtoul(
+					portoptGetArg(argl, argv, &ind), NULL,
+					10);
+
+				break;
+			case 'P':
+				arg = portoptGetArg(argl, argv, &ind);
+
+				if ((arg != NULL) && (strcmp(arg, "images") == 0))
+				{
+					image_config.parallelism 
+						= DIF_PARALLEL_IMAGES;
+				}
+				else if ((arg != NULL) 
+				&& (strcmp(arg, "pixels") == 0))
+				{
+					image_config.parallelism 
+						= DIF_PARALLEL_PIXELS;
+				}
+				else
+				{
+					image_config.parallelism 
+						= DIF_PARALLEL_AUTO;
+				}
+
+				break;
+			case 'I':
+#ifndef DIF_DISABLE_THREADING
+				if (parseThreads(portoptGetArg(argl, argv, 
+					&ind), &io_threads) != 0)
+				{
+					fprintf(stderr, "I/O thread count must"
+						" be auto or 1 to %d\n", 
+						DIF_THREADS_MAX);
+					ret = 1;
+
+					goto CLEANUP;
+				}
+#else
+				(void) portoptGetArg(argl, argv, &ind);
+				fputs("Not built with threading support\n",
+					stderr);
+#endif /* DIF_DISABLE_THREADING */
+
+				break;
+			case 'c':
+#ifndef DIF_DISABLE_THREADING
+				if (parseThreads(portoptGetArg(argl, argv, 
+					&ind), &num_compare_threads) != 0)
+				{
+					fprintf(stderr, "Compare thread count "
+						"must be auto or 1 to %d\n", 
+						DIF_THREADS_MAX);
+					ret = 1;
+
+					goto CLEANUP;
+				}
+#else
+				(void) portoptGetArg(argl, argv, &ind);
+				fputs("Not built with threading support\n",
+					stderr);
+#endif /* DIF_DISABLE_THREADING */
+
+				break;
+			case 'p':
+#ifndef DIF_DISABLE_THREADING
+				pin = PORTOPT_TRUE;
+#else
+				fputs("Not built with threading support\n",
+					stderr);
+#endif /* DIF_DISABLE_THREADING */
+
+				break;
+			case 'R':
+				if (parseCount(portoptGetArg(argl, argv, &ind),
+					readAheadLimit(), &read_ahead) != 0)
+				{
+					fprintf(stderr, "Read ahead must be 1 to %lu"
+						" files under the open file limit\n",
+						readAheadLimit());
+					ret = 1;
+
+					goto CLEANUP;
+				}
+
+				break;
+			case 'M':
+				if (parseCount(portoptGetArg(argl, argv, &ind),
+					(unsigned long) (SIZE_MAX >> 20), &count)
+					!= 0)
+				{
+					fprintf(stderr, "Memory budget must be "
+						"1 to %lu MiB\n", 
+						(unsigned long) (SIZE_MAX >> 20));
+					ret = 1;
+
+					goto CLEANUP;
+				}
+
+				image_config.mem_budget = (size_t) count << 20;
+
+				break;
+			case 'L':
+#ifndef DIF_DISABLE_THREADING
+				largest_first = PORTOPT_TRUE;
+#else
+				fputs("Not built with threading support\n",
+					stderr);
+#endif /* DIF_DISABLE_THREADING */
+
+				break;
+			case 'r':
+				if ((arg = portoptGetArg(argl, argv, &ind)) 
+					!= NULL)
+				{
+					roots[num_roots++] = arg;
+				}
+
+				break;
+			case 'f':
+				files_from = portoptGetArg(argl, argv, &ind);
+
+				break;
+			case '0':
+				list_delim = '\0';
+
+				break;
+			case 'x':
+				exact = PORTOPT_TRUE;
+
+				break;
+			case 'C':
+				cache_path = portoptGetArg(argl, argv, &ind);
+
+				break;
+			case 'F':
+				full_verify = PORTOPT_TRUE;
+
+				break;
+			case 'A':
+				if ((arg = portoptGetArg(argl, argv, &ind)) 
+					!= NULL)
+				{
+					verify_age = atol(arg) * 3600;
+				}
+
+				break;
+			case 'W':
+				if ((arg = portoptGetArg(argl, argv, &ind)) 
+					!= NULL)
+				{
+					watch_root = arg;
+					roots[num_roots++] = arg;
+				}
+
+				break;
+			case 'S':
+				serve_path = portoptGetArg(argl, argv, &ind);
+
+				break;
+			case 'v':
+				verbose = PORTOPT_TRUE;
+
+				break;
+			case 'h':
+				printHelp();
+
+				goto CLEANUP;
+			case '?': /* fallthrough */
+			default:
+				break;
+		}
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	/* Left at auto, the pools get a thread per CPU this process may use,
+	 * which respects a container's quota as well as its cpuset. Comparing
+	 * has its own count, but an explicit --threads still caps it. */
+	cpus = cpuSetCount();
+
+	if (num_compare_threads == 0)
+	{
+		num_compare_threads = ((num_threads != 0) && (num_threads < cpus))
+			? num_threads : cpus;
+	}
+
+	if (num_threads == 0)
+	{
+		num_threads = cpus;
+	}
+
+	if (verbose)
+	{
+		fprintf(stdout, "threads: %lu decoding, %lu comparing, %lu "
+			"CPUs available\n", (unsigned long) num_threads, 
+			(unsigned long) num_compare_threads, 
+			(unsigned long) cpus);
+	}
+
+	/* Every core goes to the one image being decoded at a time */
+	if (image_config.parallelism == DIF_PARALLEL_PIXELS)
+	{
+		num_threads = 1;
+	}
+
+	image_config.workers = num_threads;
+#endif /* !DIF_DISABLE_THREADING */
+
+	difInit(&image_config);
+	ind += (ind == 0);
+
+	list_from_stdin = (files_from != NULL) && (strcmp(files_from, "-") == 0);
+
+	/* A server may start out empty and be filled by its clients */
+	if ((argl - ind < 2) && (num_roots == 0) && (files_from == NULL)
+	&& (serve_path == NULL))
+	{
+		printHelp();
+
+		goto CLEANUP;
+	}
+
+	for (i = ind; (list_from_stdin) && (i < argl); i++)
+	{
+		if (strcmp(argv[i], "-") == 0)
+		{
+			fputs("stdin can't be both the file list and an image\n",
+				stderr);
+			ret = 1;
+
+			goto CLEANUP;
+		}
+	}
+
+	/* Both would want the main thread to themselves */
+	if ((watch_root != NULL) && (serve_path != NULL))
+	{
+		fputs("Watching and serving can't be combined\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	/* Only thumbnail loaded files are checked, there are none without -e */
+	if ((thumb_check_rate != 0) && ((read_flags & DIF_READ_THUMBNAIL) == 0))
+	{
+		fputs("--check-thumbnails needs --use-embedded-thumbnail\n", 
+			stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	/* The read ahead already does its I/O from the main thread */
+	if ((io_threads != 0) && (read_ahead != 0))
+	{
+		fputs("--io-threads and --read-ahead can't be combined\n", 
+			stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	/* The decoder ring is kept at a couple of jobs per thread so they 
+	 * always have the next file waiting without piling up buffers */
+	if ((pool = loaderNewThreadPool(num_threads, 2 * num_threads)) == NULL)
+	{
+		fputs("Failed to initialize thread pool\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	for (i = 0; (pin) && (i < pool->num_threads); i++)
+	{
+		if (cpuSetPinThread(pool->threads[i], i) != 0)
+		{
+			fputs("Failed to pin a decoder thread\n", stderr);
+
+			break;
+		}
+	}
+
+	if ((io_threads != 0)
+	&& ((io_pool = ioNewThreadPool(io_threads, 2 * io_threads)) == NULL))
+	{
+		fputs("Failed to initialize I/O thread pool\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	target.decoders = pool;
+	target.readers = io_pool;
+	budget_wait.pool = pool;
+
+	if ((read_ahead != 0)
+	&& ((reader = readAheadNew(read_ahead, readAheadDone, pool)) == NULL))
+#else
+	if ((read_ahead != 0)
+	&& ((reader = readAheadNew(read_ahead, readAheadDone, NULL)) == NULL))
+#endif /* DIF_DISABLE_THREADING */
+	{
+		fputs("Failed to initialize read ahead\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	if ((verbose) && (reader != NULL))
+	{
+		fprintf(stdout, "read ahead: %lu files using %s\n", 
+			(unsigned long) read_ahead, readAheadMethod(reader));
+	}
+
+	if ((cache_path != NULL) && ((cache = printCacheOpen(cache_path, 
+		DIF_PRINT_WIDTH, DIF_PRINT_HEIGHT, (read_flags & DIF_READ_THUMBNAIL) != 0))
+		== NULL))
+	{
+		fputs("Failed to open fingerprint cache\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	trust_dirs = printCacheTrustDirs(cache, (full_verify) ? -1 : verify_age);
+
+	if ((verbose) && (cache != NULL) && (num_roots != 0))
+	{
+		fprintf(stdout, "cache: %s\n", (trust_dirs) 
+			? "trusting unchanged directories" : "full verify");
+	}
+
+	target.cache = cache;
+
+	/* Watched before the first walk so nothing written during it is lost,
+	 * the events wait in the kernel until the initial run is over */
+	if ((watch_root != NULL)
+	&& (((watcher = dirWatchNew(watchEvent, &watch_state)) == NULL)
+	|| (dirWatchAdd(watcher, watch_root) != 0)))
+	{
+		fputs("Failed to initialize directory watch\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	watch_state.target = &target;
+	watch_state.output = output;
+	serve_state.set = &prints;
+	serve_state.threshold = similar_threshold;
+
+	/* Bound up front so a taken socket is found before the initial run,
+	 * clients connecting meanwhile wait to be accepted */
+#ifndef DIF_DISABLE_THREADING
+	if ((serve_path != NULL) && ((server = queryServerNew(serve_path, 
+		num_threads, &serve_ops, &serve_state)) == NULL))
+#else
+	if ((serve_path != NULL) && ((server = queryServerNew(serve_path, 0,
+		&serve_ops, &serve_state)) == NULL))
+#endif /* DIF_DISABLE_THREADING */
+	{
+		fputs("Failed to initialize query server\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	/* Inputs go straight to the loader as they're found unless they have 
+	 * to be ordered first or the read ahead, which is only driven from 
+	 * this thread, is to submit them */
+	target.store = &store;
+#ifndef DIF_DISABLE_THREADING
+	target.defer = (reader != NULL) || (largest_first) || (exact);
+#else
+	target.defer = (reader != NULL) || (exact);
+#endif /* DIF_DISABLE_THREADING */
+
+	for (; ind < argl; ind++)
+	{
+		if (strcmp(argv[ind], "-") == 0)
+		{
+			addStdin(&target);
+		}
+		else
+		{
+			addInput(&target, argv[ind]);
+		}
+	}
+
+	if (files_from != NULL)
+	{
+		if (strcmp(files_from, "-") == 0)
+		{
+			list = stdin;
+		}
+		else if ((list = fopen(files_from, "rb")) == NULL)
+		{
+			fprintf(stderr, "Failed to open file list: '%s'\n",
+				files_from);
+			ret = 1;
+
+			goto CLEANUP;
+		}
+
+		if (readFileList(list, list_delim, &list_paths, &target) != 0)
+		{
+			fprintf(stderr, "Failed to read file list: '%s'\n",
+				files_from);
+			ret = 1;
+
+			goto CLEANUP;
+		}
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if ((num_roots != 0) && ((walker = dirWalkNew(num_threads + io_threads,
+		addWalked, &target)) == NULL))
+#else
+	if ((num_roots != 0) 
+	&& ((walker = dirWalkNew(0, addWalked, &target)) == NULL))
+#endif /* DIF_DISABLE_THREADING */
+	{
+		fputs("Failed to initialize directory walker\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	dirWalkSetCache(walker, cache);
+
+	for (i = 0; i < num_roots; i++)
+	{
+		(void) dirWalkRun(walker, roots[i]);
+	}
+
+	lim = store.len;
+
+#ifndef DIF_DISABLE_THREADING
+	copies = (exact) ? markExactCopies(&store, num_threads + io_threads) : 0;
+#else
+	copies = (exact) ? markExactCopies(&store, 1) : 0;
+#endif /* DIF_DISABLE_THREADING */
+
+	if (copies < 0)
+	{
+		fputs("Failed to find exact copies, decoding all\n", stderr);
+	}
+	else if ((verbose) && (exact))
+	{
+		fprintf(stdout, "exact prefilter: %ld of %lu files are copies\n",
+			copies, (unsigned long) lim);
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if ((largest_first) 
+	&& ((order = orderByCost(&store, num_threads + io_threads)) == NULL))
+	{
+		fputs("Failed to order by cost, using given order\n", stderr);
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	/* The read ahead hands complete files to the loader as they arrive */
+	if (reader != NULL)
+	{
+		for (i = 0; i < lim; i++)
+		{
+			struct entry * const node 
+				= scheduledEntry(&store, order, i);
+
+			if (needsDecode(&store, node))
+			{
+				readAheadSubmit(reader, node->path, node);
+			}
+		}
+
+		readAheadFinish(reader);
+	}
+	else if (target.defer)
+	{
+		submitDeferred(&target, order, lim);
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	/* Readers feed the decoders so they have to drain first */
+	if (io_pool != NULL)
+	{
+		ioWaitOnIdle(io_pool);
+	}
+
+	loaderSettle(pool);
+#endif /* !DIF_DISABLE_THREADING */
+
+	inheritExactCopies(&store);
+
+	if (cache != NULL)
+	{
+		size_t hits = 0;
+
+		for (i = 0; i < lim; i++)
+		{
+			const struct entry * const node = storeAt(&store, i);
+
+			hits += node->cached;
+
+			if ((node->cache_slot != 0) && (node->source != 0))
+			{
+				printCacheUpdate(cache, node->cache_slot, 
+					node->print, node->density, 
+					node->source);
+			}
+		}
+
+		if (verbose)
+		{
+			size_t unchanged, visited;
+
+			printCacheDirStats(cache, &unchanged, &visited);
+			fprintf(stdout, "cache: %lu of %lu files hit\n", 
+				(unsigned long) hits, (unsigned long) lim);
+
+			if (visited != 0)
+			{
+				fprintf(stdout, "cache: %lu of %lu directories "
+					"unchanged\n", (unsigned long) unchanged,
+					(unsigned long) visited);
+			}
+		}
+
+		(void) printCacheWrite(cache);
+	}
+
+	if ((entry_arr = storeFlatten(&store)) == NULL)
+	{
+		fputs("Allocation failure\n", stderr);
+		ret = 1;
+
+		goto CLEANUP;
+	}
+
+	fputs("loading complete\n", stderr);
+
+	if (((read_flags & DIF_READ_THUMBNAIL) != 0) && (thumb_check_rate != 0))
+	{
+		reportThumbnailChecks(entry_arr, lim, similar_threshold);
+	}
+
+	/* Without a pool of its own the comparing runs on this thread */
+	if (num_compare_threads > 1)
+	{
+		compare_pool = difPoolNew(num_compare_threads);
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if ((pin) && (difPoolPin(compare_pool) != 0))
+	{
+		fputs("Failed to pin the compare threads\n", stderr);
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	if (doComparison(compare_pool, entry_arr, lim, similar_threshold, 
+		output) != 0)
+	{
+		fputs("Allocation failure, couldn't compare\n", stderr);
+		ret = 1;
+	}
+
+	if ((watcher != NULL) && (runWatch(&watch_state, watcher, entry_arr, 
+		lim, similar_threshold) != 0))
+	{
+		fputs("Watch failed\n", stderr);
+		ret = 1;
+	}
+
+	if ((server != NULL) 
+	&& (runServe(&serve_state, server, entry_arr, lim) != 0))
+	{
+		fputs("Serving failed\n", stderr);
+		ret = 1;
+	}
+
+CLEANUP:
+
+#ifndef DIF_DISABLE_THREADING
+	ioCleanupThreadPool(io_pool);
+	loaderCleanupThreadPool(pool);
+	budgetWaitFree();
 #endif /* !DIF_DISABLE_THREADING */
 
-	cleanupImageHandling();
+	difPoolFree(compare_pool);
+	readAheadFree(reader);
+	dirWatchFree(watcher);
+	queryServerFree(server);
+	dirWalkFree(walker);
+	difCleanup();
+	storeFree(&store);
+	pathArenaFree(&list_paths);
+	watchStateFree(&watch_state);
+	printSetFree(&prints);
+	printCacheClose(cache);
+
+	if ((list != NULL) && (list != stdin))
+	{
+		fclose(list);
+	}
+
+	free(order);
+	free(roots);
 
 	if (entry_arr != NULL)
 	{
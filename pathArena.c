@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h> /* memcpy */
+
+#include "pathArena.h"
+
+#define DIF_ARENA_BLOCK (64 * 1024)
+
+struct difArenaBlock
+{
+	struct difArenaBlock *next;
+	size_t used;
+	size_t cap;
+};
+
+void pathArenaInit(struct difPathArena * const arena)
+{
+	arena->head = NULL;
+}
+
+/* Returns len bytes of storage, or NULL on allocation failure */
+char* pathArenaAlloc(struct difPathArena * const arena, const size_t len)
+{
+	struct difArenaBlock *block = arena->head;
+	char *out;
+
+	if ((block == NULL) || (block->cap - block->used < len))
+	{
+		const size_t cap = (len > DIF_ARENA_BLOCK) ? len : DIF_ARENA_BLOCK;
+
+		if ((block = malloc(sizeof(struct difArenaBlock) + cap)) == NULL)
+		{
+			return NULL;
+		}
+
+		block->next = arena->head;
+		block->used = 0;
+		block->cap = cap;
+		arena->head = block;
+	}
+
+	out = (char *) (block + 1) + block->used;
+	block->used += len;
+
+	return out;
+}
+
+/* Copies len bytes of str and terminates them */
+char* pathArenaCopy(struct difPathArena * const arena, const char * const str,
+	const size_t len)
+{
+	char *out;
+
+	if ((out = pathArenaAlloc(arena, len + 1)) == NULL)
+	{
+		return NULL;
+	}
+
+	memcpy(out, str, len);
+	out[len] = '\0';
+
+	return out;
+}
+
+void pathArenaFree(struct difPathArena * const arena)
+{
+	struct difArenaBlock *block;
+
+	while ((block = arena->head) != NULL)
+	{
+		arena->head = block->next;
+		free(block);
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef DIF_PATH_ARENA_H
+#define DIF_PATH_ARENA_H
+
+#include <stddef.h> /* size_t */
+
+/* Strings are carved out of large blocks that live as long as the arena, so
+ * the pointers handed out never move and cost no malloc each. Not locked, 
+ * callers sharing an arena between threads have to serialize allocation. */
+struct difArenaBlock;
+
+struct difPathArena
+{
+	struct difArenaBlock *head;
+};
+
+void pathArenaInit(struct difPathArena * const arena);
+char* pathArenaAlloc(struct difPathArena * const arena, const size_t len);
+char* pathArenaCopy(struct difPathArena * const arena, const char * const str,
+	const size_t len);
+void pathArenaFree(struct difPathArena * const arena);
+
+#endif /* DIF_PATH_ARENA_H */
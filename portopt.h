@@ -116,7 +116,9 @@ static int portoptVerbose(const size_t argc, char **argv,
 	{
 		for (i = *ind; i < argc; i++)
 		{
-			if ((argv[i] == NULL) || (argv[i][0] != '-'))
+			/* A lone minus is an operand, conventionally stdin */
+			if ((argv[i] == NULL) || (argv[i][0] != '-')
+			|| (argv[i][1] == '\0'))
 			{
 				continue;
 			}
@@ -0,0 +1,1195 @@
+/* Persistent fingerprint cache. The file is a header, an array of fixed size
+ * records sorted by device and inode, the directories the walker read sorted
+ * the same way, a table linking each directory to its files and
+ * subdirectories, and a table of the paths they were last seen at. It is
+ * mapped read only at startup so looking a file up costs a stat and a binary
+ * search, and a directory whose times haven't changed can hand back its
+ * files without any of them being looked at. Prints made during the run are
+ * kept aside and merged with the old records into a new file that replaces
+ * the old one by rename, so a reader never sees a partial cache. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_CACHE_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* POSIX */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#endif /* !DIF_DISABLE_THREADING */
+
+#include "printCache.h"
+
+#define DIF_CACHE_MAGIC      "DIFPRINT"
+#define DIF_CACHE_VERSION    (2)
+#define DIF_CACHE_BYTE_ORDER (0x01020304UL)
+#define DIF_CACHE_NO_DIR     (UINT64_MAX)
+
+#ifndef DIF_DISABLE_THREADING
+#define DIF_CACHE_LOCK(mutex)   pthread_mutex_lock((mutex))
+#define DIF_CACHE_UNLOCK(mutex) pthread_mutex_unlock((mutex))
+#else
+#define DIF_CACHE_LOCK(mutex)   ((void) 0)
+#define DIF_CACHE_UNLOCK(mutex) ((void) 0)
+#endif /* DIF_DISABLE_THREADING */
+
+struct difCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t byte_order; /* Records are host order, foreign files rejected */
+	uint32_t dir_size;
+	uint64_t count;
+	uint64_t dir_count;
+	uint64_t link_count;
+	int64_t verified;    /* When every file was last looked at, 0 if never */
+	uint64_t strings_len;
+};
+
+struct difCacheRecord
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	uint64_t path_offset; /* Into the string table */
+	uint64_t print;
+	uint64_t dir;         /* The directory it was found in, if walked */
+	uint32_t mtime_nsec;
+	unsigned char density;
+	unsigned char type;   /* DIF_CACHE_*, 0 if never filled in */
+	unsigned char width;
+	unsigned char height;
+};
+
+/* A directory only changes its mtime and ctime when a name in it is added,
+ * removed or renamed, so while they hold so do the lists kept for it. Edits
+ * to a file in place are not seen this way, which is what the full verify
+ * runs are for. */
+struct difCacheDir
+{
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t ctime_sec;
+	uint64_t path_offset;
+	uint64_t parent;      /* DIF_CACHE_NO_DIR for a root */
+	uint64_t first_link;  /* Its record indices then its directory indices */
+	uint64_t files;
+	uint64_t subdirs;
+	uint64_t entries;     /* Names it held when it was last read */
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+};
+
+/* A record made this run along with where its path lives until written */
+struct difCachePending
+{
+	struct difCacheRecord rec;
+	struct difCacheDirKey dir;
+	const char *path;
+};
+
+struct difCachePendingDir
+{
+	struct difCacheDir dir;
+	struct difCacheDirKey parent;
+	const char *path;
+	int reread; /* Its entries were read rather than taken from the cache */
+};
+
+struct difPrintCache
+{
+	char *path;
+	void *map;
+	size_t map_len;
+	const struct difCacheRecord *records;
+	size_t count;
+	const struct difCacheDir *dirs;
+	size_t dir_count;
+	const uint64_t *links;
+	size_t link_count;
+	const char *strings;
+	size_t strings_len;
+	int64_t verified;
+	struct difCachePending *pending;
+	size_t pending_len;
+	size_t pending_cap;
+	struct difCachePendingDir *pending_dirs;
+	size_t pending_dirs_len;
+	size_t pending_dirs_cap;
+	unsigned char width;
+	unsigned char height;
+	int allow_thumbnail;
+	int trust_dirs;
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_t mutex;
+#endif /* !DIF_DISABLE_THREADING */
+};
+
+static int compareKeys(const uint64_t l_dev, const uint64_t l_ino,
+	const uint64_t r_dev, const uint64_t r_ino)
+{
+	if (l_dev != r_dev)
+	{
+		return (l_dev < r_dev) ? -1 : 1;
+	}
+
+	return (l_ino > r_ino) - (l_ino < r_ino);
+}
+
+static int compareRecords(const struct difCacheRecord * const left,
+	const struct difCacheRecord * const right)
+{
+	return compareKeys(left->dev, left->ino, right->dev, right->ino);
+}
+
+static const char* cacheString(const struct difPrintCache * const cache,
+	const uint64_t offset)
+{
+	return (offset < cache->strings_len) ? &cache->strings[offset] : "";
+}
+
+/* The key of an old directory by index, ino 0 if it doesn't name one */
+static struct difCacheDirKey oldDirKey(
+	const struct difPrintCache * const cache, const uint64_t index)
+{
+	struct difCacheDirKey key = {0, 0};
+
+	if (index < cache->dir_count)
+	{
+		key.dev = cache->dirs[index].dev;
+		key.ino = cache->dirs[index].ino;
+	}
+
+	return key;
+}
+
+/* Makes room for one more element, returning the possibly moved array or
+ * NULL if it couldn't grow, in which case arr is untouched. The caller holds
+ * the mutex. */
+static void* reserveOne(void * const arr, size_t * const cap,
+	const size_t len, const size_t size)
+{
+	size_t new_cap;
+	void *tmp;
+
+	if (len < *cap)
+	{
+		return arr;
+	}
+
+	new_cap = (*cap == 0) ? 1024 : *cap * 2;
+
+	if ((tmp = realloc(arr, new_cap * size)) != NULL)
+	{
+		*cap = new_cap;
+	}
+
+	return tmp;
+}
+
+static int recordUsable(const struct difPrintCache * const cache,
+	const struct difCacheRecord * const rec)
+{
+	return (rec->width == cache->width)
+		&& (rec->height == cache->height)
+		&& ((rec->type == DIF_CACHE_FULL)
+		|| ((rec->type == DIF_CACHE_THUMBNAIL)
+		&& (cache->allow_thumbnail)));
+}
+
+#ifdef DIF_CACHE_POSIX
+static void cacheMap(struct difPrintCache * const cache)
+{
+	const struct difCacheHeader *header;
+	struct stat info;
+	size_t records_len, dirs_len, links_len;
+	int fd;
+
+	if ((fd = open(cache->path, O_RDONLY)) < 0)
+	{
+		return;
+	}
+
+	if ((fstat(fd, &info) != 0)
+	|| ((size_t) info.st_size < sizeof(struct difCacheHeader))
+	|| ((cache->map = mmap(NULL, (size_t) info.st_size, PROT_READ,
+		MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+	{
+		fprintf(stderr, "Ignoring unusable cache file: '%s'\n",
+			cache->path);
+		cache->map = NULL;
+		close(fd);
+
+		return;
+	}
+
+	close(fd);
+	cache->map_len = (size_t) info.st_size;
+	header = (const struct difCacheHeader *) cache->map;
+	records_len = (size_t) header->count * sizeof(struct difCacheRecord);
+	dirs_len = (size_t) header->dir_count * sizeof(struct difCacheDir);
+	links_len = (size_t) header->link_count * sizeof(uint64_t);
+
+	if ((memcmp(header->magic, DIF_CACHE_MAGIC, 8) != 0)
+	|| (header->version != DIF_CACHE_VERSION)
+	|| (header->record_size != sizeof(struct difCacheRecord))
+	|| (header->dir_size != sizeof(struct difCacheDir))
+	|| (header->byte_order != DIF_CACHE_BYTE_ORDER)
+	|| (header->count > cache->map_len / sizeof(struct difCacheRecord))
+	|| (header->dir_count > cache->map_len / sizeof(struct difCacheDir))
+	|| (header->link_count > cache->map_len / sizeof(uint64_t))
+	|| (header->strings_len > cache->map_len)
+	|| (sizeof(struct difCacheHeader) + records_len + dirs_len
+		+ links_len + header->strings_len != cache->map_len))
+	{
+		fprintf(stderr, "Ignoring unusable cache file: '%s'\n",
+			cache->path);
+		munmap(cache->map, cache->map_len);
+		cache->map = NULL;
+		cache->map_len = 0;
+
+		return;
+	}
+
+	cache->records = (const struct difCacheRecord *) (header + 1);
+	cache->count = (size_t) header->count;
+	cache->dirs = (const struct difCacheDir *)
+		(cache->records + cache->count);
+	cache->dir_count = (size_t) header->dir_count;
+	cache->links = (const uint64_t *) (cache->dirs + cache->dir_count);
+	cache->link_count = (size_t) header->link_count;
+	cache->strings = (const char *) (cache->links + cache->link_count);
+	cache->strings_len = (size_t) header->strings_len;
+	cache->verified = header->verified;
+}
+
+static void recordIdentity(struct difCacheRecord * const rec,
+	const struct stat * const info)
+{
+	memset(rec, 0, sizeof(struct difCacheRecord));
+	rec->dev = (uint64_t) info->st_dev;
+	rec->ino = (uint64_t) info->st_ino;
+	rec->size = (uint64_t) info->st_size;
+	rec->mtime_sec = (int64_t) info->st_mtime;
+	rec->dir = DIF_CACHE_NO_DIR;
+#if defined(__APPLE__)
+	rec->mtime_nsec = (uint32_t) info->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	rec->mtime_nsec = (uint32_t) info->st_mtim.tv_nsec;
+#endif /* __APPLE__ / __linux__ */
+}
+
+static void dirIdentity(struct difCacheDir * const dir,
+	const struct stat * const info)
+{
+	memset(dir, 0, sizeof(struct difCacheDir));
+	dir->dev = (uint64_t) info->st_dev;
+	dir->ino = (uint64_t) info->st_ino;
+	dir->mtime_sec = (int64_t) info->st_mtime;
+	dir->ctime_sec = (int64_t) info->st_ctime;
+	dir->parent = DIF_CACHE_NO_DIR;
+#if defined(__APPLE__)
+	dir->mtime_nsec = (uint32_t) info->st_mtimespec.tv_nsec;
+	dir->ctime_nsec = (uint32_t) info->st_ctimespec.tv_nsec;
+#elif defined(__linux__)
+	dir->mtime_nsec = (uint32_t) info->st_mtim.tv_nsec;
+	dir->ctime_nsec = (uint32_t) info->st_ctim.tv_nsec;
+#endif /* __APPLE__ / __linux__ */
+}
+#endif /* DIF_CACHE_POSIX */
+
+/* Appends a record made this run, returns its slot or 0 if it couldn't be */
+static size_t pendingAdd(struct difPrintCache * const cache,
+	const struct difCacheRecord * const rec,
+	const struct difCacheDirKey * const dir, const char * const path)
+{
+	struct difCachePending *tmp;
+	size_t slot = 0;
+
+	DIF_CACHE_LOCK(&cache->mutex);
+
+	if ((tmp = reserveOne(cache->pending, &cache->pending_cap,
+		cache->pending_len, sizeof(struct difCachePending))) != NULL)
+	{
+		struct difCachePending *pend;
+
+		cache->pending = tmp;
+		pend = &cache->pending[cache->pending_len];
+
+		pend->rec = *rec;
+		pend->dir.dev = (dir != NULL) ? dir->dev : 0;
+		pend->dir.ino = (dir != NULL) ? dir->ino : 0;
+		pend->path = path;
+		slot = ++cache->pending_len;
+	}
+
+	DIF_CACHE_UNLOCK(&cache->mutex);
+
+	return slot;
+}
+
+/* An empty cache is returned if there is no usable file at path yet */
+struct difPrintCache* printCacheOpen(const char * const path,
+	const unsigned int width, const unsigned int height,
+	const int allow_thumbnail)
+{
+#ifndef DIF_CACHE_POSIX
+	(void) path;
+	(void) width;
+	(void) height;
+	(void) allow_thumbnail;
+	fputs("The fingerprint cache isn't supported on this platform\n",
+		stderr);
+
+	return NULL;
+#else
+	struct difPrintCache *cache;
+
+	if ((path == NULL) || (width > UINT8_MAX) || (height > UINT8_MAX)
+	|| ((cache = calloc(1, sizeof(struct difPrintCache))) == NULL))
+	{
+		return NULL;
+	}
+
+	if ((cache->path = malloc(strlen(path) + 1)) == NULL)
+	{
+		free(cache);
+
+		return NULL;
+	}
+
+	strcpy(cache->path, path);
+	cache->width = (unsigned char) width;
+	cache->height = (unsigned char) height;
+	cache->allow_thumbnail = allow_thumbnail;
+	cache->trust_dirs = 1;
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_init(&cache->mutex, NULL);
+#endif /* !DIF_DISABLE_THREADING */
+	cacheMap(cache);
+
+	return cache;
+#endif /* DIF_CACHE_POSIX */
+}
+
+/* Decides whether unchanged directories are taken on trust this run. A
+ * negative max_age never trusts them, 0 always does, otherwise they are
+ * trusted until max_age seconds after every file was last looked at.
+ * Returns whether they are. */
+int printCacheTrustDirs(struct difPrintCache * const cache,
+	const long max_age)
+{
+	if (cache == NULL)
+	{
+		return 0;
+	}
+
+	if (max_age < 0)
+	{
+		cache->trust_dirs = 0;
+	}
+	else if (max_age == 0)
+	{
+		cache->trust_dirs = 1;
+	}
+	else
+	{
+		cache->trust_dirs = (cache->verified != 0)
+			&& ((int64_t) time(NULL) - cache->verified
+			<= (int64_t) max_age);
+	}
+
+	return cache->trust_dirs;
+}
+
+/* Returns 1 and fills in the print on a hit. On a miss returns 0 with slot
+ * set to pass to printCacheUpdate once the file has been fingerprinted, or to
+ * 0 if the file can't be cached. dir is where the walker found the file, or
+ * NULL if it was named directly. Safe to call from several threads. */
+int printCacheLookup(struct difPrintCache * const cache,
+	const char * const path, const struct difCacheDirKey * const dir,
+	uint64_t * const print, unsigned char * const density,
+	unsigned char * const type, size_t * const slot)
+{
+#ifdef DIF_CACHE_POSIX
+	struct difCacheRecord key;
+	struct stat info;
+	size_t left = 0;
+	size_t right;
+
+	*slot = 0;
+
+	if ((cache == NULL) || (stat(path, &info) != 0))
+	{
+		return 0;
+	}
+
+	recordIdentity(&key, &info);
+	right = cache->count;
+
+	while (left < right)
+	{
+		const size_t mid = (left + right) >> 1;
+
+		if (compareRecords(&cache->records[mid], &key) < 0)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left < cache->count)
+	{
+		const struct difCacheRecord * const rec = &cache->records[left];
+
+		if ((compareRecords(rec, &key) == 0) && (rec->size == key.size)
+		&& (rec->mtime_sec == key.mtime_sec)
+		&& (rec->mtime_nsec == key.mtime_nsec)
+		&& (recordUsable(cache, rec)))
+		{
+			*print = rec->print;
+			*density = rec->density;
+			*type = rec->type;
+
+			/* A walked hit is carried over so its directory, which
+			 * is being read again, still lists it */
+			if (dir != NULL)
+			{
+				(void) pendingAdd(cache, rec, dir, path);
+			}
+
+			return 1;
+		}
+	}
+
+	*slot = pendingAdd(cache, &key, dir, path);
+#else
+	(void) cache;
+	(void) path;
+	(void) dir;
+	*slot = 0;
+#endif /* DIF_CACHE_POSIX */
+
+	(void) print;
+	(void) density;
+	(void) type;
+
+	return 0;
+}
+
+/* Hands back the print of a record listed by an unchanged directory without
+ * the file being looked at, returns 0 if it isn't of a usable kind */
+int printCacheReuse(const struct difPrintCache * const cache,
+	const size_t record, uint64_t * const print,
+	unsigned char * const density, unsigned char * const type)
+{
+	const struct difCacheRecord *rec;
+
+	if ((cache == NULL) || (record == 0) || (record > cache->count))
+	{
+		return 0;
+	}
+
+	rec = &cache->records[record - 1];
+
+	if (!recordUsable(cache, rec))
+	{
+		return 0;
+	}
+
+	*print = rec->print;
+	*density = rec->density;
+	*type = rec->type;
+
+	return 1;
+}
+
+void printCacheUpdate(struct difPrintCache * const cache, const size_t slot,
+	const uint64_t print, const unsigned char density,
+	const unsigned char type)
+{
+	struct difCacheRecord *rec;
+
+	if ((cache == NULL) || (slot == 0) || (slot > cache->pending_len))
+	{
+		return;
+	}
+
+	rec = &cache->pending[slot - 1].rec;
+	rec->print = print;
+	rec->density = density;
+	rec->type = type;
+	rec->width = cache->width;
+	rec->height = cache->height;
+}
+
+/* Returns 1 + the index of the directory if it is cached and its times are
+ * unchanged, 0 if it has to be read or directories aren't being trusted */
+size_t printCacheDirUnchanged(const struct difPrintCache * const cache,
+	const struct stat * const info)
+{
+#ifdef DIF_CACHE_POSIX
+	struct difCacheDir key;
+	size_t left = 0;
+	size_t right;
+
+	if ((cache == NULL) || (!cache->trust_dirs))
+	{
+		return 0;
+	}
+
+	dirIdentity(&key, info);
+	right = cache->dir_count;
+
+	while (left < right)
+	{
+		const size_t mid = (left + right) >> 1;
+
+		if (compareKeys(cache->dirs[mid].dev, cache->dirs[mid].ino,
+			key.dev, key.ino) < 0)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left < cache->dir_count)
+	{
+		const struct difCacheDir * const dir = &cache->dirs[left];
+
+		if ((dir->dev == key.dev) && (dir->ino == key.ino)
+		&& (dir->mtime_sec == key.mtime_sec)
+		&& (dir->mtime_nsec == key.mtime_nsec)
+		&& (dir->ctime_sec == key.ctime_sec)
+		&& (dir->ctime_nsec == key.ctime_nsec))
+		{
+			return left + 1;
+		}
+	}
+#else
+	(void) cache;
+	(void) info;
+#endif /* DIF_CACHE_POSIX */
+
+	return 0;
+}
+
+/* A directory whose links run out of the table is given as empty */
+void printCacheDirContents(const struct difPrintCache * const cache,
+	const size_t dir, size_t * const files, size_t * const subdirs)
+{
+	const struct difCacheDir *rec;
+
+	*files = 0;
+	*subdirs = 0;
+
+	if ((cache == NULL) || (dir == 0) || (dir > cache->dir_count))
+	{
+		return;
+	}
+
+	rec = &cache->dirs[dir - 1];
+
+	if ((rec->first_link > cache->link_count)
+	|| (rec->files > cache->link_count - rec->first_link)
+	|| (rec->subdirs > cache->link_count - rec->first_link - rec->files))
+	{
+		return;
+	}
+
+	*files = (size_t) rec->files;
+	*subdirs = (size_t) rec->subdirs;
+}
+
+/* Returns 1 + the index of the i'th file record of a directory, or 0 */
+size_t printCacheDirFile(const struct difPrintCache * const cache,
+	const size_t dir, const size_t i, const char ** const path,
+	uint64_t * const dev, uint64_t * const ino)
+{
+	const struct difCacheRecord *rec;
+	uint64_t index;
+
+	index = cache->links[cache->dirs[dir - 1].first_link + i];
+
+	if (index >= cache->count)
+	{
+		return 0;
+	}
+
+	rec = &cache->records[index];
+	*path = cacheString(cache, rec->path_offset);
+	*dev = rec->dev;
+	*ino = rec->ino;
+
+	return (size_t) index + 1;
+}
+
+/* Returns the path of the i'th subdirectory of a directory, or NULL */
+const char* printCacheDirSubdir(const struct difPrintCache * const cache,
+	const size_t dir, const size_t i)
+{
+	const struct difCacheDir * const rec = &cache->dirs[dir - 1];
+	const uint64_t index = cache->links[rec->first_link + rec->files + i];
+
+	if (index >= cache->dir_count)
+	{
+		return NULL;
+	}
+
+	return cacheString(cache, cache->dirs[index].path_offset);
+}
+
+/* Records a directory the walker has been through, known is as returned by
+ * printCacheDirUnchanged or 0 if its entries were read. The path must stay
+ * valid until the cache is written. Safe to call from several threads. */
+void printCacheDirVisit(struct difPrintCache * const cache,
+	const size_t known, const struct stat * const info,
+	const struct difCacheDirKey * const parent, const char * const path,
+	const size_t entries)
+{
+#ifdef DIF_CACHE_POSIX
+	struct difCachePendingDir pend;
+	struct difCachePendingDir *tmp;
+
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	dirIdentity(&pend.dir, info);
+	pend.parent.dev = (parent != NULL) ? parent->dev : 0;
+	pend.parent.ino = (parent != NULL) ? parent->ino : 0;
+	pend.path = path;
+	pend.reread = (known == 0) || (known > cache->dir_count);
+	pend.dir.entries = (pend.reread)
+		? (uint64_t) entries : cache->dirs[known - 1].entries;
+
+	DIF_CACHE_LOCK(&cache->mutex);
+
+	if ((tmp = reserveOne(cache->pending_dirs, &cache->pending_dirs_cap,
+		cache->pending_dirs_len, sizeof(struct difCachePendingDir)))
+		!= NULL)
+	{
+		cache->pending_dirs = tmp;
+		cache->pending_dirs[cache->pending_dirs_len++] = pend;
+	}
+
+	DIF_CACHE_UNLOCK(&cache->mutex);
+#else
+	(void) cache;
+	(void) known;
+	(void) info;
+	(void) parent;
+	(void) path;
+	(void) entries;
+#endif /* DIF_CACHE_POSIX */
+}
+
+/* Should only be called once the walk is over */
+void printCacheDirStats(const struct difPrintCache * const cache,
+	size_t * const unchanged, size_t * const visited)
+{
+	size_t i;
+
+	*unchanged = 0;
+	*visited = 0;
+
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < cache->pending_dirs_len; i++)
+	{
+		*unchanged += (cache->pending_dirs[i].reread == 0);
+	}
+
+	*visited = cache->pending_dirs_len;
+}
+
+/* Records from this run come first so they win over old ones for the same
+ * file, the sort is otherwise stable on order of arrival */
+struct difCacheMerge
+{
+	struct difCacheRecord rec;
+	struct difCacheDirKey dir;
+	const char *path;
+	size_t order;
+	int fresh;
+};
+
+struct difCacheDirMerge
+{
+	struct difCacheDir dir;
+	struct difCacheDirKey parent;
+	const char *path;
+	size_t order;
+	int fresh;
+	int reread;
+};
+
+static int compareMerge(const void * const l_ptr, const void * const r_ptr)
+{
+	const struct difCacheMerge * const left
+		= (const struct difCacheMerge *) l_ptr;
+	const struct difCacheMerge * const right
+		= (const struct difCacheMerge *) r_ptr;
+	const int ret = compareRecords(&left->rec, &right->rec);
+
+	if (ret != 0)
+	{
+		return ret;
+	}
+
+	return (left->order > right->order) - (left->order < right->order);
+}
+
+static int compareDirMerge(const void * const l_ptr,
+	const void * const r_ptr)
+{
+	const struct difCacheDirMerge * const left
+		= (const struct difCacheDirMerge *) l_ptr;
+	const struct difCacheDirMerge * const right
+		= (const struct difCacheDirMerge *) r_ptr;
+	const int ret = compareKeys(left->dir.dev, left->dir.ino,
+		right->dir.dev, right->dir.ino);
+
+	if (ret != 0)
+	{
+		return ret;
+	}
+
+	return (left->order > right->order) - (left->order < right->order);
+}
+
+/* Index of the directory with the given key, DIF_CACHE_NO_DIR if absent */
+static uint64_t findMergedDir(const struct difCacheDirMerge * const dirs,
+	const size_t len, const struct difCacheDirKey * const key)
+{
+	size_t left = 0;
+	size_t right = len;
+
+	if (key->ino == 0)
+	{
+		return DIF_CACHE_NO_DIR;
+	}
+
+	while (left < right)
+	{
+		const size_t mid = (left + right) >> 1;
+
+		if (compareKeys(dirs[mid].dir.dev, dirs[mid].dir.ino,
+			key->dev, key->ino) < 0)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if ((left < len) && (dirs[left].dir.dev == key->dev)
+	&& (dirs[left].dir.ino == key->ino))
+	{
+		return (uint64_t) left;
+	}
+
+	return DIF_CACHE_NO_DIR;
+}
+
+/* An old entry whose directory was read again this run without it being
+ * found there is no longer in that directory, so it is left unattached */
+static int dirWasReread(const struct difCacheDirMerge * const dirs,
+	const size_t len, const struct difCacheDirKey * const key)
+{
+	const uint64_t at = findMergedDir(dirs, len, key);
+
+	return (at != DIF_CACHE_NO_DIR) && (dirs[at].reread);
+}
+
+/* Writes to a temporary next to the cache and renames it over the old one */
+int printCacheWrite(struct difPrintCache * const cache)
+{
+#ifdef DIF_CACHE_POSIX
+	struct difCacheHeader header;
+	struct difCacheMerge *merge = NULL;
+	struct difCacheDirMerge *dirs = NULL;
+	uint64_t *links = NULL;
+	uint64_t *fill = NULL;
+	struct stat info;
+	char *tmp_path = NULL;
+	FILE *out = NULL;
+	size_t len = 0;
+	size_t kept = 0;
+	size_t dir_len = 0;
+	size_t dir_kept = 0;
+	uint64_t link_count = 0;
+	uint64_t offset = 0;
+	size_t i;
+	int ret = -1;
+	int fd = -1;
+	int created = 0;
+
+	if (cache == NULL)
+	{
+		return -1;
+	}
+
+	if (((merge = malloc(sizeof(struct difCacheMerge)
+		* (cache->pending_len + cache->count + 1))) == NULL)
+	|| ((dirs = malloc(sizeof(struct difCacheDirMerge)
+		* (cache->pending_dirs_len + cache->dir_count + 1))) == NULL))
+	{
+		goto CLEANUP;
+	}
+
+	for (i = 0; i < cache->pending_dirs_len; i++)
+	{
+		dirs[dir_len].dir = cache->pending_dirs[i].dir;
+		dirs[dir_len].parent = cache->pending_dirs[i].parent;
+		dirs[dir_len].path = cache->pending_dirs[i].path;
+		dirs[dir_len].order = dir_len;
+		dirs[dir_len].fresh = 1;
+		dirs[dir_len].reread = cache->pending_dirs[i].reread;
+		dir_len++;
+	}
+
+	for (i = 0; i < cache->dir_count; i++)
+	{
+		dirs[dir_len].dir = cache->dirs[i];
+		dirs[dir_len].parent = oldDirKey(cache, cache->dirs[i].parent);
+		dirs[dir_len].path = cacheString(cache,
+			cache->dirs[i].path_offset);
+		dirs[dir_len].order = dir_len;
+		dirs[dir_len].fresh = 0;
+		dirs[dir_len].reread = 0;
+		dir_len++;
+	}
+
+	qsort(dirs, dir_len, sizeof(struct difCacheDirMerge),
+		compareDirMerge);
+
+	for (i = 0; i < dir_len; i++)
+	{
+		if ((dir_kept == 0)
+		|| (compareKeys(dirs[dir_kept - 1].dir.dev,
+			dirs[dir_kept - 1].dir.ino, dirs[i].dir.dev,
+			dirs[i].dir.ino) != 0))
+		{
+			dirs[dir_kept++] = dirs[i];
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		if ((!dirs[i].fresh)
+		&& (dirWasReread(dirs, dir_kept, &dirs[i].parent)))
+		{
+			dirs[i].parent.ino = 0;
+		}
+	}
+
+	for (i = 0; i < cache->pending_len; i++)
+	{
+		if (cache->pending[i].rec.type != 0)
+		{
+			merge[len].rec = cache->pending[i].rec;
+			merge[len].dir = cache->pending[i].dir;
+			merge[len].path = cache->pending[i].path;
+			merge[len].order = len;
+			merge[len].fresh = 1;
+			len++;
+		}
+	}
+
+	for (i = 0; i < cache->count; i++)
+	{
+		merge[len].rec = cache->records[i];
+		merge[len].dir = oldDirKey(cache, cache->records[i].dir);
+		merge[len].path = cacheString(cache,
+			cache->records[i].path_offset);
+		merge[len].order = len;
+		merge[len].fresh = 0;
+		len++;
+	}
+
+	qsort(merge, len, sizeof(struct difCacheMerge), compareMerge);
+
+	/* Only the first, newest, record for each file is kept */
+	for (i = 0; i < len; i++)
+	{
+		if ((kept == 0)
+		|| (compareRecords(&merge[kept - 1].rec, &merge[i].rec) != 0))
+		{
+			merge[kept++] = merge[i];
+		}
+	}
+
+	/* Each directory's files then its subdirectories are laid out
+	 * together in the link table, fill counts them up then places them */
+	if ((fill = calloc(dir_kept + 1, sizeof(uint64_t))) == NULL)
+	{
+		goto CLEANUP;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if ((!merge[i].fresh)
+		&& (dirWasReread(dirs, dir_kept, &merge[i].dir)))
+		{
+			merge[i].dir.ino = 0;
+		}
+
+		merge[i].rec.dir = findMergedDir(dirs, dir_kept, &merge[i].dir);
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		dirs[i].dir.files = 0;
+		dirs[i].dir.subdirs = 0;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if (merge[i].rec.dir != DIF_CACHE_NO_DIR)
+		{
+			dirs[merge[i].rec.dir].dir.files++;
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		dirs[i].dir.parent = findMergedDir(dirs, dir_kept,
+			&dirs[i].parent);
+
+		if (dirs[i].dir.parent != DIF_CACHE_NO_DIR)
+		{
+			dirs[dirs[i].dir.parent].dir.subdirs++;
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		dirs[i].dir.first_link = link_count;
+		link_count += dirs[i].dir.files + dirs[i].dir.subdirs;
+	}
+
+	if ((links = malloc(sizeof(uint64_t) * (size_t) (link_count + 1)))
+		== NULL)
+	{
+		goto CLEANUP;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		const uint64_t at = merge[i].rec.dir;
+
+		if (at != DIF_CACHE_NO_DIR)
+		{
+			links[dirs[at].dir.first_link + fill[at]++] = i;
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		const uint64_t at = dirs[i].dir.parent;
+
+		if (at != DIF_CACHE_NO_DIR)
+		{
+			links[dirs[at].dir.first_link + fill[at]++] = i;
+		}
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		merge[i].rec.path_offset = offset;
+		offset += strlen(merge[i].path) + 1;
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		dirs[i].dir.path_offset = offset;
+		offset += strlen(dirs[i].path) + 1;
+	}
+
+	if ((tmp_path = malloc(strlen(cache->path) + sizeof(".XXXXXX")))
+		== NULL)
+	{
+		goto CLEANUP;
+	}
+
+	strcpy(tmp_path, cache->path);
+	strcat(tmp_path, ".XXXXXX");
+
+	if ((fd = mkstemp(tmp_path)) < 0)
+	{
+		goto CLEANUP;
+	}
+
+	created = 1;
+
+	/* mkstemp is owner only, a replaced cache keeps its own mode */
+	if (stat(cache->path, &info) == 0)
+	{
+		(void) fchmod(fd, info.st_mode & 07777);
+	}
+
+	if ((out = fdopen(fd, "wb")) == NULL)
+	{
+		goto CLEANUP;
+	}
+
+	fd = -1;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DIF_CACHE_MAGIC, 8);
+	header.version = DIF_CACHE_VERSION;
+	header.record_size = sizeof(struct difCacheRecord);
+	header.dir_size = sizeof(struct difCacheDir);
+	header.byte_order = DIF_CACHE_BYTE_ORDER;
+	header.count = (uint64_t) kept;
+	header.dir_count = (uint64_t) dir_kept;
+	header.link_count = link_count;
+	header.verified = (cache->trust_dirs)
+		? cache->verified : (int64_t) time(NULL);
+	header.strings_len = offset;
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+	{
+		goto CLEANUP;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if (fwrite(&merge[i].rec, sizeof(struct difCacheRecord), 1, out)
+			!= 1)
+		{
+			goto CLEANUP;
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		if (fwrite(&dirs[i].dir, sizeof(struct difCacheDir), 1, out)
+			!= 1)
+		{
+			goto CLEANUP;
+		}
+	}
+
+	if ((link_count != 0) && (fwrite(links, sizeof(uint64_t),
+		(size_t) link_count, out) != (size_t) link_count))
+	{
+		goto CLEANUP;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if (fwrite(merge[i].path, strlen(merge[i].path) + 1, 1, out)
+			!= 1)
+		{
+			goto CLEANUP;
+		}
+	}
+
+	for (i = 0; i < dir_kept; i++)
+	{
+		if (fwrite(dirs[i].path, strlen(dirs[i].path) + 1, 1, out)
+			!= 1)
+		{
+			goto CLEANUP;
+		}
+	}
+
+	if ((fflush(out) != 0) || (fsync(fileno(out)) != 0))
+	{
+		goto CLEANUP;
+	}
+
+	fclose(out);
+	out = NULL;
+
+	if (rename(tmp_path, cache->path) != 0)
+	{
+		goto CLEANUP;
+	}
+
+	ret = 0;
+
+CLEANUP:
+
+	if (out != NULL)
+	{
+		fclose(out);
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to write cache file: '%s'\n",
+			cache->path);
+
+		if (created)
+		{
+			(void) unlink(tmp_path);
+		}
+	}
+
+	free(tmp_path);
+	free(links);
+	free(fill);
+	free(dirs);
+	free(merge);
+
+	return ret;
+#else
+	(void) cache;
+
+	return -1;
+#endif /* DIF_CACHE_POSIX */
+}
+
+void printCacheClose(struct difPrintCache * const cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+
+#ifdef DIF_CACHE_POSIX
+	if (cache->map != NULL)
+	{
+		munmap(cache->map, cache->map_len);
+	}
+#endif /* DIF_CACHE_POSIX */
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_destroy(&cache->mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	free(cache->pending);
+	free(cache->pending_dirs);
+	free(cache->path);
+	free(cache);
+}
@@ -0,0 +1,55 @@
+#ifndef DIF_PRINT_CACHE_H
+#define DIF_PRINT_CACHE_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+
+/* How a cached print was made, only prints of the kind a run would make
+ * itself are handed back to it */
+#define DIF_CACHE_FULL      (1)
+#define DIF_CACHE_THUMBNAIL (2)
+
+/* Identifies a directory by device and inode, an ino of 0 for none */
+struct difCacheDirKey
+{
+	uint64_t dev;
+	uint64_t ino;
+};
+
+struct difPrintCache;
+struct stat;
+
+struct difPrintCache* printCacheOpen(const char * const path,
+	const unsigned int width, const unsigned int height,
+	const int allow_thumbnail);
+int printCacheTrustDirs(struct difPrintCache * const cache,
+	const long max_age);
+int printCacheLookup(struct difPrintCache * const cache,
+	const char * const path, const struct difCacheDirKey * const dir,
+	uint64_t * const print, unsigned char * const density,
+	unsigned char * const type, size_t * const slot);
+int printCacheReuse(const struct difPrintCache * const cache,
+	const size_t record, uint64_t * const print,
+	unsigned char * const density, unsigned char * const type);
+void printCacheUpdate(struct difPrintCache * const cache, const size_t slot,
+	const uint64_t print, const unsigned char density,
+	const unsigned char type);
+size_t printCacheDirUnchanged(const struct difPrintCache * const cache,
+	const struct stat * const info);
+void printCacheDirContents(const struct difPrintCache * const cache,
+	const size_t dir, size_t * const files, size_t * const subdirs);
+size_t printCacheDirFile(const struct difPrintCache * const cache,
+	const size_t dir, const size_t i, const char ** const path,
+	uint64_t * const dev, uint64_t * const ino);
+const char* printCacheDirSubdir(const struct difPrintCache * const cache,
+	const size_t dir, const size_t i);
+void printCacheDirVisit(struct difPrintCache * const cache,
+	const size_t known, const struct stat * const info,
+	const struct difCacheDirKey * const parent, const char * const path,
+	const size_t entries);
+void printCacheDirStats(const struct difPrintCache * const cache,
+	size_t * const unchanged, size_t * const visited);
+int printCacheWrite(struct difPrintCache * const cache);
+void printCacheClose(struct difPrintCache * const cache);
+
+#endif /* DIF_PRINT_CACHE_H */
@@ -0,0 +1,798 @@
+/* Query server answering fingerprint, query and insert requests over a Unix
+ * domain socket, so callers pay for loading the prints once rather than once
+ * per question. The main thread polls the listening socket and every idle
+ * client. A client with a request waiting is taken out of the poll set and
+ * served on one of the server's threads, which hands it back once the reply
+ * has been sent, so one slow client never holds up the others. A client may
+ * send any number of requests one after another on the same connection. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* strlen, memcpy, memchr */
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_SERVE_POSIX
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif /* POSIX */
+
+#ifndef DIF_DISABLE_THREADING
+#include <pthread.h>
+#include "thirdparty/macroThreadPool.h"
+#endif /* !DIF_DISABLE_THREADING */
+
+#include "queryServer.h"
+
+#ifndef DIF_DISABLE_THREADING
+#define DIF_SERVE_LOCK(mutex)   pthread_mutex_lock((mutex))
+#define DIF_SERVE_UNLOCK(mutex) pthread_mutex_unlock((mutex))
+#else
+#define DIF_SERVE_LOCK(mutex)   ((void) 0)
+#define DIF_SERVE_UNLOCK(mutex) ((void) 0)
+#endif /* DIF_DISABLE_THREADING */
+
+/* Larger requests are refused and their client dropped */
+#define DIF_SERVE_MAX_PAYLOAD ((size_t) 64 << 20)
+
+/* A client stalling mid request or not reading its reply is dropped after */
+#define DIF_SERVE_TIMEOUT_SEC (5)
+
+#define DIF_SERVE_BACKLOG (128)
+
+/* Clients queued per server thread before the poll loop waits for room */
+#define DIF_SERVE_RING_PER_THREAD (4)
+
+#ifdef MSG_NOSIGNAL
+#define DIF_SERVE_SEND_FLAGS (MSG_NOSIGNAL)
+#else
+#define DIF_SERVE_SEND_FLAGS (0)
+#endif /* MSG_NOSIGNAL */
+
+#ifdef DIF_SERVE_POSIX
+struct difFdList
+{
+	int *fds;
+	size_t len;
+	size_t cap;
+};
+
+struct difQueryServer
+{
+	char *path; /* Set once bound, the socket is removed on free */
+	int listen_fd;
+	int wake[2]; /* Written to once a served client is handed back */
+	struct difFdList idle;  /* Polled, only touched by the main thread */
+	struct difFdList ready; /* Handed back, to rejoin the idle clients */
+	struct pollfd *polled;
+	size_t polled_cap;
+	const struct difServeOps *ops;
+	void *ctx;
+#ifndef DIF_DISABLE_THREADING
+	struct serveThreadPool *pool;
+	pthread_mutex_t ready_mutex;
+#endif /* !DIF_DISABLE_THREADING */
+};
+
+/* A reply is built whole, header first, and sent with one write */
+struct difServeReply
+{
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	size_t matches; /* Added to the query being answered */
+};
+
+static uint32_t getLe32(const unsigned char * const at)
+{
+	return (uint32_t) at[0] | ((uint32_t) at[1] << 8)
+		| ((uint32_t) at[2] << 16) | ((uint32_t) at[3] << 24);
+}
+
+static uint64_t getLe64(const unsigned char * const at)
+{
+	return (uint64_t) getLe32(at) | ((uint64_t) getLe32(at + 4) << 32);
+}
+
+static void putLe32(unsigned char * const at, const uint32_t val)
+{
+	at[0] = (unsigned char) (val & 0xFF);
+	at[1] = (unsigned char) ((val >> 8) & 0xFF);
+	at[2] = (unsigned char) ((val >> 16) & 0xFF);
+	at[3] = (unsigned char) ((val >> 24) & 0xFF);
+}
+
+static void putLe64(unsigned char * const at, const uint64_t val)
+{
+	putLe32(at, (uint32_t) (val & 0xFFFFFFFFUL));
+	putLe32(at + 4, (uint32_t) (val >> 32));
+}
+
+static int fdListPush(struct difFdList * const list, const int fd)
+{
+	if (list->len == list->cap)
+	{
+		const size_t cap = (list->cap == 0) ? 64 : list->cap * 2;
+		int * const fds = realloc(list->fds, sizeof(int) * cap);
+
+		if (fds == NULL)
+		{
+			return -1;
+		}
+
+		list->fds = fds;
+		list->cap = cap;
+	}
+
+	list->fds[list->len++] = fd;
+
+	return 0;
+}
+
+/* Returns where the next len bytes of the reply go, or NULL once it would
+ * be too large to describe */
+static unsigned char* replyGrow(struct difServeReply * const reply,
+	const size_t len)
+{
+	unsigned char *at;
+
+	if (reply->len + len - DIF_SERVE_HEADER_LEN > UINT32_MAX)
+	{
+		return NULL;
+	}
+
+	if (reply->len + len > reply->cap)
+	{
+		size_t cap = (reply->cap == 0) ? 256 : reply->cap;
+
+		while (cap < reply->len + len)
+		{
+			cap *= 2;
+		}
+
+		if ((at = realloc(reply->data, cap)) == NULL)
+		{
+			return NULL;
+		}
+
+		reply->data = at;
+		reply->cap = cap;
+	}
+
+	at = reply->data + reply->len;
+	reply->len += len;
+
+	return at;
+}
+
+static int replyPrint(struct difServeReply * const reply, const uint64_t val)
+{
+	unsigned char * const at = replyGrow(reply, 8);
+
+	if (at == NULL)
+	{
+		return -1;
+	}
+
+	putLe64(at, val);
+
+	return 0;
+}
+
+/* Each match is its distance, the length of its name and then the name */
+static int replyMatch(void *ctx, const char *name, unsigned int distance)
+{
+	struct difServeReply * const reply = (struct difServeReply *) ctx;
+	const size_t len = strlen(name);
+	unsigned char *at;
+
+	if ((len > UINT32_MAX) || ((at = replyGrow(reply, 5 + len)) == NULL))
+	{
+		return -1;
+	}
+
+	at[0] = (unsigned char) distance;
+	putLe32(at + 1, (uint32_t) len);
+	memcpy(at + 5, name, len);
+	reply->matches++;
+
+	return 0;
+}
+
+/* Returns -1 if the client hung up, errored or timed out first */
+static int recvFull(const int fd, unsigned char *buf, size_t len)
+{
+	while (len != 0)
+	{
+		const ssize_t got = recv(fd, buf, len, 0);
+
+		if (got > 0)
+		{
+			buf += got;
+			len -= (size_t) got;
+		}
+		else if ((got == 0) || (errno != EINTR))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int sendFull(const int fd, const unsigned char *buf, size_t len)
+{
+	while (len != 0)
+	{
+		const ssize_t sent = send(fd, buf, len, DIF_SERVE_SEND_FLAGS);
+
+		if (sent > 0)
+		{
+			buf += sent;
+			len -= (size_t) sent;
+		}
+		else if ((sent == 0) || (errno != EINTR))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Answers the request into reply and returns its status. The payload has a
+ * spare byte past its end, so paths and names are terminated in place. */
+static unsigned char serveOp(const struct difQueryServer * const server,
+	const unsigned char op, const unsigned char threshold,
+	unsigned char * const payload, const size_t len,
+	struct difServeReply * const reply)
+{
+	const struct difServeOps * const ops = server->ops;
+	uint64_t print;
+	size_t i;
+
+	payload[len] = '\0';
+
+	switch (op)
+	{
+		case DIF_SERVE_FINGERPRINT_PATH:
+			/* A path holding a NUL would be cut short */
+			if ((len == 0) || (memchr(payload, '\0', len) != NULL))
+			{
+				return DIF_SERVE_BAD_REQUEST;
+			}
+
+			if ((ops->fingerprint(server->ctx, (const char *) payload,
+				NULL, 0, &print) != 0)
+			|| (replyPrint(reply, print) != 0))
+			{
+				return DIF_SERVE_FAILED;
+			}
+
+			return DIF_SERVE_OK;
+		case DIF_SERVE_FINGERPRINT_DATA:
+			if (len == 0)
+			{
+				return DIF_SERVE_BAD_REQUEST;
+			}
+
+			if ((ops->fingerprint(server->ctx, NULL, payload, len,
+				&print) != 0)
+			|| (replyPrint(reply, print) != 0))
+			{
+				return DIF_SERVE_FAILED;
+			}
+
+			return DIF_SERVE_OK;
+		case DIF_SERVE_QUERY:
+			/* Any number of prints, each answered with a count and
+			 * then that many matches */
+			if ((len == 0) || (len % 8 != 0))
+			{
+				return DIF_SERVE_BAD_REQUEST;
+			}
+
+			for (i = 0; i < len; i += 8)
+			{
+				const size_t count_at = reply->len;
+
+				reply->matches = 0;
+
+				if ((replyGrow(reply, 4) == NULL)
+				|| (ops->query(server->ctx, getLe64(payload + i),
+					threshold, replyMatch, reply) != 0))
+				{
+					return DIF_SERVE_FAILED;
+				}
+
+				putLe32(reply->data + count_at,
+					(uint32_t) reply->matches);
+			}
+
+			return DIF_SERVE_OK;
+		case DIF_SERVE_INSERT:
+			if ((len <= 8) || (memchr(payload + 8, '\0', len - 8)
+				!= NULL))
+			{
+				return DIF_SERVE_BAD_REQUEST;
+			}
+
+			if ((ops->insert(server->ctx, getLe64(payload),
+				(const char *) payload + 8, &print) != 0)
+			|| (replyPrint(reply, print) != 0))
+			{
+				return DIF_SERVE_FAILED;
+			}
+
+			return DIF_SERVE_OK;
+		default:
+			return DIF_SERVE_BAD_REQUEST;
+	}
+}
+
+/* Reads and answers one request. Returns -1 once the client should be
+ * dropped, having hung up, stalled or sent more than can be taken. */
+static int serveClient(const struct difQueryServer * const server,
+	const int fd)
+{
+	unsigned char head[DIF_SERVE_HEADER_LEN];
+	struct difServeReply reply = {NULL, 0, 0, 0};
+	unsigned char *payload = NULL;
+	unsigned char status = DIF_SERVE_BAD_REQUEST;
+	size_t len;
+	int ret = -1;
+
+	if ((recvFull(fd, head, sizeof(head)) != 0)
+	|| (replyGrow(&reply, DIF_SERVE_HEADER_LEN) == NULL))
+	{
+		goto CLEANUP;
+	}
+
+	/* Too large to skip without reading it all, so the client goes */
+	if ((len = getLe32(head + 4)) <= DIF_SERVE_MAX_PAYLOAD)
+	{
+		if (((payload = malloc(len + 1)) == NULL)
+		|| (recvFull(fd, payload, len) != 0))
+		{
+			goto CLEANUP;
+		}
+
+		status = serveOp(server, head[0], head[1], payload, len,
+			&reply);
+		ret = 0;
+	}
+
+	/* Whatever was added before a failure isn't sent */
+	if (status != DIF_SERVE_OK)
+	{
+		reply.len = DIF_SERVE_HEADER_LEN;
+	}
+
+	reply.data[0] = status;
+	reply.data[1] = head[0];
+	reply.data[2] = 0;
+	reply.data[3] = 0;
+	putLe32(reply.data + 4, (uint32_t) (reply.len - DIF_SERVE_HEADER_LEN));
+
+	if (sendFull(fd, reply.data, reply.len) != 0)
+	{
+		ret = -1;
+	}
+
+CLEANUP:
+
+	free(payload);
+	free(reply.data);
+
+	return ret;
+}
+
+/* Returns a served client to the poll loop or closes it for good */
+static void serveHandBack(struct difQueryServer * const server,
+	const int fd, const int keep)
+{
+	int pushed = 0;
+
+	if (keep == 0)
+	{
+		DIF_SERVE_LOCK(&server->ready_mutex);
+		pushed = (fdListPush(&server->ready, fd) == 0);
+		DIF_SERVE_UNLOCK(&server->ready_mutex);
+	}
+
+	if (!pushed)
+	{
+		close(fd);
+
+		return;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	/* Failing with the pipe full is fine, the loop will wake regardless */
+	while ((write(server->wake[1], "", 1) < 0) && (errno == EINTR))
+	{
+		continue;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+}
+
+#ifndef DIF_DISABLE_THREADING
+struct serveJob
+{
+	struct difQueryServer *server;
+	int fd;
+};
+
+static void serveFunction(struct serveJob job);
+
+MACRO_THREAD_POOL_COMPLETE(serve, struct serveJob, serveFunction);
+
+static void serveFunction(struct serveJob job)
+{
+	serveHandBack(job.server, job.fd, serveClient(job.server, job.fd));
+}
+#endif /* !DIF_DISABLE_THREADING */
+
+static void serveDispatch(struct difQueryServer * const server, const int fd)
+{
+#ifndef DIF_DISABLE_THREADING
+	if (server->pool != NULL)
+	{
+		struct serveJob job;
+
+		job.server = server;
+		job.fd = fd;
+		serveEnqueueJob(server->pool, job);
+
+		return;
+	}
+#endif /* !DIF_DISABLE_THREADING */
+
+	serveHandBack(server, fd, serveClient(server, fd));
+}
+
+static int serveFdFlags(const int fd, const int nonblock)
+{
+	const int flags = fcntl(fd, F_GETFL);
+
+	if ((flags < 0)
+	|| (fcntl(fd, F_SETFL, (nonblock)
+		? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) != 0)
+	|| (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Clients block on their own reads and writes, bounded by the timeout, as
+ * only the thread serving them touches them then */
+static void serveAccept(struct difQueryServer * const server)
+{
+	struct timeval timeout;
+	int fd;
+
+	if ((fd = accept(server->listen_fd, NULL, NULL)) < 0)
+	{
+		return;
+	}
+
+	timeout.tv_sec = DIF_SERVE_TIMEOUT_SEC;
+	timeout.tv_usec = 0;
+
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+	{
+		const int one = 1;
+
+		(void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one,
+			sizeof(one));
+	}
+#endif /* !MSG_NOSIGNAL && SO_NOSIGPIPE */
+
+	if ((serveFdFlags(fd, 0) != 0)
+	|| (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		sizeof(timeout)) != 0)
+	|| (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		sizeof(timeout)) != 0)
+	|| (fdListPush(&server->idle, fd) != 0))
+	{
+		close(fd);
+	}
+}
+
+/* Moves the handed back clients into the poll set and makes room to poll
+ * them all along with the listening socket and the wake pipe */
+static int servePrepare(struct difQueryServer * const server)
+{
+	size_t i;
+	int ret = 0;
+
+	DIF_SERVE_LOCK(&server->ready_mutex);
+
+	for (i = 0; i < server->ready.len; i++)
+	{
+		if (fdListPush(&server->idle, server->ready.fds[i]) != 0)
+		{
+			close(server->ready.fds[i]);
+		}
+	}
+
+	server->ready.len = 0;
+	DIF_SERVE_UNLOCK(&server->ready_mutex);
+
+	if (server->idle.len + 2 > server->polled_cap)
+	{
+		const size_t cap = (server->idle.len + 2) * 2;
+		struct pollfd * const polled = realloc(server->polled,
+			sizeof(struct pollfd) * cap);
+
+		if (polled == NULL)
+		{
+			ret = -1;
+		}
+		else
+		{
+			server->polled = polled;
+			server->polled_cap = cap;
+		}
+	}
+
+	return ret;
+}
+#endif /* DIF_SERVE_POSIX */
+
+/* A stale socket left at path is replaced, anything else there is an error.
+ * With threads as 0 requests are answered on the thread running the server.
+ */
+struct difQueryServer* queryServerNew(const char * const path,
+	const size_t threads, const struct difServeOps * const ops, void *ctx)
+{
+#ifdef DIF_SERVE_POSIX
+	struct difQueryServer *server;
+	struct sockaddr_un addr;
+	struct stat info;
+	size_t path_len;
+
+	if ((path == NULL) || (ops == NULL) || (ops->fingerprint == NULL)
+	|| (ops->query == NULL) || (ops->insert == NULL))
+	{
+		return NULL;
+	}
+
+	if ((path_len = strlen(path)) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: '%s'\n", path);
+
+		return NULL;
+	}
+
+	if ((server = calloc(1, sizeof(struct difQueryServer))) == NULL)
+	{
+		return NULL;
+	}
+
+	server->listen_fd = -1;
+	server->wake[0] = -1;
+	server->wake[1] = -1;
+	server->ops = ops;
+	server->ctx = ctx;
+
+#ifndef DIF_DISABLE_THREADING
+	pthread_mutex_init(&server->ready_mutex, NULL);
+#endif /* !DIF_DISABLE_THREADING */
+
+	if ((lstat(path, &info) == 0) && (S_ISSOCK(info.st_mode)))
+	{
+		(void) unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, path_len + 1);
+
+	if (((server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	|| (serveFdFlags(server->listen_fd, 1) != 0)
+	|| (bind(server->listen_fd, (const struct sockaddr *) &addr,
+		sizeof(addr)) != 0))
+	{
+		fprintf(stderr, "Failed to bind socket: '%s'\n", path);
+		queryServerFree(server);
+
+		return NULL;
+	}
+
+	if ((server->path = malloc(path_len + 1)) != NULL)
+	{
+		memcpy(server->path, path, path_len + 1);
+	}
+
+	if ((server->path == NULL)
+	|| (listen(server->listen_fd, DIF_SERVE_BACKLOG) != 0)
+	|| (pipe(server->wake) != 0)
+	|| (serveFdFlags(server->wake[0], 1) != 0)
+	|| (serveFdFlags(server->wake[1], 1) != 0))
+	{
+		fprintf(stderr, "Failed to listen on socket: '%s'\n", path);
+
+		if (server->path == NULL)
+		{
+			(void) unlink(path);
+		}
+
+		queryServerFree(server);
+
+		return NULL;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	if ((threads != 0) && ((server->pool = serveNewThreadPool(threads,
+		DIF_SERVE_RING_PER_THREAD * threads)) == NULL))
+	{
+		queryServerFree(server);
+
+		return NULL;
+	}
+#else
+	(void) threads;
+#endif /* DIF_DISABLE_THREADING */
+
+	return server;
+#else
+	(void) path;
+	(void) threads;
+	(void) ops;
+	(void) ctx;
+	fputs("Serving queries isn't supported on this platform\n", stderr);
+
+	return NULL;
+#endif /* DIF_SERVE_POSIX */
+}
+
+/* Serves until stop is set, which a signal handler should follow up on by
+ * interrupting the poll. Returns -1 if the clients couldn't be polled. */
+int queryServerRun(struct difQueryServer *server,
+	volatile sig_atomic_t *stop)
+{
+#ifdef DIF_SERVE_POSIX
+	if ((server == NULL) || (stop == NULL))
+	{
+		return -1;
+	}
+
+	while (!*stop)
+	{
+		size_t i, kept = 0;
+
+		if (servePrepare(server) != 0)
+		{
+			fputs("Allocation failure, can't poll clients\n", stderr);
+
+			return -1;
+		}
+
+		server->polled[0].fd = server->listen_fd;
+		server->polled[1].fd = server->wake[0];
+
+		for (i = 0; i < server->idle.len; i++)
+		{
+			server->polled[i + 2].fd = server->idle.fds[i];
+		}
+
+		for (i = 0; i < server->idle.len + 2; i++)
+		{
+			server->polled[i].events = POLLIN;
+			server->polled[i].revents = 0;
+		}
+
+		if (poll(server->polled, (nfds_t) (server->idle.len + 2), -1)
+			< 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			fputs("Failed to poll clients\n", stderr);
+
+			return -1;
+		}
+
+		if (server->polled[1].revents != 0)
+		{
+			unsigned char drain[64];
+
+			while (read(server->wake[0], drain, sizeof(drain)) > 0)
+			{
+				continue;
+			}
+		}
+
+		/* A hang up is found out by reading, the same as a request */
+		for (i = 0; i < server->idle.len; i++)
+		{
+			if (server->polled[i + 2].revents != 0)
+			{
+				serveDispatch(server, server->idle.fds[i]);
+			}
+			else
+			{
+				server->idle.fds[kept++] = server->idle.fds[i];
+			}
+		}
+
+		server->idle.len = kept;
+
+		if (server->polled[0].revents != 0)
+		{
+			serveAccept(server);
+		}
+	}
+
+	return 0;
+#else
+	(void) server;
+	(void) stop;
+
+	return -1;
+#endif /* DIF_SERVE_POSIX */
+}
+
+/* Waits for the requests being served, then drops every client */
+void queryServerFree(struct difQueryServer *server)
+{
+#ifdef DIF_SERVE_POSIX
+	size_t i;
+
+	if (server == NULL)
+	{
+		return;
+	}
+
+#ifndef DIF_DISABLE_THREADING
+	serveCleanupThreadPool(server->pool);
+	pthread_mutex_destroy(&server->ready_mutex);
+#endif /* !DIF_DISABLE_THREADING */
+
+	for (i = 0; i < server->idle.len; i++)
+	{
+		close(server->idle.fds[i]);
+	}
+
+	for (i = 0; i < server->ready.len; i++)
+	{
+		close(server->ready.fds[i]);
+	}
+
+	if (server->listen_fd >= 0)
+	{
+		close(server->listen_fd);
+	}
+
+	if (server->wake[0] >= 0)
+	{
+		close(server->wake[0]);
+		close(server->wake[1]);
+	}
+
+	if (server->path != NULL)
+	{
+		(void) unlink(server->path);
+		free(server->path);
+	}
+
+	free(server->idle.fds);
+	free(server->ready.fds);
+	free(server->polled);
+	free(server);
+#else
+	(void) server;
+#endif /* DIF_SERVE_POSIX */
+}
@@ -0,0 +1,51 @@
+#ifndef DIF_QUERY_SERVER_H
+#define DIF_QUERY_SERVER_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+#include <signal.h> /* sig_atomic_t */
+
+/* Every request and reply starts with an 8 byte header, integers are little
+ * endian. A request is op, threshold, two reserved bytes and the payload
+ * length, a reply is status, the op answered, two reserved bytes and the
+ * payload length. See the README for the payload of each op. */
+#define DIF_SERVE_HEADER_LEN (8)
+
+#define DIF_SERVE_FINGERPRINT_PATH (1) /* Path in, print out */
+#define DIF_SERVE_FINGERPRINT_DATA (2) /* Encoded image in, print out */
+#define DIF_SERVE_QUERY            (3) /* Prints in, matches of each out */
+#define DIF_SERVE_INSERT           (4) /* Print and name in, id out */
+
+#define DIF_SERVE_OK          (0)
+#define DIF_SERVE_BAD_REQUEST (1)
+#define DIF_SERVE_FAILED      (2)
+
+/* Threshold byte asking for the server's own */
+#define DIF_SERVE_DEFAULT_THRESHOLD (0xFF)
+
+/* Adds a match to the reply being built, returns -1 on allocation failure */
+typedef int (*difServeMatch)(void *reply, const char *name,
+	unsigned int distance);
+
+/* What the server does with each request, called from the server's threads
+ * and possibly several at once. Each returns 0 on success. path is NULL when
+ * fingerprinting data. */
+struct difServeOps
+{
+	int (*fingerprint)(void *ctx, const char *path,
+		const unsigned char *data, size_t len, uint64_t *print);
+	int (*query)(void *ctx, uint64_t print, unsigned int threshold,
+		difServeMatch match, void *reply);
+	int (*insert)(void *ctx, uint64_t print, const char *name,
+		uint64_t *id);
+};
+
+struct difQueryServer;
+
+struct difQueryServer* queryServerNew(const char * const path,
+	const size_t threads, const struct difServeOps * const ops, void *ctx);
+int queryServerRun(struct difQueryServer *server,
+	volatile sig_atomic_t *stop);
+void queryServerFree(struct difQueryServer *server);
+
+#endif /* DIF_QUERY_SERVER_H */
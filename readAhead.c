@@ -0,0 +1,657 @@
+/* Read ahead stage, keeps up to depth whole file reads outstanding so that the
+ * latency of slow or networked storage overlaps with decoding instead of each
+ * decode thread blocking on its own read. io_uring is used where the kernel
+ * allows it, otherwise the window is primed with posix_fadvise and the oldest
+ * file is read synchronously once it is due. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* memset */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIF_READ_AHEAD_POSIX
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* POSIX */
+
+#if defined(__linux__) && !defined(DIF_DISABLE_IO_URING) \
+	&& defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DIF_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* __has_include(<linux/io_uring.h>) */
+#endif /* __linux__ && !DIF_DISABLE_IO_URING */
+
+#include "readAhead.h"
+
+/* A single read is capped below what a 32-bit sqe length can express, larger
+ * files simply take several reads */
+#define DIF_READ_CHUNK_MAX ((size_t) 1 << 30)
+
+struct difReadSlot
+{
+	void *tag;
+	unsigned char *data;
+	size_t len;
+	size_t done;
+	int fd;
+	int busy;
+};
+
+struct difReadAhead
+{
+	struct difReadSlot *slots;
+	size_t depth;
+	size_t head;    /* Oldest slot, the fadvise window is a FIFO */
+	size_t pending;
+	difReadDone done;
+	void *ctx;
+#ifdef DIF_USE_IO_URING
+	int ring_fd;    /* -1 when io_uring isn't available */
+	int sq_failed;  /* Set once a submission couldn't be made */
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_len;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	struct io_uring_cqe *cqes;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+#endif /* DIF_USE_IO_URING */
+};
+
+#ifdef DIF_READ_AHEAD_POSIX
+/* Reads whatever the asynchronous side didn't get to and hands the slot's
+ * buffer off, a file that shrank underneath us is delivered as it stands */
+static void readSlotFinish(struct difReadAhead * const ra,
+	struct difReadSlot * const slot)
+{
+	while (slot->done < slot->len)
+	{
+		const ssize_t got = pread(slot->fd, slot->data + slot->done,
+			slot->len - slot->done, (off_t) slot->done);
+
+		if (got < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			slot->done = 0;
+
+			break;
+		}
+
+		if (got == 0)
+		{
+			break;
+		}
+
+		slot->done += (size_t) got;
+	}
+
+	close(slot->fd);
+
+	if (slot->done == 0)
+	{
+		free(slot->data);
+		ra->done(ra->ctx, slot->tag, NULL, 0);
+	}
+	else
+	{
+		ra->done(ra->ctx, slot->tag, slot->data, slot->done);
+	}
+
+	memset(slot, 0, sizeof(struct difReadSlot));
+	slot->fd = -1;
+	ra->pending--;
+}
+#endif /* DIF_READ_AHEAD_POSIX */
+
+#ifdef DIF_USE_IO_URING
+static void uringTeardown(struct difReadAhead * const ra)
+{
+	if ((ra->cq_ring != NULL) && (ra->cq_ring != ra->sq_ring))
+	{
+		munmap(ra->cq_ring, ra->cq_ring_len);
+	}
+
+	if (ra->sq_ring != NULL)
+	{
+		munmap(ra->sq_ring, ra->sq_ring_len);
+	}
+
+	if (ra->sqes != NULL)
+	{
+		munmap(ra->sqes, ra->sqes_len);
+	}
+
+	if (ra->ring_fd >= 0)
+	{
+		close(ra->ring_fd);
+	}
+
+	ra->sq_ring = NULL;
+	ra->cq_ring = NULL;
+	ra->sqes = NULL;
+	ra->ring_fd = -1;
+}
+
+/* Sets up the rings by hand rather than depending upon liburing, failure is
+ * expected on old kernels and in sandboxes that filter the syscalls */
+static int uringSetup(struct difReadAhead * const ra)
+{
+	struct io_uring_params params;
+	unsigned char *sq;
+	unsigned char *cq;
+	void *map;
+
+	memset(&params, 0, sizeof(params));
+	ra->ring_fd = (int) syscall(__NR_io_uring_setup, (unsigned) ra->depth,
+		&params);
+
+	if (ra->ring_fd < 0)
+	{
+		ra->ring_fd = -1;
+
+		return -1;
+	}
+
+	ra->sq_ring_len = params.sq_off.array
+		+ (params.sq_entries * sizeof(unsigned));
+	ra->cq_ring_len = params.cq_off.cqes
+		+ (params.cq_entries * sizeof(struct io_uring_cqe));
+	ra->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+	{
+		ra->sq_ring_len = (ra->cq_ring_len > ra->sq_ring_len)
+			? ra->cq_ring_len : ra->sq_ring_len;
+		ra->cq_ring_len = ra->sq_ring_len;
+	}
+
+	if ((map = mmap(NULL, ra->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ra->ring_fd, IORING_OFF_SQ_RING))
+		== MAP_FAILED)
+	{
+		uringTeardown(ra);
+
+		return -1;
+	}
+
+	ra->sq_ring = map;
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+	{
+		ra->cq_ring = ra->sq_ring;
+	}
+	else if ((map = mmap(NULL, ra->cq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ra->ring_fd, IORING_OFF_CQ_RING))
+		== MAP_FAILED)
+	{
+		uringTeardown(ra);
+
+		return -1;
+	}
+	else
+	{
+		ra->cq_ring = map;
+	}
+
+	if ((map = mmap(NULL, ra->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ra->ring_fd, IORING_OFF_SQES))
+		== MAP_FAILED)
+	{
+		uringTeardown(ra);
+
+		return -1;
+	}
+
+	ra->sqes = map;
+	sq = ra->sq_ring;
+	cq = ra->cq_ring;
+	ra->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ra->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ra->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ra->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ra->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ra->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ra->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+/* A submission that fails leaves its sqe in the ring where the next enter
+ * would pick it up, so after the first failure nothing else is submitted and
+ * reads are finished synchronously while the ring is only reaped. */
+static int uringQueueRead(struct difReadAhead * const ra, const size_t index)
+{
+	struct difReadSlot * const slot = &ra->slots[index];
+	const unsigned tail = *ra->sq_tail;
+	const unsigned sqe_index = tail & *ra->sq_mask;
+	struct io_uring_sqe * const sqe = &ra->sqes[sqe_index];
+	const size_t want = slot->len - slot->done;
+	long ret;
+
+	if (ra->sq_failed != 0)
+	{
+		return -1;
+	}
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (uint64_t) (uintptr_t) (slot->data + slot->done);
+	sqe->len = (uint32_t) ((want > DIF_READ_CHUNK_MAX)
+		? DIF_READ_CHUNK_MAX : want);
+	sqe->off = (uint64_t) slot->done;
+	sqe->user_data = (uint64_t) index;
+	ra->sq_array[sqe_index] = sqe_index;
+	__atomic_store_n(ra->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, ra->ring_fd, 1, 0, 0, NULL, 0);
+	} while ((ret < 0) 
+	&& ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)));
+
+	if (ret != 1)
+	{
+		ra->sq_failed = 1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Handles every completion currently posted, blocking for at least one first
+ * if asked to. Errors, including kernels without IORING_OP_READ, fall back to
+ * finishing the slot with pread. */
+static void uringReap(struct difReadAhead * const ra, const int wait)
+{
+	unsigned head = *ra->cq_head;
+	long ret;
+
+	if (wait != 0)
+	{
+		do
+		{
+			ret = syscall(__NR_io_uring_enter, ra->ring_fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		} while ((ret < 0) && (errno == EINTR));
+	}
+
+	while (head != __atomic_load_n(ra->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		const struct io_uring_cqe * const cqe
+			= &ra->cqes[head & *ra->cq_mask];
+		const size_t index = (size_t) cqe->user_data;
+		const int res = cqe->res;
+		struct difReadSlot * const slot = &ra->slots[index];
+
+		__atomic_store_n(ra->cq_head, ++head, __ATOMIC_RELEASE);
+
+		if (res > 0)
+		{
+			slot->done += (size_t) res;
+
+			if ((slot->done < slot->len)
+			&& (uringQueueRead(ra, index) == 0))
+			{
+				continue;
+			}
+		}
+		else if (res == 0) /* Truncated since it was sized */
+		{
+			slot->len = slot->done;
+		}
+
+		readSlotFinish(ra, slot);
+	}
+}
+#endif /* DIF_USE_IO_URING */
+
+struct difReadAhead* readAheadNew(const size_t depth, difReadDone done,
+	void *ctx)
+{
+	struct difReadAhead *ra;
+	size_t i;
+
+	if ((depth == 0) || (done == NULL)
+	|| ((ra = calloc(1, sizeof(struct difReadAhead))) == NULL))
+	{
+		return NULL;
+	}
+
+	if ((ra->slots = calloc(depth, sizeof(struct difReadSlot))) == NULL)
+	{
+		free(ra);
+
+		return NULL;
+	}
+
+	for (i = 0; i < depth; i++)
+	{
+		ra->slots[i].fd = -1;
+	}
+
+	ra->depth = depth;
+	ra->done = done;
+	ra->ctx = ctx;
+
+#ifdef DIF_USE_IO_URING
+	ra->ring_fd = -1;
+	(void) uringSetup(ra);
+#endif /* DIF_USE_IO_URING */
+
+	return ra;
+}
+
+const char* readAheadMethod(const struct difReadAhead * const ra)
+{
+#ifdef DIF_USE_IO_URING
+	if ((ra != NULL) && (ra->ring_fd >= 0))
+	{
+		return "io_uring";
+	}
+#endif /* DIF_USE_IO_URING */
+#ifdef DIF_READ_AHEAD_POSIX
+	(void) ra;
+
+	return "fadvise";
+#else
+	(void) ra;
+
+	return "stdio";
+#endif /* !DIF_READ_AHEAD_POSIX */
+}
+
+#ifdef DIF_READ_AHEAD_POSIX
+/* Completes at least one outstanding read to make room in the window */
+static void readAheadRetire(struct difReadAhead * const ra)
+{
+#ifdef DIF_USE_IO_URING
+	if (ra->ring_fd >= 0)
+	{
+		uringReap(ra, 1);
+
+		return;
+	}
+#endif /* DIF_USE_IO_URING */
+
+	readSlotFinish(ra, &ra->slots[ra->head]);
+	ra->head = (ra->head + 1) % ra->depth;
+}
+#endif /* DIF_READ_AHEAD_POSIX */
+
+/* Returns -1 if the file couldn't be opened, the done callback has still been
+ * called for it in that case */
+int readAheadSubmit(struct difReadAhead *ra, const char * const path,
+	void *tag)
+{
+#ifdef DIF_READ_AHEAD_POSIX
+	struct difReadSlot *slot = NULL;
+	struct stat info;
+	size_t index;
+	int fd;
+
+	if ((ra == NULL) || (path == NULL))
+	{
+		return -1;
+	}
+
+	while (ra->pending == ra->depth)
+	{
+		readAheadRetire(ra);
+	}
+
+	index = (ra->head + ra->pending) % ra->depth;
+
+#ifdef DIF_USE_IO_URING
+	/* Completions come back in any order so look for any free slot */
+	if (ra->ring_fd >= 0)
+	{
+		for (index = 0; ra->slots[index].busy != 0; index++);
+	}
+#endif /* DIF_USE_IO_URING */
+
+	slot = &ra->slots[index];
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		ra->done(ra->ctx, tag, NULL, 0);
+
+		return -1;
+	}
+
+	if ((fstat(fd, &info) != 0) || (info.st_size <= 0)
+	|| ((slot->data = malloc((size_t) info.st_size)) == NULL))
+	{
+		close(fd);
+		ra->done(ra->ctx, tag, NULL, 0);
+
+		return -1;
+	}
+
+	slot->tag = tag;
+	slot->len = (size_t) info.st_size;
+	slot->done = 0;
+	slot->fd = fd;
+	slot->busy = 1;
+	ra->pending++;
+
+#ifdef DIF_USE_IO_URING
+	if (ra->ring_fd >= 0)
+	{
+		if (uringQueueRead(ra, index) != 0)
+		{
+			readSlotFinish(ra, slot);
+		}
+
+		return 0;
+	}
+#endif /* DIF_USE_IO_URING */
+
+#ifdef POSIX_FADV_WILLNEED
+	(void) posix_fadvise(fd, 0, info.st_size, POSIX_FADV_WILLNEED);
+#endif /* POSIX_FADV_WILLNEED */
+
+	return 0;
+#else
+	unsigned char *data = NULL;
+	size_t len;
+
+	if ((ra == NULL) || (path == NULL))
+	{
+		return -1;
+	}
+
+	if (readWholeFile(path, &data, &len) != 0)
+	{
+		ra->done(ra->ctx, tag, NULL, 0);
+
+		return -1;
+	}
+
+	ra->done(ra->ctx, tag, data, len);
+
+	return 0;
+#endif /* !DIF_READ_AHEAD_POSIX */
+}
+
+/* Blocks until every submitted read has been handed to the callback */
+void readAheadFinish(struct difReadAhead *ra)
+{
+	if (ra == NULL)
+	{
+		return;
+	}
+
+#ifdef DIF_READ_AHEAD_POSIX
+	while (ra->pending != 0)
+	{
+		readAheadRetire(ra);
+	}
+#endif /* DIF_READ_AHEAD_POSIX */
+}
+
+void readAheadFree(struct difReadAhead *ra)
+{
+	if (ra == NULL)
+	{
+		return;
+	}
+
+	readAheadFinish(ra);
+
+#ifdef DIF_USE_IO_URING
+	uringTeardown(ra);
+#endif /* DIF_USE_IO_URING */
+
+	free(ra->slots);
+	free(ra);
+}
+
+/* Synchronous counterpart used by blocking reader threads, on success data
+ * must be released with free() */
+int readWholeFile(const char * const path, unsigned char **data, 
+	size_t *len)
+{
+#ifdef DIF_READ_AHEAD_POSIX
+	struct stat info;
+	size_t done = 0;
+	int fd;
+
+	*data = NULL;
+	*len = 0;
+
+	if ((path == NULL) || ((fd = open(path, O_RDONLY)) < 0))
+	{
+		return -1;
+	}
+
+	if ((fstat(fd, &info) != 0) || (info.st_size <= 0)
+	|| ((*data = malloc((size_t) info.st_size)) == NULL))
+	{
+		close(fd);
+
+		return -1;
+	}
+
+	while (done < (size_t) info.st_size)
+	{
+		const ssize_t got = pread(fd, *data + done, 
+			(size_t) info.st_size - done, (off_t) done);
+
+		if ((got < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+
+		if (got <= 0)
+		{
+			break;
+		}
+
+		done += (size_t) got;
+	}
+
+	close(fd);
+
+	if (done == 0)
+	{
+		free(*data);
+		*data = NULL;
+
+		return -1;
+	}
+
+	*len = done;
+
+	return 0;
+#else
+	FILE *file;
+	long size;
+
+	*data = NULL;
+	*len = 0;
+
+	if ((path == NULL) || ((file = fopen(path, "rb")) == NULL))
+	{
+		return -1;
+	}
+
+	if ((fseek(file, 0, SEEK_END) != 0)
+	|| ((size = ftell(file)) <= 0)
+	|| (fseek(file, 0, SEEK_SET) != 0)
+	|| ((*data = malloc((size_t) size)) == NULL)
+	|| ((*len = fread(*data, 1, (size_t) size, file)) == 0))
+	{
+		fclose(file);
+		free(*data);
+		*data = NULL;
+
+		return -1;
+	}
+
+	fclose(file);
+
+	return 0;
+#endif /* !DIF_READ_AHEAD_POSIX */
+}
+
+/* As readWholeFile but for a stream whose size isn't known up front, such as
+ * a pipe, read until its end */
+int readWholeStream(FILE * const in, unsigned char **data, size_t *len)
+{
+	size_t cap = 64 * 1024;
+	size_t got;
+
+	*len = 0;
+
+	if ((in == NULL) || ((*data = malloc(cap)) == NULL))
+	{
+		return -1;
+	}
+
+	while ((got = fread(*data + *len, 1, cap - *len, in)) != 0)
+	{
+		*len += got;
+
+		if (*len == cap)
+		{
+			unsigned char * const tmp = realloc(*data, cap * 2);
+
+			if (tmp == NULL)
+			{
+				break;
+			}
+
+			*data = tmp;
+			cap *= 2;
+		}
+	}
+
+	if ((ferror(in)) || (!feof(in)) || (*len == 0))
+	{
+		free(*data);
+		*data = NULL;
+		*len = 0;
+
+		return -1;
+	}
+
+	return 0;
+}
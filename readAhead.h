@@ -0,0 +1,26 @@
+#ifndef DIF_READ_AHEAD_H
+#define DIF_READ_AHEAD_H
+
+#include <stddef.h> /* size_t */
+#include <stdio.h>  /* FILE */
+
+/* Called once per submitted path from the thread driving the read ahead, ctx
+ * is as given to readAheadNew. On success data holds the whole file and must
+ * be released with free(), on failure data is NULL. */
+typedef void (*difReadDone)(void *ctx, void *tag, unsigned char *data, 
+	size_t len);
+
+struct difReadAhead;
+
+struct difReadAhead* readAheadNew(const size_t depth, difReadDone done,
+	void *ctx);
+int readAheadSubmit(struct difReadAhead *ra, const char * const path,
+	void *tag);
+void readAheadFinish(struct difReadAhead *ra);
+void readAheadFree(struct difReadAhead *ra);
+const char* readAheadMethod(const struct difReadAhead * const ra);
+int readWholeFile(const char * const path, unsigned char **data, 
+	size_t *len);
+int readWholeStream(FILE * const in, unsigned char **data, size_t *len);
+
+#endif /* DIF_READ_AHEAD_H */
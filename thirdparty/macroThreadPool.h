@@ -6,6 +6,7 @@
 #include <stddef.h>  /* NULL, size_t */
 #include <limits.h>  /* INT_MAX */
 #include <pthread.h> /* lots, can use a windows wrapper */
+#include <stdatomic.h>
 
 #define MTP_BOOL    int
 #define MTP_TRUE    1
@@ -21,6 +22,224 @@
 #define MTP_FREE free
 #endif
 
+/* Keeps the producer and consumer cursors off one another's cache line */
+#define MTP_CACHE_LINE 64
+
+#define MTP_THREAD_ID_DEFINITIONS(NAME)                                      \
+                                                                             \
+static pthread_once_t NAME##_id_once = PTHREAD_ONCE_INIT;                    \
+static pthread_key_t NAME##_id_key;                                          \
+                                                                             \
+static void NAME##IdDestroy(void *key)                                       \
+{                                                                            \
+	MTP_FREE(key);                                                       \
+}                                                                            \
+                                                                             \
+static void NAME##IdKeyCreate(void)                                          \
+{                                                                            \
+	pthread_key_create(&(NAME##_id_key), NAME##IdDestroy);               \
+}                                                                            \
+                                                                             \
+static void NAME##IdCreate(void)                                             \
+{                                                                            \
+	static pthread_mutex_t inc_mutex = PTHREAD_MUTEX_INITIALIZER;        \
+	static volatile unsigned int runner = 0;                             \
+	signed int *thread_id = MTP_CALLOC(1, sizeof(signed int));           \
+	                                                                     \
+	pthread_mutex_lock(&(inc_mutex));                                    \
+	*thread_id = (runner <= INT_MAX) ? (signed int) runner++ : -1;       \
+	pthread_mutex_unlock(&(inc_mutex));                                  \
+	pthread_once(&(NAME##_id_once), NAME##IdKeyCreate);                  \
+	pthread_setspecific(NAME##_id_key, thread_id);                       \
+}                                                                            \
+                                                                             \
+int NAME##GetThreadId(void)                                                  \
+{                                                                            \
+	int * const ret = pthread_getspecific(NAME##_id_key);                \
+	                                                                     \
+	return (ret != NULL) ? (*ret) : (-1);                                \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_THREAD_ID_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* Called by ParallelFor with each range of indices, end being exclusive */
+typedef void (*mtpRangeFunc)(void *ctx, size_t begin, size_t end);
+
+/* A loop shared out by ParallelFor. Threads claim the next grain indices with
+ * a single fetch and add, so nothing is queued per range, and the caller is
+ * woken once every index is done. Whichever of the caller and the helper jobs
+ * lets go of it last frees it, a helper only dequeued after the loop is over
+ * just finds nothing left to claim. */
+struct mtpRange
+{
+	_Atomic size_t next;
+	char    pad_next[MTP_CACHE_LINE - sizeof(size_t)];
+	_Atomic size_t done;
+	_Atomic size_t refs;
+	size_t  begin;
+	size_t  len;
+	size_t  grain;
+	mtpRangeFunc func;
+	void   *ctx;
+	pthread_mutex_t mutex;
+	pthread_cond_t finished;
+};
+
+static inline struct mtpRange* mtpRangeNew(const size_t begin,
+	const size_t end, const size_t grain, mtpRangeFunc func, void *ctx,
+	const size_t refs)
+{
+	struct mtpRange *range;
+
+	if ((range = MTP_CALLOC(1, sizeof(struct mtpRange))) == NULL)
+	{
+		return NULL;
+	}
+
+	atomic_init(&(range->next), 0);
+	atomic_init(&(range->done), 0);
+	atomic_init(&(range->refs), refs);
+	range->begin = begin;
+	range->len = end - begin;
+	range->grain = grain;
+	range->func = func;
+	range->ctx = ctx;
+	pthread_mutex_init(&(range->mutex), NULL);
+	pthread_cond_init(&(range->finished), NULL);
+
+	return range;
+}
+
+static inline void mtpRangeRelease(struct mtpRange *range)
+{
+	if (atomic_fetch_sub(&(range->refs), 1) == 1)
+	{
+		pthread_mutex_destroy(&(range->mutex));
+		pthread_cond_destroy(&(range->finished));
+		MTP_FREE(range);
+	}
+}
+
+/* Claims and runs ranges until there are none left */
+static inline void mtpRangeRun(struct mtpRange *range)
+{
+	size_t first;
+
+	while ((first = atomic_fetch_add(&(range->next), range->grain))
+		< range->len)
+	{
+		const size_t count = ((range->len - first) < range->grain)
+			? (range->len - first) : range->grain;
+
+		range->func(range->ctx, range->begin + first,
+			range->begin + first + count);
+
+		if ((atomic_fetch_add(&(range->done), count) + count)
+			== range->len)
+		{
+			pthread_mutex_lock(&(range->mutex));
+			pthread_cond_broadcast(&(range->finished));
+			pthread_mutex_unlock(&(range->mutex));
+		}
+	}
+}
+
+static inline void mtpRangeWait(struct mtpRange *range)
+{
+	pthread_mutex_lock(&(range->mutex));
+
+	while (atomic_load(&(range->done)) != range->len)
+	{
+		pthread_cond_wait(&(range->finished), &(range->mutex));
+	}
+
+	pthread_mutex_unlock(&(range->mutex));
+}
+
+/* Elements of the given size from the start of a cache line to the next point
+ * where one ends on a line boundary too, so that ranges of a multiple of them
+ * over a line aligned array never share a line */
+static inline size_t mtpLineGrain(const size_t size)
+{
+	size_t left = MTP_CACHE_LINE;
+	size_t right = (size == 0) ? 1 : size;
+
+	while (right != 0)
+	{
+		const size_t rem = left % right;
+
+		left = right;
+		right = rem;
+	}
+
+	return MTP_CACHE_LINE / left;
+}
+
+/* Needs the variant's TryEnqueueArgs. The calling thread takes ranges too and
+ * only as many helpers as there are other threads are queued, those that
+ * don't fit in the ring are simply left out. func runs on the caller as well
+ * as the pool's threads, so a GetThreadId there may be -1. */
+#define MTP_PARALLEL_FOR_DEFINITIONS(NAME)                                   \
+                                                                             \
+void NAME##ParallelFor(struct NAME##ThreadPool *pool, const size_t begin,    \
+	const size_t end, const size_t grain, mtpRangeFunc func, void *ctx)  \
+{                                                                            \
+	const size_t step = (grain == 0) ? 1 : grain;                        \
+	struct NAME##ThreadArgs tmp = {0};                                   \
+	struct mtpRange *range = NULL;                                       \
+	size_t ranges, helpers, i;                                           \
+                                                                             \
+	if (end <= begin)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+                                                                             \
+	ranges = ((end - begin) / step) + (((end - begin) % step) != 0);     \
+	helpers = (pool->num_threads < ranges) ? pool->num_threads : ranges; \
+	helpers = (helpers == 0) ? 0 : helpers - 1;                          \
+                                                                             \
+	if ((helpers == 0) || ((range = mtpRangeNew(begin, end, step, func,  \
+		ctx, helpers + 1)) == NULL))                                 \
+	{                                                                    \
+		for (i = begin; (end - i) > step; i += step)                 \
+		{                                                            \
+			func(ctx, i, i + step);                              \
+		}                                                            \
+                                                                             \
+		func(ctx, i, end);                                           \
+                                                                             \
+		return;                                                      \
+	}                                                                    \
+                                                                             \
+	tmp.range = range;                                                   \
+                                                                             \
+	for (i = 0; i < helpers; i++)                                        \
+	{                                                                    \
+		if (NAME##TryEnqueueArgs(pool, &tmp) == MTP_FALSE)           \
+		{                                                            \
+			atomic_fetch_sub(&(range->refs), helpers - i);       \
+                                                                             \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+                                                                             \
+	mtpRangeRun(range);                                                  \
+	mtpRangeWait(range);                                                 \
+	mtpRangeRelease(range);                                              \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_PARALLEL_FOR_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#if defined(MTP_LOCK_FREE) && defined(MTP_WORK_STEALING)
+#error "Define at most one of MTP_LOCK_FREE and MTP_WORK_STEALING"
+#endif
+
+#if !defined(MTP_LOCK_FREE) && !defined(MTP_WORK_STEALING)
+
 #define MTP_ENQUEUE_JOB(type, queue, in)                                     \
 do                                                                           \
 {                                                                            \
@@ -41,6 +260,30 @@ do                                                                           \
 	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
 } while (0)
 
+#define MTP_TRY_ENQUEUE_JOB(type, queue, in, ret)                            \
+do                                                                           \
+{                                                                            \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	if (((queue)->read_curs == (queue)->write_curs)                      \
+	&& ((queue)->jobs_waiting != 0))                                     \
+	{                                                                    \
+		(ret) = MTP_FALSE;                                           \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		((type *) (queue)->jobs)[(queue)->write_curs++]              \
+			= *((type *) in);                                    \
+		(queue)->write_curs %= (queue)->jobs_max;                    \
+		(queue)->jobs_waiting++;                                     \
+		(ret) = MTP_TRUE;                                            \
+		                                                             \
+		pthread_cond_broadcast(&((queue)->has_jobs));                \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
 #define MTP_DEQUEUE_JOB(type, queue, out)                                    \
 do                                                                           \
 {                                                                            \
@@ -55,6 +298,7 @@ do                                                                           \
 	*((type *) out) = ((type *) (queue)->jobs)[(queue)->read_curs++];    \
 	(queue)->read_curs %= (queue)->jobs_max;                             \
 	(queue)->jobs_waiting--;                                             \
+	(queue)->jobs_working++;                                             \
 	pthread_cond_broadcast(&((queue)->has_room));                        \
 	                                                                     \
 	if ((queue)->jobs_waiting == 0)                                      \
@@ -72,6 +316,7 @@ do                                                                           \
 struct NAME##ThreadArgs                                                      \
 {                                                                            \
 	MTP_BOOL terminate;                                                  \
+	struct mtpRange *range; /* Set for a ParallelFor helper instead */   \
 	ElmType payload;                                                     \
 };                                                                           \
                                                                              \
@@ -88,7 +333,6 @@ struct NAME##JobQueue                                                        \
 	pthread_cond_t is_empty;                                             \
 	pthread_cond_t is_idle;                                              \
 	pthread_mutex_t ring_mutex;                                          \
-	pthread_mutex_t work_mutex;                                          \
 };                                                                           \
                                                                              \
 struct NAME##ThreadPool                                                      \
@@ -99,61 +343,93 @@ struct NAME##ThreadPool                                                      \
 };                                                                           \
                                                                              \
 void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in);            \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in);     \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count);                                                 \
+void NAME##ParallelFor(struct NAME##ThreadPool *pool, const size_t begin,    \
+	const size_t end, const size_t grain, mtpRangeFunc func, void *ctx); \
 void* NAME##ThreadRoutine(void *queue);                                      \
 struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
 	const size_t max_jobs);                                              \
 void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool);                 \
 void NAME##WaitOnIdle(struct NAME##ThreadPool *pool);                        \
                                                                              \
-enum {MTP_PROTOTYPE_DUMMY = 0}
+enum {NAME##_MTP_PROTOTYPE_DUMMY = 0}
 
 /* ----------------------------- MIND THE GAP ----------------------------- */
 
 #define MACRO_THREAD_POOL_DEFINITIONS(NAME, ElmType, ThreadFunc)             \
                                                                              \
-static pthread_once_t NAME##_id_once = PTHREAD_ONCE_INIT;                    \
-static pthread_key_t NAME##_id_key;                                          \
+MTP_THREAD_ID_DEFINITIONS(NAME);                                             \
                                                                              \
-static void NAME##IdDestroy(void *key)                                       \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
 {                                                                            \
-	MTP_FREE(key);                                                       \
-}                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+	tmp.payload   = in;                                                  \
                                                                              \
-static void NAME##IdKeyCreate(void)                                          \
-{                                                                            \
-	pthread_key_create(&(NAME##_id_key), NAME##IdDestroy);               \
+	MTP_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue, &tmp);         \
 }                                                                            \
                                                                              \
-static void NAME##IdCreate(void)                                             \
+static MTP_BOOL NAME##TryEnqueueArgs(struct NAME##ThreadPool *pool,          \
+	struct NAME##ThreadArgs *in)                                         \
 {                                                                            \
-	static pthread_mutex_t inc_mutex = PTHREAD_MUTEX_INITIALIZER;        \
-	static volatile unsigned int runner = 0;                             \
-	signed int *thread_id = MTP_CALLOC(1, sizeof(signed int));           \
-	                                                                     \
-	pthread_mutex_lock(&(inc_mutex));                                    \
-	*thread_id = (runner <= INT_MAX) ? (signed int) runner++ : -1;       \
-	pthread_mutex_unlock(&(inc_mutex));                                  \
-	pthread_once(&(NAME##_id_once), NAME##IdKeyCreate);                  \
-	pthread_setspecific(NAME##_id_key, thread_id);                       \
-}                                                                            \
+	MTP_BOOL ret;                                                        \
                                                                              \
-int NAME##GetThreadId(void)                                                  \
-{                                                                            \
-	int * const ret = pthread_getspecific(NAME##_id_key);                \
+	MTP_TRY_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue, in, ret);  \
 	                                                                     \
-	return (ret != NULL) ? (*ret) : (-1);                                \
+	return ret;                                                          \
 }                                                                            \
                                                                              \
-void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
+/* Returns MTP_FALSE rather than blocking if the ring is full, for jobs that \
+ * may be queued from the pool's own threads and could otherwise deadlock */ \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in)      \
 {                                                                            \
 	struct NAME##ThreadArgs tmp;                                         \
 	                                                                     \
 	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
 	tmp.payload   = in;                                                  \
                                                                              \
-	MTP_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue, &tmp);         \
+	return NAME##TryEnqueueArgs(pool, &tmp);                             \
+}                                                                            \
+                                                                             \
+/* Queues all of them under the one lock, only letting go of it to wait for  \
+ * room when the ring fills up */                                            \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count)                                                  \
+{                                                                            \
+	struct NAME##JobQueue * const queue = pool->queue;                   \
+	size_t i;                                                            \
+                                                                             \
+	pthread_mutex_lock(&(queue->ring_mutex));                            \
+                                                                             \
+	for (i = 0; i < count; i++)                                          \
+	{                                                                    \
+		while ((queue->read_curs == queue->write_curs)               \
+		&& (queue->jobs_waiting != 0))                               \
+		{                                                            \
+			pthread_cond_broadcast(&(queue->has_jobs));          \
+			pthread_cond_wait(&(queue->has_room),                \
+				&(queue->ring_mutex));                       \
+		}                                                            \
+                                                                             \
+		queue->jobs[queue->write_curs].terminate = MTP_FALSE;        \
+		queue->jobs[queue->write_curs].range = NULL;                 \
+		queue->jobs[queue->write_curs].payload = in[i];              \
+		queue->write_curs = (queue->write_curs + 1)                  \
+			% queue->jobs_max;                                   \
+		queue->jobs_waiting++;                                       \
+	}                                                                    \
+                                                                             \
+	pthread_cond_broadcast(&(queue->has_jobs));                          \
+	pthread_mutex_unlock(&(queue->ring_mutex));                          \
 }                                                                            \
                                                                              \
+MTP_PARALLEL_FOR_DEFINITIONS(NAME);                                          \
+                                                                             \
 void* NAME##ThreadRoutine(void *queue)                                       \
 {                                                                            \
 	struct NAME##ThreadArgs args = {0};                                  \
@@ -172,21 +448,25 @@ void* NAME##ThreadRoutine(void *queue)                                       \
 			pthread_exit(0);                                     \
 		}                                                            \
 		                                                             \
-		pthread_mutex_lock(&(tmp->work_mutex));                      \
-		tmp->jobs_working++;                                         \
-		pthread_mutex_unlock(&(tmp->work_mutex));                    \
-		                                                             \
-		ThreadFunc(args.payload);                                    \
+		if (args.range != NULL)                                      \
+		{                                                            \
+			mtpRangeRun(args.range);                             \
+			mtpRangeRelease(args.range);                         \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			ThreadFunc(args.payload);                            \
+		}                                                            \
 		                                                             \
-		pthread_mutex_lock(&(tmp->work_mutex));                      \
+		pthread_mutex_lock(&(tmp->ring_mutex));                      \
 		tmp->jobs_working--;                                         \
 		                                                             \
-		if (tmp->jobs_working == 0)                                  \
+		if ((tmp->jobs_working == 0) && (tmp->jobs_waiting == 0))    \
 		{                                                            \
 			pthread_cond_broadcast(&(tmp->is_idle));             \
 		}                                                            \
 		                                                             \
-		pthread_mutex_unlock(&(tmp->work_mutex));                    \
+		pthread_mutex_unlock(&(tmp->ring_mutex));                    \
 	}                                                                    \
 }                                                                            \
                                                                              \
@@ -234,7 +514,6 @@ struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
 	pthread_cond_init(&(pool->queue->is_empty), NULL);                   \
 	pthread_cond_init(&(pool->queue->is_idle),  NULL);                   \
 	pthread_mutex_init(&(pool->queue->ring_mutex), NULL);                \
-	pthread_mutex_init(&(pool->queue->work_mutex), NULL);                \
 	                                                                     \
 	for (i = 0; i < num_threads; i++)                                    \
 	{                                                                    \
@@ -299,30 +578,1187 @@ void NAME##WaitOnIdle(struct NAME##ThreadPool *pool)                         \
                                                                              \
 	pthread_mutex_lock(&(queue->ring_mutex));                            \
 	                                                                     \
-	while (queue->jobs_waiting != 0)                                     \
+	while ((queue->jobs_waiting != 0) || (queue->jobs_working != 0))     \
 	{                                                                    \
-		pthread_cond_wait(&(queue->is_empty), &(queue->ring_mutex)); \
+		pthread_cond_wait(&(queue->is_idle), &(queue->ring_mutex));  \
 	}                                                                    \
 	                                                                     \
 	pthread_mutex_unlock(&(queue->ring_mutex));                          \
-	pthread_mutex_lock(&(queue->work_mutex));                            \
-	                                                                     \
-	while (queue->jobs_working != 0)                                     \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_DEFINITIONS_DUMMY = 0}
+
+#else /* MTP_LOCK_FREE || MTP_WORK_STEALING */
+
+/* Lock-free variant, selected by defining MTP_LOCK_FREE before inclusion. The
+ * ring is a bounded MPMC queue of sequence numbered slots, a slot's sequence
+ * telling producers and consumers alike whose turn it is, so pushing and
+ * popping is a single compare and swap on the uncontended path. Threads that
+ * find nothing to do spin and yield briefly and then park on an event count, a
+ * futex on Linux and a condition variable elsewhere, which only costs the
+ * waker a system call when somebody is actually asleep. The jobs queued or
+ * running are kept in a single atomic counter for WaitOnIdle. Needs C11
+ * atomics. */
+
+#include <stdint.h>  /* uint32_t, intptr_t */
+#include <sched.h>   /* sched_yield */
+
+#ifdef __linux__
+#include <unistd.h>      /* syscall */
+#include <sys/syscall.h> /* SYS_futex */
+#include <linux/futex.h> /* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+#endif /* __linux__ */
+
+/* Empty polls before a thread starts yielding */
+#ifndef MTP_SPIN_LIMIT
+#define MTP_SPIN_LIMIT 16
+#endif
+
+/* Yields before a thread parks, after spinning */
+#ifndef MTP_YIELD_LIMIT
+#define MTP_YIELD_LIMIT 16
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MTP_CPU_RELAX() __asm__ __volatile__ ("pause")
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define MTP_CPU_RELAX() __asm__ __volatile__ ("yield")
+#else
+#define MTP_CPU_RELAX() ((void) 0)
+#endif
+
+/* Spins with a pause for a while, then yields for a while in case whoever
+ * is wanted is waiting on the same core, returns MTP_FALSE once it's time to
+ * park instead */
+static inline MTP_BOOL mtpBackoff(const size_t spins)
+{
+	if (spins < MTP_SPIN_LIMIT)
+	{
+		MTP_CPU_RELAX();
+
+		return MTP_TRUE;
+	}
+
+	if (spins < (MTP_SPIN_LIMIT + MTP_YIELD_LIMIT))
+	{
+		sched_yield();
+
+		return MTP_TRUE;
+	}
+
+	return MTP_FALSE;
+}
+
+/* A waiter registers, reads the count, rechecks whatever it is waiting on and
+ * only then sleeps, for as long as the count is unchanged. A notifier bumps
+ * the count after making its change, but only if somebody is registered. The
+ * fences on both sides mean one of the two always sees the other's change. */
+struct mtpEvent
+{
+	_Atomic uint32_t count;
+	_Atomic unsigned int waiters;
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif /* !__linux__ */
+};
+
+static inline void mtpEventInit(struct mtpEvent *ev)
+{
+	atomic_init(&(ev->count), 0);
+	atomic_init(&(ev->waiters), 0);
+#ifndef __linux__
+	pthread_mutex_init(&(ev->mutex), NULL);
+	pthread_cond_init(&(ev->cond), NULL);
+#endif /* !__linux__ */
+}
+
+static inline void mtpEventDestroy(struct mtpEvent *ev)
+{
+#ifndef __linux__
+	pthread_mutex_destroy(&(ev->mutex));
+	pthread_cond_destroy(&(ev->cond));
+#else
+	(void) ev;
+#endif /* !__linux__ */
+}
+
+static inline uint32_t mtpEventPrepare(struct mtpEvent *ev)
+{
+	atomic_fetch_add(&(ev->waiters), 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return atomic_load(&(ev->count));
+}
+
+static inline void mtpEventCancel(struct mtpEvent *ev)
+{
+	atomic_fetch_sub(&(ev->waiters), 1);
+}
+
+static inline void mtpEventWait(struct mtpEvent *ev, const uint32_t key)
+{
+#ifdef __linux__
+	while (atomic_load(&(ev->count)) == key)
+	{
+		syscall(SYS_futex, (uint32_t *) &(ev->count),
+			FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_lock(&(ev->mutex));
+
+	while (atomic_load(&(ev->count)) == key)
+	{
+		pthread_cond_wait(&(ev->cond), &(ev->mutex));
+	}
+
+	pthread_mutex_unlock(&(ev->mutex));
+#endif /* __linux__ */
+
+	mtpEventCancel(ev);
+}
+
+static inline void mtpEventNotify(struct mtpEvent *ev, const MTP_BOOL all)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&(ev->waiters), memory_order_relaxed) == 0)
+	{
+		return;
+	}
+
+	atomic_fetch_add(&(ev->count), 1);
+
+#ifdef __linux__
+	syscall(SYS_futex, (uint32_t *) &(ev->count), FUTEX_WAKE_PRIVATE,
+		(all == MTP_TRUE) ? INT_MAX : 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&(ev->mutex));
+
+	if (all == MTP_TRUE)
+	{
+		pthread_cond_broadcast(&(ev->cond));
+	}
+	else
+	{
+		pthread_cond_signal(&(ev->cond));
+	}
+
+	pthread_mutex_unlock(&(ev->mutex));
+#endif /* __linux__ */
+}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* The ring, and the pending count WaitOnIdle watches, as both the lock-free
+ * and the work stealing variants use them */
+#define MTP_RING_DEFINITIONS(NAME)                                           \
+                                                                             \
+static MTP_BOOL NAME##RingPush(struct NAME##JobQueue *queue,                 \
+	const struct NAME##ThreadArgs *in)                                   \
+{                                                                            \
+	size_t pos = atomic_load_explicit(&(queue->write_curs),              \
+		memory_order_relaxed);                                       \
+	struct NAME##JobSlot *slot;                                          \
+                                                                             \
+	for (;;)                                                             \
 	{                                                                    \
-		pthread_cond_wait(&(queue->is_idle), &(queue->work_mutex));  \
+		intptr_t diff;                                               \
+                                                                             \
+		slot = &(queue->jobs[pos & queue->jobs_mask]);               \
+		diff = (intptr_t) atomic_load_explicit(&(slot->seq),         \
+			memory_order_acquire) - (intptr_t) pos;              \
+                                                                             \
+		if (diff == 0)                                               \
+		{                                                            \
+			if (atomic_compare_exchange_weak_explicit(           \
+				&(queue->write_curs), &pos, pos + 1,         \
+				memory_order_relaxed, memory_order_relaxed)) \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		else if (diff < 0)                                           \
+		{                                                            \
+			return MTP_FALSE;                                    \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			pos = atomic_load_explicit(&(queue->write_curs),     \
+				memory_order_relaxed);                       \
+		}                                                            \
+	}                                                                    \
+                                                                             \
+	slot->args = *in;                                                    \
+	atomic_store_explicit(&(slot->seq), pos + 1, memory_order_release);  \
+	mtpEventNotify(&(queue->has_jobs), MTP_FALSE);                       \
+                                                                             \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+                                                                             \
+static MTP_BOOL NAME##RingPop(struct NAME##JobQueue *queue,                  \
+	struct NAME##ThreadArgs *out)                                        \
+{                                                                            \
+	size_t pos = atomic_load_explicit(&(queue->read_curs),               \
+		memory_order_relaxed);                                       \
+	struct NAME##JobSlot *slot;                                          \
+                                                                             \
+	for (;;)                                                             \
+	{                                                                    \
+		intptr_t diff;                                               \
+                                                                             \
+		slot = &(queue->jobs[pos & queue->jobs_mask]);               \
+		diff = (intptr_t) atomic_load_explicit(&(slot->seq),         \
+			memory_order_acquire) - (intptr_t) (pos + 1);        \
+                                                                             \
+		if (diff == 0)                                               \
+		{                                                            \
+			if (atomic_compare_exchange_weak_explicit(           \
+				&(queue->read_curs), &pos, pos + 1,          \
+				memory_order_relaxed, memory_order_relaxed)) \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		else if (diff < 0)                                           \
+		{                                                            \
+			return MTP_FALSE;                                    \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			pos = atomic_load_explicit(&(queue->read_curs),      \
+				memory_order_relaxed);                       \
+		}                                                            \
+	}                                                                    \
+                                                                             \
+	*out = slot->args;                                                   \
+	atomic_store_explicit(&(slot->seq), pos + queue->jobs_mask + 1,      \
+		memory_order_release);                                       \
+	mtpEventNotify(&(queue->has_room), MTP_FALSE);                       \
+                                                                             \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+                                                                             \
+static void NAME##RingPut(struct NAME##JobQueue *queue,                      \
+	const struct NAME##ThreadArgs *in)                                   \
+{                                                                            \
+	size_t spins = 0;                                                    \
+                                                                             \
+	while (NAME##RingPush(queue, in) == MTP_FALSE)                       \
+	{                                                                    \
+		uint32_t key;                                                \
+                                                                             \
+		if (mtpBackoff(spins++) == MTP_TRUE)                         \
+		{                                                            \
+			continue;                                            \
+		}                                                            \
+                                                                             \
+		key = mtpEventPrepare(&(queue->has_room));                   \
+                                                                             \
+		if (NAME##RingPush(queue, in) == MTP_TRUE)                   \
+		{                                                            \
+			mtpEventCancel(&(queue->has_room));                  \
+                                                                             \
+			return;                                              \
+		}                                                            \
+                                                                             \
+		mtpEventWait(&(queue->has_room), key);                       \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+static void NAME##JobDone(struct NAME##JobQueue *queue)                      \
+{                                                                            \
+	if (atomic_fetch_sub(&(queue->jobs_pending), 1) == 1)                \
+	{                                                                    \
+		mtpEventNotify(&(queue->is_idle), MTP_TRUE);                 \
 	}                                                                    \
-	                                                                     \
-	pthread_mutex_unlock(&(queue->work_mutex));                          \
 }                                                                            \
                                                                              \
-enum {MTP_DEFINITIONS_DUMMY = 0}
+void NAME##WaitOnIdle(struct NAME##ThreadPool *pool)                         \
+{                                                                            \
+	struct NAME##JobQueue *queue = pool->queue;                          \
+	size_t spins = 0;                                                    \
+                                                                             \
+	while (atomic_load(&(queue->jobs_pending)) != 0)                     \
+	{                                                                    \
+		uint32_t key;                                                \
+                                                                             \
+		if (mtpBackoff(spins++) == MTP_TRUE)                         \
+		{                                                            \
+			continue;                                            \
+		}                                                            \
+                                                                             \
+		key = mtpEventPrepare(&(queue->is_idle));                    \
+                                                                             \
+		if (atomic_load(&(queue->jobs_pending)) == 0)                \
+		{                                                            \
+			mtpEventCancel(&(queue->is_idle));                   \
+                                                                             \
+			return;                                              \
+		}                                                            \
+                                                                             \
+		mtpEventWait(&(queue->is_idle), key);                        \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_RING_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#ifndef MTP_WORK_STEALING
+
+#define MACRO_THREAD_POOL_PROTOTYPES(NAME, ElmType)                          \
+                                                                             \
+struct NAME##ThreadArgs                                                      \
+{                                                                            \
+	MTP_BOOL terminate;                                                  \
+	struct mtpRange *range; /* Set for a ParallelFor helper instead */   \
+	ElmType payload;                                                     \
+};                                                                           \
+                                                                             \
+struct NAME##JobSlot                                                         \
+{                                                                            \
+	_Atomic size_t seq;                                                  \
+	struct NAME##ThreadArgs args;                                        \
+};                                                                           \
+                                                                             \
+struct NAME##JobQueue                                                        \
+{                                                                            \
+	struct NAME##JobSlot *jobs;                                          \
+	size_t  jobs_mask;                                                   \
+	char    pad_write[MTP_CACHE_LINE];                                   \
+	_Atomic size_t write_curs;                                           \
+	char    pad_read[MTP_CACHE_LINE - sizeof(size_t)];                   \
+	_Atomic size_t read_curs;                                            \
+	char    pad_pending[MTP_CACHE_LINE - sizeof(size_t)];                \
+	_Atomic size_t jobs_pending;                                         \
+	struct mtpEvent has_jobs;                                            \
+	struct mtpEvent has_room;                                            \
+	struct mtpEvent is_idle;                                             \
+};                                                                           \
+                                                                             \
+struct NAME##ThreadPool                                                      \
+{                                                                            \
+	pthread_t *threads;                                                  \
+	size_t num_threads;                                                  \
+	struct NAME##JobQueue *queue;                                        \
+};                                                                           \
+                                                                             \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in);            \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in);     \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count);                                                 \
+void NAME##ParallelFor(struct NAME##ThreadPool *pool, const size_t begin,    \
+	const size_t end, const size_t grain, mtpRangeFunc func, void *ctx); \
+void* NAME##ThreadRoutine(void *queue);                                      \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs);                                              \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool);                 \
+void NAME##WaitOnIdle(struct NAME##ThreadPool *pool);                        \
+                                                                             \
+enum {NAME##_MTP_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_DEFINITIONS(NAME, ElmType, ThreadFunc)             \
+                                                                             \
+MTP_THREAD_ID_DEFINITIONS(NAME);                                             \
+MTP_RING_DEFINITIONS(NAME);                                                  \
+                                                                             \
+static void NAME##RingTake(struct NAME##JobQueue *queue,                     \
+	struct NAME##ThreadArgs *out)                                        \
+{                                                                            \
+	size_t spins = 0;                                                    \
+                                                                             \
+	while (NAME##RingPop(queue, out) == MTP_FALSE)                       \
+	{                                                                    \
+		uint32_t key;                                                \
+                                                                             \
+		if (mtpBackoff(spins++) == MTP_TRUE)                         \
+		{                                                            \
+			continue;                                            \
+		}                                                            \
+                                                                             \
+		key = mtpEventPrepare(&(queue->has_jobs));                   \
+                                                                             \
+		if (NAME##RingPop(queue, out) == MTP_TRUE)                   \
+		{                                                            \
+			mtpEventCancel(&(queue->has_jobs));                  \
+                                                                             \
+			return;                                              \
+		}                                                            \
+                                                                             \
+		mtpEventWait(&(queue->has_jobs), key);                       \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+	tmp.payload   = in;                                                  \
+                                                                             \
+	atomic_fetch_add(&(pool->queue->jobs_pending), 1);                   \
+	NAME##RingPut(pool->queue, &tmp);                                    \
+}                                                                            \
+                                                                             \
+static MTP_BOOL NAME##TryEnqueueArgs(struct NAME##ThreadPool *pool,          \
+	struct NAME##ThreadArgs *in)                                         \
+{                                                                            \
+	atomic_fetch_add(&(pool->queue->jobs_pending), 1);                   \
+                                                                             \
+	if (NAME##RingPush(pool->queue, in) == MTP_FALSE)                    \
+	{                                                                    \
+		NAME##JobDone(pool->queue);                                  \
+                                                                             \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+                                                                             \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+                                                                             \
+/* Returns MTP_FALSE rather than blocking if the ring is full, for jobs that \
+ * may be queued from the pool's own threads and could otherwise deadlock */ \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in)      \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+	tmp.payload   = in;                                                  \
+                                                                             \
+	return NAME##TryEnqueueArgs(pool, &tmp);                             \
+}                                                                            \
+                                                                             \
+/* The pending count is raised once for the lot */                           \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count)                                                  \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+	size_t i;                                                            \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+                                                                             \
+	atomic_fetch_add(&(pool->queue->jobs_pending), count);               \
+                                                                             \
+	for (i = 0; i < count; i++)                                          \
+	{                                                                    \
+		tmp.payload = in[i];                                         \
+		NAME##RingPut(pool->queue, &tmp);                            \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+MTP_PARALLEL_FOR_DEFINITIONS(NAME);                                          \
+                                                                             \
+void* NAME##ThreadRoutine(void *queue)                                       \
+{                                                                            \
+	struct NAME##JobQueue * const tmp = (struct NAME##JobQueue *) queue; \
+	struct NAME##ThreadArgs args = {0};                                  \
+                                                                             \
+	NAME##IdCreate();                                                    \
+                                                                             \
+	for (;;)                                                             \
+	{                                                                    \
+		NAME##RingTake(tmp, &args);                                  \
+                                                                             \
+		if (args.terminate == MTP_TRUE)                              \
+		{                                                            \
+			pthread_exit(0);                                     \
+		}                                                            \
+                                                                             \
+		if (args.range != NULL)                                      \
+		{                                                            \
+			mtpRangeRun(args.range);                             \
+			mtpRangeRelease(args.range);                         \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			ThreadFunc(args.payload);                            \
+		}                                                            \
+		NAME##JobDone(tmp);                                          \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs)                                               \
+{                                                                            \
+	struct NAME##ThreadPool *pool = NULL;                                \
+	size_t slots = 2;                                                    \
+	size_t i;                                                            \
+                                                                             \
+	while (slots < max_jobs)                                             \
+	{                                                                    \
+		slots <<= 1;                                                 \
+	}                                                                    \
+                                                                             \
+	if ((pool = MTP_CALLOC(1, sizeof(struct NAME##ThreadPool))) == NULL) \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	if ((pool->threads = MTP_CALLOC(num_threads, sizeof(pthread_t)))     \
+		== NULL)                                                     \
+	{                                                                    \
+		MTP_FREE(pool);                                              \
+                                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	if ((pool->queue = MTP_CALLOC(1, sizeof(struct NAME##JobQueue)))     \
+		== NULL)                                                     \
+	{                                                                    \
+		MTP_FREE(pool->threads);                                     \
+		MTP_FREE(pool);                                              \
+                                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	if ((pool->queue->jobs = MTP_CALLOC(slots,                           \
+		sizeof(struct NAME##JobSlot))) == NULL)                      \
+	{                                                                    \
+		MTP_FREE(pool->queue);                                       \
+		MTP_FREE(pool->threads);                                     \
+		MTP_FREE(pool);                                              \
+                                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	for (i = 0; i < slots; i++)                                          \
+	{                                                                    \
+		atomic_init(&(pool->queue->jobs[i].seq), i);                 \
+	}                                                                    \
+                                                                             \
+	pool->queue->jobs_mask = slots - 1;                                  \
+	atomic_init(&(pool->queue->write_curs), 0);                          \
+	atomic_init(&(pool->queue->read_curs), 0);                           \
+	atomic_init(&(pool->queue->jobs_pending), 0);                        \
+	mtpEventInit(&(pool->queue->has_jobs));                              \
+	mtpEventInit(&(pool->queue->has_room));                              \
+	mtpEventInit(&(pool->queue->is_idle));                               \
+                                                                             \
+	for (i = 0; i < num_threads; i++)                                    \
+	{                                                                    \
+		pthread_create(&pool->threads[i], NULL, NAME##ThreadRoutine, \
+			pool->queue);                                        \
+	}                                                                    \
+                                                                             \
+	pool->num_threads = num_threads;                                     \
+                                                                             \
+	return pool;                                                         \
+}                                                                            \
+                                                                             \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool)                  \
+{                                                                            \
+	size_t i;                                                            \
+	struct NAME##ThreadArgs arg = {0};                                   \
+                                                                             \
+	arg.terminate = MTP_TRUE;                                            \
+                                                                             \
+	if (pool == NULL)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+                                                                             \
+	if (pool->threads != NULL)                                           \
+	{                                                                    \
+		if ((pool->queue != NULL)                                    \
+		&& (pool->queue->jobs != NULL))                              \
+		{                                                            \
+			for (i = 0; i < pool->num_threads; i++)              \
+			{                                                    \
+				NAME##RingPut(pool->queue, &arg);            \
+			}                                                    \
+                                                                             \
+			for (i = 0; i < pool->num_threads; i++)              \
+			{                                                    \
+				pthread_join(pool->threads[i], NULL);        \
+			}                                                    \
+		}                                                            \
+                                                                             \
+		MTP_FREE(pool->threads);                                     \
+	}                                                                    \
+                                                                             \
+	if (pool->queue != NULL)                                             \
+	{                                                                    \
+		if (pool->queue->jobs != NULL)                               \
+		{                                                            \
+			mtpEventDestroy(&(pool->queue->has_jobs));           \
+			mtpEventDestroy(&(pool->queue->has_room));           \
+			mtpEventDestroy(&(pool->queue->is_idle));            \
+			MTP_FREE(pool->queue->jobs);                         \
+		}                                                            \
+                                                                             \
+		MTP_FREE(pool->queue);                                       \
+	}                                                                    \
+                                                                             \
+	MTP_FREE(pool);                                                      \
+	pool = NULL;                                                         \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_DEFINITIONS_DUMMY = 0}
+
+#else /* MTP_WORK_STEALING */
+
+/* Work stealing variant, selected by defining MTP_WORK_STEALING instead. Every
+ * thread also has a Chase-Lev deque of its own, jobs queued from inside one of
+ * the pool's jobs go onto the bottom of the running thread's deque rather than
+ * the shared ring. A thread takes the newest job from its own deque first,
+ * which keeps nested work hot in its cache, then from the ring, and only then
+ * steals the oldest job from the top of another thread's deque. Only the ring
+ * is bounded, deques grow as needed. */
+
+/* Jobs a deque holds before it first grows, a power of two */
+#ifndef MTP_DEQUE_INITIAL
+#define MTP_DEQUE_INITIAL 64
+#endif
+
+#define MACRO_THREAD_POOL_PROTOTYPES(NAME, ElmType)                          \
+                                                                             \
+struct NAME##ThreadArgs                                                      \
+{                                                                            \
+	MTP_BOOL terminate;                                                  \
+	struct mtpRange *range; /* Set for a ParallelFor helper instead */   \
+	ElmType payload;                                                     \
+};                                                                           \
+                                                                             \
+struct NAME##JobSlot                                                         \
+{                                                                            \
+	_Atomic size_t seq;                                                  \
+	struct NAME##ThreadArgs args;                                        \
+};                                                                           \
+                                                                             \
+/* A deque is only ever replaced by a larger copy, the arrays it outgrew are \
+ * kept until the pool is cleaned up as thieves may still be reading them */ \
+struct NAME##DequeArray                                                      \
+{                                                                            \
+	size_t mask;                                                         \
+	struct NAME##DequeArray *outgrown;                                   \
+	struct NAME##ThreadArgs jobs[];                                      \
+};                                                                           \
+                                                                             \
+struct NAME##JobQueue;                                                       \
+                                                                             \
+struct NAME##Worker                                                          \
+{                                                                            \
+	struct NAME##JobQueue *queue;                                        \
+	_Atomic(struct NAME##DequeArray *) deque;                            \
+	unsigned int seed;                                                   \
+	char    pad_top[MTP_CACHE_LINE];                                     \
+	_Atomic size_t top;                                                  \
+	char    pad_bottom[MTP_CACHE_LINE - sizeof(size_t)];                 \
+	_Atomic size_t bottom;                                               \
+	char    pad_end[MTP_CACHE_LINE - sizeof(size_t)];                    \
+};                                                                           \
+                                                                             \
+struct NAME##JobQueue                                                        \
+{                                                                            \
+	struct NAME##JobSlot *jobs;                                          \
+	size_t  jobs_mask;                                                   \
+	char    pad_write[MTP_CACHE_LINE];                                   \
+	_Atomic size_t write_curs;                                           \
+	char    pad_read[MTP_CACHE_LINE - sizeof(size_t)];                   \
+	_Atomic size_t read_curs;                                            \
+	char    pad_pending[MTP_CACHE_LINE - sizeof(size_t)];                \
+	_Atomic size_t jobs_pending;                                         \
+	struct mtpEvent has_jobs;                                            \
+	struct mtpEvent has_room;                                            \
+	struct mtpEvent is_idle;                                             \
+	struct NAME##Worker *workers;                                        \
+	size_t  num_workers;                                                 \
+};                                                                           \
+                                                                             \
+struct NAME##ThreadPool                                                      \
+{                                                                            \
+	pthread_t *threads;                                                  \
+	size_t num_threads;                                                  \
+	struct NAME##JobQueue *queue;                                        \
+};                                                                           \
+                                                                             \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in);            \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in);     \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count);                                                 \
+void NAME##ParallelFor(struct NAME##ThreadPool *pool, const size_t begin,    \
+	const size_t end, const size_t grain, mtpRangeFunc func, void *ctx); \
+void* NAME##ThreadRoutine(void *worker);                                     \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs);                                              \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool);                 \
+void NAME##WaitOnIdle(struct NAME##ThreadPool *pool);                        \
+                                                                             \
+enum {NAME##_MTP_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_DEFINITIONS(NAME, ElmType, ThreadFunc)             \
+                                                                             \
+MTP_THREAD_ID_DEFINITIONS(NAME);                                             \
+MTP_RING_DEFINITIONS(NAME);                                                  \
+                                                                             \
+/* The worker running on this thread, NULL outside of the pool */            \
+static _Thread_local struct NAME##Worker *NAME##_self = NULL;                \
+                                                                             \
+/* Only ever called by the deque's owner */                                  \
+static MTP_BOOL NAME##DequePush(struct NAME##Worker *worker,                 \
+	const struct NAME##ThreadArgs *in)                                   \
+{                                                                            \
+	const size_t bottom = atomic_load_explicit(&(worker->bottom),        \
+		memory_order_relaxed);                                       \
+	const size_t top = atomic_load_explicit(&(worker->top),              \
+		memory_order_acquire);                                       \
+	struct NAME##DequeArray *deque = atomic_load_explicit(               \
+		&(worker->deque), memory_order_relaxed);                     \
+                                                                             \
+	if ((bottom - top) > deque->mask)                                    \
+	{                                                                    \
+		const size_t size = 2 * (deque->mask + 1);                   \
+		struct NAME##DequeArray *grown;                              \
+		size_t i;                                                    \
+                                                                             \
+		if ((grown = MTP_CALLOC(1, sizeof(struct NAME##DequeArray)   \
+			+ (size * sizeof(struct NAME##ThreadArgs))))         \
+			== NULL)                                             \
+		{                                                            \
+			return MTP_FALSE;                                    \
+		}                                                            \
+                                                                             \
+		grown->mask = size - 1;                                      \
+		grown->outgrown = deque;                                     \
+                                                                             \
+		for (i = top; i != bottom; i++)                              \
+		{                                                            \
+			grown->jobs[i & grown->mask]                         \
+				= deque->jobs[i & deque->mask];              \
+		}                                                            \
+                                                                             \
+		atomic_store_explicit(&(worker->deque), grown,               \
+			memory_order_release);                               \
+		deque = grown;                                               \
+	}                                                                    \
+                                                                             \
+	deque->jobs[bottom & deque->mask] = *in;                             \
+	atomic_store_explicit(&(worker->bottom), bottom + 1,                 \
+		memory_order_release);                                       \
+	mtpEventNotify(&(worker->queue->has_jobs), MTP_FALSE);               \
+                                                                             \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+                                                                             \
+/* Only ever called by the deque's owner, the newest job first */            \
+static MTP_BOOL NAME##DequeTake(struct NAME##Worker *worker,                 \
+	struct NAME##ThreadArgs *out)                                        \
+{                                                                            \
+	const size_t bottom = atomic_load_explicit(&(worker->bottom),        \
+		memory_order_relaxed) - 1;                                   \
+	struct NAME##DequeArray * const deque = atomic_load_explicit(        \
+		&(worker->deque), memory_order_relaxed);                     \
+	MTP_BOOL ret = MTP_TRUE;                                             \
+	size_t top;                                                          \
+                                                                             \
+	atomic_store_explicit(&(worker->bottom), bottom,                     \
+		memory_order_relaxed);                                       \
+	atomic_thread_fence(memory_order_seq_cst);                           \
+	top = atomic_load_explicit(&(worker->top), memory_order_relaxed);    \
+                                                                             \
+	if ((intptr_t) (bottom - top) < 0)                                   \
+	{                                                                    \
+		atomic_store_explicit(&(worker->bottom), bottom + 1,         \
+			memory_order_relaxed);                               \
+                                                                             \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+                                                                             \
+	*out = deque->jobs[bottom & deque->mask];                            \
+                                                                             \
+	/* A thief may be after the last job too */                          \
+	if (bottom == top)                                                   \
+	{                                                                    \
+		if (!atomic_compare_exchange_strong_explicit(&(worker->top), \
+			&top, top + 1, memory_order_seq_cst,                 \
+			memory_order_relaxed))                               \
+		{                                                            \
+			ret = MTP_FALSE;                                     \
+		}                                                            \
+                                                                             \
+		atomic_store_explicit(&(worker->bottom), bottom + 1,         \
+			memory_order_relaxed);                               \
+	}                                                                    \
+                                                                             \
+	return ret;                                                          \
+}                                                                            \
+                                                                             \
+/* Called by any other thread, the oldest job first */                       \
+static MTP_BOOL NAME##DequeSteal(struct NAME##Worker *victim,                \
+	struct NAME##ThreadArgs *out)                                        \
+{                                                                            \
+	size_t top = atomic_load_explicit(&(victim->top),                    \
+		memory_order_acquire);                                       \
+	struct NAME##DequeArray *deque;                                      \
+	struct NAME##ThreadArgs job;                                         \
+	size_t bottom;                                                       \
+                                                                             \
+	atomic_thread_fence(memory_order_seq_cst);                           \
+	bottom = atomic_load_explicit(&(victim->bottom),                     \
+		memory_order_acquire);                                       \
+                                                                             \
+	if ((intptr_t) (bottom - top) <= 0)                                  \
+	{                                                                    \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+                                                                             \
+	deque = atomic_load_explicit(&(victim->deque),                       \
+		memory_order_acquire);                                       \
+	job = deque->jobs[top & deque->mask];                                \
+                                                                             \
+	if (!atomic_compare_exchange_strong_explicit(&(victim->top), &top,   \
+		top + 1, memory_order_seq_cst, memory_order_relaxed))        \
+	{                                                                    \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+                                                                             \
+	*out = job;                                                          \
+                                                                             \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+                                                                             \
+/* Own deque, then the ring, then every other deque once starting from a     \
+ * random one so that thieves spread out */                                  \
+static MTP_BOOL NAME##FindJob(struct NAME##Worker *self,                     \
+	struct NAME##ThreadArgs *out)                                        \
+{                                                                            \
+	struct NAME##JobQueue * const queue = self->queue;                   \
+	size_t start, i;                                                     \
+                                                                             \
+	if ((NAME##DequeTake(self, out) == MTP_TRUE)                         \
+	|| (NAME##RingPop(queue, out) == MTP_TRUE))                          \
+	{                                                                    \
+		return MTP_TRUE;                                             \
+	}                                                                    \
+                                                                             \
+	self->seed ^= self->seed << 13;                                      \
+	self->seed ^= self->seed >> 17;                                      \
+	self->seed ^= self->seed << 5;                                       \
+	start = self->seed % queue->num_workers;                             \
+                                                                             \
+	for (i = 0; i < queue->num_workers; i++)                             \
+	{                                                                    \
+		struct NAME##Worker * const victim = &(queue->workers[       \
+			(start + i) % queue->num_workers]);                  \
+                                                                             \
+		if ((victim != self)                                         \
+		&& (NAME##DequeSteal(victim, out) == MTP_TRUE))              \
+		{                                                            \
+			return MTP_TRUE;                                     \
+		}                                                            \
+	}                                                                    \
+                                                                             \
+	return MTP_FALSE;                                                    \
+}                                                                            \
+                                                                             \
+/* From inside one of the pool's own jobs the job goes onto the running      \
+ * thread's deque, from anywhere else onto the ring. It has to have been     \
+ * counted as pending already. */                                            \
+static void NAME##PutArgs(struct NAME##ThreadPool *pool,                     \
+	struct NAME##ThreadArgs *in)                                         \
+{                                                                            \
+	struct NAME##Worker * const self = NAME##_self;                      \
+                                                                             \
+	if ((self == NULL) || (self->queue != pool->queue))                  \
+	{                                                                    \
+		NAME##RingPut(pool->queue, in);                              \
+	}                                                                    \
+	else if (NAME##DequePush(self, in) == MTP_FALSE)                     \
+	{                                                                    \
+		/* Waiting on the ring from a worker could deadlock */       \
+		ThreadFunc(in->payload);                                     \
+		NAME##JobDone(pool->queue);                                  \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+static MTP_BOOL NAME##TryEnqueueArgs(struct NAME##ThreadPool *pool,          \
+	struct NAME##ThreadArgs *in)                                         \
+{                                                                            \
+	struct NAME##Worker * const self = NAME##_self;                      \
+                                                                             \
+	atomic_fetch_add(&(pool->queue->jobs_pending), 1);                   \
+                                                                             \
+	if (((self == NULL) || (self->queue != pool->queue))                 \
+		? (NAME##RingPush(pool->queue, in) == MTP_TRUE)              \
+		: (NAME##DequePush(self, in) == MTP_TRUE))                   \
+	{                                                                    \
+		return MTP_TRUE;                                             \
+	}                                                                    \
+                                                                             \
+	NAME##JobDone(pool->queue);                                          \
+                                                                             \
+	return MTP_FALSE;                                                    \
+}                                                                            \
+                                                                             \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+	tmp.payload   = in;                                                  \
+                                                                             \
+	atomic_fetch_add(&(pool->queue->jobs_pending), 1);                   \
+	NAME##PutArgs(pool, &tmp);                                           \
+}                                                                            \
+                                                                             \
+/* Returns MTP_FALSE rather than blocking if the ring is full, or a deque    \
+ * couldn't grow, leaving the caller to run the job itself */                \
+MTP_BOOL NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in)      \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+	tmp.payload   = in;                                                  \
+                                                                             \
+	return NAME##TryEnqueueArgs(pool, &tmp);                             \
+}                                                                            \
+                                                                             \
+/* The pending count is raised once for the lot */                           \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *in,     \
+	const size_t count)                                                  \
+{                                                                            \
+	struct NAME##ThreadArgs tmp;                                         \
+	size_t i;                                                            \
+                                                                             \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.range     = NULL;                                                \
+                                                                             \
+	atomic_fetch_add(&(pool->queue->jobs_pending), count);               \
+                                                                             \
+	for (i = 0; i < count; i++)                                          \
+	{                                                                    \
+		tmp.payload = in[i];                                         \
+		NAME##PutArgs(pool, &tmp);                                   \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+MTP_PARALLEL_FOR_DEFINITIONS(NAME);                                          \
+                                                                             \
+void* NAME##ThreadRoutine(void *worker)                                      \
+{                                                                            \
+	struct NAME##Worker * const self = (struct NAME##Worker *) worker;   \
+	struct NAME##ThreadArgs args = {0};                                  \
+	size_t spins = 0;                                                    \
+                                                                             \
+	NAME##IdCreate();                                                    \
+	NAME##_self = self;                                                  \
+                                                                             \
+	for (;;)                                                             \
+	{                                                                    \
+		uint32_t key;                                                \
+                                                                             \
+		if (NAME##FindJob(self, &args) == MTP_FALSE)                 \
+		{                                                            \
+			if (mtpBackoff(spins++) == MTP_TRUE)                 \
+			{                                                    \
+				continue;                                    \
+			}                                                    \
+                                                                             \
+			key = mtpEventPrepare(&(self->queue->has_jobs));     \
+                                                                             \
+			if (NAME##FindJob(self, &args) == MTP_FALSE)         \
+			{                                                    \
+				mtpEventWait(&(self->queue->has_jobs), key); \
+                                                                             \
+				continue;                                    \
+			}                                                    \
+                                                                             \
+			mtpEventCancel(&(self->queue->has_jobs));            \
+		}                                                            \
+                                                                             \
+		spins = 0;                                                   \
+                                                                             \
+		if (args.terminate == MTP_TRUE)                              \
+		{                                                            \
+			pthread_exit(0);                                     \
+		}                                                            \
+                                                                             \
+		if (args.range != NULL)                                      \
+		{                                                            \
+			mtpRangeRun(args.range);                             \
+			mtpRangeRelease(args.range);                         \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			ThreadFunc(args.payload);                            \
+		}                                                            \
+		NAME##JobDone(self->queue);                                  \
+	}                                                                    \
+}                                                                            \
+                                                                             \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs)                                               \
+{                                                                            \
+	struct NAME##ThreadPool *pool = NULL;                                \
+	struct NAME##JobQueue *queue;                                        \
+	size_t slots = 2;                                                    \
+	size_t i;                                                            \
+                                                                             \
+	while (slots < max_jobs)                                             \
+	{                                                                    \
+		slots <<= 1;                                                 \
+	}                                                                    \
+                                                                             \
+	if ((pool = MTP_CALLOC(1, sizeof(struct NAME##ThreadPool))) == NULL) \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	if (((pool->threads = MTP_CALLOC(num_threads, sizeof(pthread_t)))    \
+		== NULL)                                                     \
+	|| ((pool->queue = MTP_CALLOC(1, sizeof(struct NAME##JobQueue)))     \
+		== NULL))                                                    \
+	{                                                                    \
+		NAME##CleanupThreadPool(pool);                               \
+                                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	queue = pool->queue;                                                 \
+	atomic_init(&(queue->write_curs), 0);                                \
+	atomic_init(&(queue->read_curs), 0);                                 \
+	atomic_init(&(queue->jobs_pending), 0);                              \
+	mtpEventInit(&(queue->has_jobs));                                    \
+	mtpEventInit(&(queue->has_room));                                    \
+	mtpEventInit(&(queue->is_idle));                                     \
+                                                                             \
+	if (((queue->jobs = MTP_CALLOC(slots, sizeof(struct NAME##JobSlot))) \
+		== NULL)                                                     \
+	|| ((queue->workers = MTP_CALLOC(num_threads,                        \
+		sizeof(struct NAME##Worker))) == NULL))                      \
+	{                                                                    \
+		NAME##CleanupThreadPool(pool);                               \
+                                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+                                                                             \
+	queue->jobs_mask = slots - 1;                                        \
+                                                                             \
+	for (i = 0; i < slots; i++)                                          \
+	{                                                                    \
+		atomic_init(&(queue->jobs[i].seq), i);                       \
+	}                                                                    \
+                                                                             \
+	for (i = 0; i < num_threads; i++)                                    \
+	{                                                                    \
+		struct NAME##Worker * const worker = &(queue->workers[i]);   \
+		struct NAME##DequeArray *deque;                              \
+                                                                             \
+		if ((deque = MTP_CALLOC(1, sizeof(struct NAME##DequeArray)   \
+			+ (MTP_DEQUE_INITIAL                                 \
+			* sizeof(struct NAME##ThreadArgs)))) == NULL)        \
+		{                                                            \
+			NAME##CleanupThreadPool(pool);                       \
+                                                                             \
+			return NULL;                                         \
+		}                                                            \
+                                                                             \
+		deque->mask = MTP_DEQUE_INITIAL - 1;                         \
+		worker->queue = queue;                                       \
+		worker->seed = (unsigned int) i + 1;                         \
+		atomic_init(&(worker->deque), deque);                        \
+		atomic_init(&(worker->top), 0);                              \
+		atomic_init(&(worker->bottom), 0);                           \
+		queue->num_workers = i + 1;                                  \
+	}                                                                    \
+                                                                             \
+	for (i = 0; i < num_threads; i++)                                    \
+	{                                                                    \
+		pthread_create(&pool->threads[i], NULL, NAME##ThreadRoutine, \
+			&(queue->workers[i]));                               \
+	}                                                                    \
+                                                                             \
+	pool->num_threads = num_threads;                                     \
+                                                                             \
+	return pool;                                                         \
+}                                                                            \
+                                                                             \
+/* Also takes apart a pool NewThreadPool only got part way through */        \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool)                  \
+{                                                                            \
+	size_t i;                                                            \
+	struct NAME##ThreadArgs arg = {0};                                   \
+                                                                             \
+	arg.terminate = MTP_TRUE;                                            \
+                                                                             \
+	if (pool == NULL)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+                                                                             \
+	if (pool->threads != NULL)                                           \
+	{                                                                    \
+		for (i = 0; i < pool->num_threads; i++)                      \
+		{                                                            \
+			NAME##RingPut(pool->queue, &arg);                    \
+		}                                                            \
+                                                                             \
+		for (i = 0; i < pool->num_threads; i++)                      \
+		{                                                            \
+			pthread_join(pool->threads[i], NULL);                \
+		}                                                            \
+                                                                             \
+		MTP_FREE(pool->threads);                                     \
+	}                                                                    \
+                                                                             \
+	if (pool->queue != NULL)                                             \
+	{                                                                    \
+		for (i = 0; i < pool->queue->num_workers; i++)               \
+		{                                                            \
+			struct NAME##DequeArray *deque = atomic_load(        \
+				&(pool->queue->workers[i].deque));           \
+                                                                             \
+			while (deque != NULL)                                \
+			{                                                    \
+				struct NAME##DequeArray * const outgrown     \
+					= deque->outgrown;                   \
+                                                                             \
+				MTP_FREE(deque);                             \
+				deque = outgrown;                            \
+			}                                                    \
+		}                                                            \
+                                                                             \
+		if (pool->queue->workers != NULL)                            \
+		{                                                            \
+			MTP_FREE(pool->queue->workers);                      \
+		}                                                            \
+                                                                             \
+		if (pool->queue->jobs != NULL)                               \
+		{                                                            \
+			MTP_FREE(pool->queue->jobs);                         \
+		}                                                            \
+                                                                             \
+		mtpEventDestroy(&(pool->queue->has_jobs));                   \
+		mtpEventDestroy(&(pool->queue->has_room));                   \
+		mtpEventDestroy(&(pool->queue->is_idle));                    \
+		MTP_FREE(pool->queue);                                       \
+	}                                                                    \
+                                                                             \
+	MTP_FREE(pool);                                                      \
+	pool = NULL;                                                         \
+}                                                                            \
+                                                                             \
+enum {NAME##_MTP_DEFINITIONS_DUMMY = 0}
+
+#endif /* MTP_WORK_STEALING */
+
+#endif /* MTP_LOCK_FREE || MTP_WORK_STEALING */
 
 /* ----------------------------- MIND THE GAP ----------------------------- */
 
 #define MACRO_THREAD_POOL_COMPLETE(NAME, TYPE, FUNC) \
 MACRO_THREAD_POOL_PROTOTYPES(NAME, TYPE);            \
 MACRO_THREAD_POOL_DEFINITIONS(NAME, TYPE, FUNC);     \
-enum {MTP_COMPLETE_DUMMY = 0}
+enum {NAME##_MTP_COMPLETE_DUMMY = 0}
 
 #endif /* MACRO_THREAD_POOL_H */
 